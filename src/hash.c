@@ -27,6 +27,8 @@
 # include <config.h>
 #endif
 
+#include "sha1mb.h" // multi-buffer HMAC, used with all backends
+
 #if USE_BUILTIN_HASH // built-in / AVR -- TODO: check license of sha1.c
 #include <stdio.h>
 #include "oauth.h" // oauth_encode_base64
@@ -47,6 +49,54 @@ char *oauth_sign_hmac_sha1 (const char *m, const char *k) {
 	return(oauth_sign_hmac_sha1_raw (m, strlen(m), k, strlen(k)));
 }
 
+struct oauth_hmac_sha1 {
+	sha1nfo inner; ///< state after absorbing key ^ ipad
+	sha1nfo outer; ///< state after absorbing key ^ opad
+	uint32_t mb_inner[5], mb_outer[5]; ///< midstates for the multi-buffer engine
+	int extended; ///< 'inner' has absorbed a message prefix (see oauth_hmac_sha1_extend)
+};
+
+oauth_hmac_sha1 *oauth_hmac_sha1_new (const char *k, const size_t kl) {
+	oauth_hmac_sha1 *h = (oauth_hmac_sha1*) xmalloc(sizeof(oauth_hmac_sha1));
+	// sha1_initHmac() leaves the inner midstate and the padded key behind
+	sha1_initHmac(&h->inner, (const uint8_t*) k, kl);
+	sha1_init(&h->outer);
+	sha1_writeKeyPad(&h->outer, h->inner.keyBuffer, HMAC_OPAD);
+	memset(h->inner.keyBuffer, 0, BLOCK_LENGTH);
+	sha1mb_hmac_init(h->mb_inner, h->mb_outer, (const unsigned char*) k, kl);
+	h->extended = 0;
+	return h;
+}
+
+oauth_hmac_sha1 *oauth_hmac_sha1_extend (const oauth_hmac_sha1 *h, const char *m, const size_t ml) {
+	oauth_hmac_sha1 *x;
+	if (!h) return NULL;
+	x = (oauth_hmac_sha1*) xmalloc(sizeof(oauth_hmac_sha1));
+	*x = *h;
+	sha1_write(&x->inner, m, ml);
+	x->extended = 1;
+	return x;
+}
+
+int oauth_hmac_sha1_digest (const oauth_hmac_sha1 *h, const char *m, const size_t ml, unsigned char *digest) {
+	sha1nfo s;
+	uint8_t inner[HASH_LENGTH];
+	if (!h) return 0;
+	s = h->inner;
+	sha1_write(&s, m, ml);
+	memcpy(inner, sha1_result(&s), HASH_LENGTH);
+	s = h->outer;
+	sha1_write(&s, (const char*) inner, HASH_LENGTH);
+	memcpy(digest, sha1_result(&s), HASH_LENGTH);
+	return HASH_LENGTH;
+}
+
+void oauth_hmac_sha1_free (oauth_hmac_sha1 *h) {
+	if (!h) return;
+	memset(h, 0, sizeof(oauth_hmac_sha1));
+	xfree(h);
+}
+
 char *oauth_body_hash_file(char *filename) {
 	size_t len=0;
 	char fb[BUFSIZ];
@@ -70,7 +120,7 @@ char *oauth_body_hash_file(char *filename) {
 char *oauth_body_hash_data(size_t length, const char *data) {
 	sha1nfo s;
 	sha1_init(&s);
-	for (;length--;) sha1_writebyte(&s, *data++);
+	sha1_write(&s, data, length);
 
 	unsigned char *dgst = xmalloc(HASH_LENGTH*sizeof(char)); // oauth_body_hash_encode frees the digest..
 	memcpy(dgst, sha1_result(&s), HASH_LENGTH);
@@ -189,6 +239,98 @@ looser:
 	return rv;
 }
 
+struct oauth_hmac_sha1 {
+	PK11Context *inner; ///< SHA1 digest context after absorbing key ^ ipad
+	PK11Context *outer; ///< SHA1 digest context after absorbing key ^ opad
+	uint32_t mb_inner[5], mb_outer[5]; ///< midstates for the multi-buffer engine
+	int extended; ///< 'inner' has absorbed a message prefix (see oauth_hmac_sha1_extend)
+};
+
+void oauth_hmac_sha1_free (oauth_hmac_sha1 *h) {
+	if (!h) return;
+	if (h->inner) PK11_DestroyContext(h->inner, PR_TRUE);
+	if (h->outer) PK11_DestroyContext(h->outer, PR_TRUE);
+	memset(h, 0, sizeof(oauth_hmac_sha1));
+	xfree(h);
+}
+
+oauth_hmac_sha1 *oauth_hmac_sha1_new (const char *k, const size_t kl) {
+	unsigned char  kb[64], pad[64];
+	int            i;
+	oauth_hmac_sha1 *h = (oauth_hmac_sha1*) xcalloc(1, sizeof(oauth_hmac_sha1));
+
+	oauth_init_nss();
+	memset(kb, 0, sizeof(kb));
+	if (kl > sizeof(kb)) {
+		if (PK11_HashBuf(SEC_OID_SHA1, kb, (unsigned char*) k, kl) != SECSuccess) goto looser;
+	} else {
+		memcpy(kb, k, kl);
+	}
+
+	h->inner = PK11_CreateDigestContext(SEC_OID_SHA1);
+	h->outer = PK11_CreateDigestContext(SEC_OID_SHA1);
+	if (!h->inner || !h->outer) goto looser;
+
+	for (i=0; i<64; i++) pad[i] = kb[i] ^ 0x36;
+	if (PK11_DigestBegin(h->inner) != SECSuccess) goto looser;
+	if (PK11_DigestOp(h->inner, pad, sizeof(pad)) != SECSuccess) goto looser;
+	for (i=0; i<64; i++) pad[i] = kb[i] ^ 0x5c;
+	if (PK11_DigestBegin(h->outer) != SECSuccess) goto looser;
+	if (PK11_DigestOp(h->outer, pad, sizeof(pad)) != SECSuccess) goto looser;
+	sha1mb_hmac_init(h->mb_inner, h->mb_outer, kb, sizeof(kb));
+	memset(kb, 0, sizeof(kb));
+	memset(pad, 0, sizeof(pad));
+	return h;
+
+looser:
+	memset(kb, 0, sizeof(kb));
+	memset(pad, 0, sizeof(pad));
+	oauth_hmac_sha1_free(h);
+	return NULL;
+}
+
+int oauth_hmac_sha1_digest (const oauth_hmac_sha1 *h, const char *m, const size_t ml, unsigned char *digest) {
+	PK11Context   *context = NULL;
+	unsigned char  inner[20];
+	unsigned int   len = 0;
+	int            rv = 0;
+
+	if (!h) return 0;
+	context = PK11_CloneContext(h->inner);
+	if (!context) goto looser;
+	if (PK11_DigestOp(context, (unsigned char*) m, ml) != SECSuccess) goto looser;
+	if (PK11_DigestFinal(context, inner, &len, sizeof inner) != SECSuccess) goto looser;
+	PK11_DestroyContext(context, PR_TRUE);
+
+	context = PK11_CloneContext(h->outer);
+	if (!context) goto looser;
+	if (PK11_DigestOp(context, inner, sizeof inner) != SECSuccess) goto looser;
+	if (PK11_DigestFinal(context, digest, &len, 20) != SECSuccess) goto looser;
+	rv = len;
+
+looser:
+	if (context) PK11_DestroyContext(context, PR_TRUE);
+	return rv;
+}
+
+oauth_hmac_sha1 *oauth_hmac_sha1_extend (const oauth_hmac_sha1 *h, const char *m, const size_t ml) {
+	oauth_hmac_sha1 *x;
+	if (!h) return NULL;
+	x = (oauth_hmac_sha1*) xcalloc(1, sizeof(oauth_hmac_sha1));
+	x->inner = PK11_CloneContext(h->inner);
+	x->outer = PK11_CloneContext(h->outer);
+	if (!x->inner || !x->outer) goto looser;
+	if (PK11_DigestOp(x->inner, (unsigned char*) m, ml) != SECSuccess) goto looser;
+	memcpy(x->mb_inner, h->mb_inner, sizeof(x->mb_inner));
+	memcpy(x->mb_outer, h->mb_outer, sizeof(x->mb_outer));
+	x->extended = 1;
+	return x;
+
+looser:
+	oauth_hmac_sha1_free(x);
+	return NULL;
+}
+
 char *oauth_sign_rsa_sha1 (const char *m, const char *k) {
 	PK11SlotInfo      *slot = NULL;
 	SECKEYPrivateKey  *pkey = NULL;
@@ -379,6 +521,102 @@ char *oauth_sign_hmac_sha1_raw (const char *m, const size_t ml, const char *k, c
 	return(oauth_encode_base64(resultlen, result));
 }
 
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+# define EVP_MD_CTX_new EVP_MD_CTX_create
+# define EVP_MD_CTX_free EVP_MD_CTX_destroy
+#endif
+
+struct oauth_hmac_sha1 {
+	EVP_MD_CTX *inner; ///< state after absorbing key ^ ipad
+	EVP_MD_CTX *outer; ///< state after absorbing key ^ opad
+	uint32_t mb_inner[5], mb_outer[5]; ///< midstates for the multi-buffer engine
+	int extended; ///< 'inner' has absorbed a message prefix (see oauth_hmac_sha1_extend)
+};
+
+/**
+ * a new digest context in the state of 'ctx'.
+ */
+static EVP_MD_CTX *oauth_hmac_sha1_dup (const EVP_MD_CTX *ctx) {
+	EVP_MD_CTX *x = EVP_MD_CTX_new();
+	if (x && !EVP_MD_CTX_copy_ex(x, ctx)) {
+		EVP_MD_CTX_free(x);
+		return NULL;
+	}
+	return x;
+}
+
+oauth_hmac_sha1 *oauth_hmac_sha1_new (const char *k, const size_t kl) {
+	unsigned char kb[SHA_CBLOCK], pad[SHA_CBLOCK];
+	int i, ok;
+	oauth_hmac_sha1 *h = (oauth_hmac_sha1*) xmalloc(sizeof(oauth_hmac_sha1));
+
+	memset(kb, 0, sizeof(kb));
+	if (kl > SHA_CBLOCK) EVP_Digest(k, kl, kb, NULL, EVP_sha1(), NULL);
+	else memcpy(kb, k, kl);
+
+	h->inner = EVP_MD_CTX_new();
+	h->outer = EVP_MD_CTX_new();
+	ok = h->inner && h->outer
+		&& EVP_DigestInit_ex(h->inner, EVP_sha1(), NULL)
+		&& EVP_DigestInit_ex(h->outer, EVP_sha1(), NULL);
+	for (i=0; i<SHA_CBLOCK; i++) pad[i] = kb[i] ^ 0x36;
+	ok = ok && EVP_DigestUpdate(h->inner, pad, SHA_CBLOCK);
+	for (i=0; i<SHA_CBLOCK; i++) pad[i] = kb[i] ^ 0x5c;
+	ok = ok && EVP_DigestUpdate(h->outer, pad, SHA_CBLOCK);
+	sha1mb_hmac_init(h->mb_inner, h->mb_outer, kb, sizeof(kb));
+	h->extended = 0;
+
+	memset(kb, 0, sizeof(kb));
+	memset(pad, 0, sizeof(pad));
+	if (!ok) {
+		oauth_hmac_sha1_free(h);
+		return NULL;
+	}
+	return h;
+}
+
+oauth_hmac_sha1 *oauth_hmac_sha1_extend (const oauth_hmac_sha1 *h, const char *m, const size_t ml) {
+	oauth_hmac_sha1 *x;
+	if (!h) return NULL;
+	x = (oauth_hmac_sha1*) xmalloc(sizeof(oauth_hmac_sha1));
+	*x = *h;
+	x->inner = oauth_hmac_sha1_dup(h->inner);
+	x->outer = oauth_hmac_sha1_dup(h->outer);
+	x->extended = 1;
+	if (!x->inner || !x->outer || !EVP_DigestUpdate(x->inner, m, ml)) {
+		oauth_hmac_sha1_free(x);
+		return NULL;
+	}
+	return x;
+}
+
+int oauth_hmac_sha1_digest (const oauth_hmac_sha1 *h, const char *m, const size_t ml, unsigned char *digest) {
+	EVP_MD_CTX *ctx;
+	unsigned char inner[SHA_DIGEST_LENGTH];
+	int ok;
+	if (!h || !(ctx = EVP_MD_CTX_new())) return 0;
+	ok = EVP_MD_CTX_copy_ex(ctx, h->inner)
+		&& EVP_DigestUpdate(ctx, m, ml)
+		&& EVP_DigestFinal_ex(ctx, inner, NULL)
+		&& EVP_MD_CTX_copy_ex(ctx, h->outer)
+		&& EVP_DigestUpdate(ctx, inner, SHA_DIGEST_LENGTH)
+		&& EVP_DigestFinal_ex(ctx, digest, NULL);
+	EVP_MD_CTX_free(ctx);
+	memset(inner, 0, sizeof(inner));
+	return ok ? SHA_DIGEST_LENGTH : 0;
+}
+
+void oauth_hmac_sha1_free (oauth_hmac_sha1 *h) {
+	if (!h) return;
+	if (h->inner) EVP_MD_CTX_free(h->inner);
+	if (h->outer) EVP_MD_CTX_free(h->outer);
+	memset(h, 0, sizeof(oauth_hmac_sha1));
+	xfree(h);
+}
+
 #include <openssl/evp.h>
 #include <openssl/x509.h>
 #include <openssl/x509v3.h>
@@ -491,4 +729,39 @@ char *oauth_body_hash_data(size_t length, const char *data) {
 
 #endif
 
+/* multi-buffer HMAC - shared by all backends */
+
+int oauth_hmac_sha1_digest_multi (const oauth_hmac_sha1 * const *h,
+		const char * const *m, const size_t *ml, unsigned char *digest, int n) {
+	const uint32_t *inner[64], *outer[64];
+	int i, j;
+	if (!h || !m || !ml || !digest || n < 0) return 0;
+	for (i=0; i < n && h[i] && !h[i]->extended; i++) ;
+	if (i < n) {
+		// the engine starts every message at the key midstate
+		for (i=0; i < n; i++)
+			if (oauth_hmac_sha1_digest(h[i], m[i], ml[i], digest + 20*i) != 20) return 0;
+		return n;
+	}
+	for (i=0; i < n; i += 64) {
+		int g = n - i < 64 ? n - i : 64;
+		for (j=0; j < g; j++) {
+			if (!h[i+j]) return 0;
+			inner[j] = h[i+j]->mb_inner;
+			outer[j] = h[i+j]->mb_outer;
+		}
+		sha1mb_hmac(inner, outer, (const unsigned char * const*) (m+i), ml+i, digest + 20*i, g);
+	}
+	return n;
+}
+
+int oauth_hmac_sha1_lanes (void) {
+	return sha1mb_lanes();
+}
+
+int oauth_hmac_sha1_select_lanes (int max) {
+	return sha1mb_select(max);
+}
+
+
 // vi: sts=2 sw=2 ts=2
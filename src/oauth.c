@@ -38,243 +38,27 @@
 #include <string.h>
 #include <time.h>
 #include <math.h>
-#include <ctype.h> // isxdigit
+#include <ctype.h> // toupper
+#include <stdint.h>
 
 #include "xmalloc.h"
 #include "oauth.h"
+#include "oauth_codec.h"
 
-#ifndef WIN32 // getpid() on POSIX systems
+#ifndef WIN32 // getpid(), sched_yield() on POSIX systems
 #include <sys/types.h>
 #include <unistd.h>
+#include <sched.h>
+#include <errno.h>
+#include <fcntl.h>    // shm_open() for the shared replay cache
+#include <signal.h>   // kill()
+#include <sys/mman.h>
+#include <sys/stat.h>
 #else
 #define snprintf _snprintf
 #define strncasecmp strnicmp
 #endif
 
-/**
- * Base64 encode one byte
- */
-char oauth_b64_encode(unsigned char u) {
-  if(u < 26)  return 'A'+u;
-  if(u < 52)  return 'a'+(u-26);
-  if(u < 62)  return '0'+(u-52);
-  if(u == 62) return '+';
-  return '/';
-}
-
-/**
- * Decode a single base64 character.
- */
-unsigned char oauth_b64_decode(char c) {
-  if(c >= 'A' && c <= 'Z') return(c - 'A');
-  if(c >= 'a' && c <= 'z') return(c - 'a' + 26);
-  if(c >= '0' && c <= '9') return(c - '0' + 52);
-  if(c == '+')             return 62;
-  return 63;
-}
-
-/**
- * Return TRUE if 'c' is a valid base64 character, otherwise FALSE
- */
-int oauth_b64_is_base64(char c) {
-  if((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
-     (c >= '0' && c <= '9') || (c == '+')             ||
-     (c == '/')             || (c == '=')) {
-    return 1;
-  }
-  return 0;
-}
-
-/**
- * Base64 encode and return size data in 'src'. The caller must free the
- * returned string.
- *
- * @param size The size of the data in src
- * @param src The data to be base64 encode
- * @return encoded string otherwise NULL
- */
-char *oauth_encode_base64(int size, const unsigned char *src) {
-	int i;
-	char *out, *p;
-
-	if(!src) return NULL;
-	if(!size) size= strlen((char *)src);
-	out= (char*) xcalloc(sizeof(char), size*4/3+4);
-	p= out;
-
-	for(i=0; i<size; i+=3) {
-		unsigned char b1=0, b2=0, b3=0, b4=0, b5=0, b6=0, b7=0;
-		b1= src[i];
-		if(i+1<size) b2= src[i+1];
-		if(i+2<size) b3= src[i+2];
-
-		b4= b1>>2;
-		b5= ((b1&0x3)<<4)|(b2>>4);
-		b6= ((b2&0xf)<<2)|(b3>>6);
-		b7= b3&0x3f;
-
-		*p++= oauth_b64_encode(b4);
-		*p++= oauth_b64_encode(b5);
-
-		if(i+1<size) *p++= oauth_b64_encode(b6);
-		else *p++= '=';
-
-		if(i+2<size) *p++= oauth_b64_encode(b7);
-		else *p++= '=';
-	}
-	return out;
-}
-
-/**
- * Decode the base64 encoded string 'src' into the memory pointed to by
- * 'dest'.
- *
- * @param dest Pointer to memory for holding the decoded string.
- * Must be large enough to receive the decoded string.
- * @param src A base64 encoded string.
- * @return the length of the decoded string if decode
- * succeeded otherwise 0.
- */
-int oauth_decode_base64(unsigned char *dest, const char *src) {
-	if(src && *src) {
-		unsigned char *p= dest;
-		int k, l= strlen(src)+1;
-		unsigned char *buf= (unsigned char*) xcalloc(sizeof(unsigned char), l);
-
-		/* Ignore non base64 chars as per the POSIX standard */
-		for(k=0, l=0; src[k]; k++) {
-			if(oauth_b64_is_base64(src[k])) {
-				buf[l++]= src[k];
-			}
-		}
-
-		for(k=0; k<l; k+=4) {
-			char c1='A', c2='A', c3='A', c4='A';
-			unsigned char b1=0, b2=0, b3=0, b4=0;
-			c1= buf[k];
-
-			if(k+1<l) c2= buf[k+1];
-			if(k+2<l) c3= buf[k+2];
-			if(k+3<l) c4= buf[k+3];
-
-			b1= oauth_b64_decode(c1);
-			b2= oauth_b64_decode(c2);
-			b3= oauth_b64_decode(c3);
-			b4= oauth_b64_decode(c4);
-
-			*p++=((b1<<2)|(b2>>4) );
-
-			if(c3 != '=') *p++=(((b2&0xf)<<4)|(b3>>2) );
-			if(c4 != '=') *p++=(((b3&0x3)<<6)|b4 );
-		}
-		xfree(buf);
-		dest[p-dest]='\0';
-		return(p-dest);
-	}
-	return 0;
-}
-
-/**
- * Escape 'string' according to RFC3986 and
- * http://oauth.net/core/1.0/#encoding_parameters.
- *
- * @param string The data to be encoded
- * @return encoded string otherwise NULL
- * The caller must free the returned string.
- */
-char *oauth_url_escape(const char *string) {
-	size_t alloc, newlen;
-	char *ns = NULL, *testing_ptr = NULL;
-	unsigned char in;
-	size_t strindex=0;
-	size_t length;
-
-	if (!string) return xstrdup("");
-
-	alloc = strlen(string)+1;
-	newlen = alloc;
-
-	ns = (char*) xmalloc(alloc);
-
-	length = alloc-1;
-	while(length--) {
-		in = *string;
-
-		switch(in){
-			case '0': case '1': case '2': case '3': case '4':
-			case '5': case '6': case '7': case '8': case '9':
-			case 'a': case 'b': case 'c': case 'd': case 'e':
-			case 'f': case 'g': case 'h': case 'i': case 'j':
-			case 'k': case 'l': case 'm': case 'n': case 'o':
-			case 'p': case 'q': case 'r': case 's': case 't':
-			case 'u': case 'v': case 'w': case 'x': case 'y': case 'z':
-			case 'A': case 'B': case 'C': case 'D': case 'E':
-			case 'F': case 'G': case 'H': case 'I': case 'J':
-			case 'K': case 'L': case 'M': case 'N': case 'O':
-			case 'P': case 'Q': case 'R': case 'S': case 'T':
-			case 'U': case 'V': case 'W': case 'X': case 'Y': case 'Z':
-			case '_': case '~': case '.': case '-':
-				ns[strindex++]=in;
-				break;
-			default:
-				newlen += 2; /* this'll become a %XX */
-				if(newlen > alloc) {
-					alloc *= 2;
-					testing_ptr = (char*) xrealloc(ns, alloc);
-					ns = testing_ptr;
-				}
-				snprintf(&ns[strindex], 4, "%%%02X", in);
-				strindex+=3;
-				break;
-		}
-		string++;
-	}
-	ns[strindex]=0;
-	return ns;
-}
-
-#ifndef ISXDIGIT
-# define ISXDIGIT(x) (isxdigit((int) ((unsigned char)x)))
-#endif
-
-/**
- * Parse RFC3986 encoded 'string' back to  unescaped version.
- *
- * @param string The data to be unescaped
- * @param olen unless NULL the length of the returned string is stored there.
- * @return decoded string or NULL
- * The caller must free the returned string.
- */
-char *oauth_url_unescape(const char *string, size_t *olen) {
-	size_t alloc, strindex=0;
-	char *ns = NULL;
-	unsigned char in;
-	long hex;
-
-	if (!string) return NULL;
-	alloc = strlen(string)+1;
-	ns = (char*) xmalloc(alloc);
-
-	while(--alloc > 0) {
-		in = *string;
-		if(('%' == in) && ISXDIGIT(string[1]) && ISXDIGIT(string[2])) {
-			char hexstr[3]; // '%XX'
-			hexstr[0] = string[1];
-			hexstr[1] = string[2];
-			hexstr[2] = 0;
-			hex = strtol(hexstr, NULL, 16);
-			in = (unsigned char)hex; /* hex is always < 256 */
-			string+=2;
-			alloc-=2;
-		}
-		ns[strindex++] = in;
-		string++;
-	}
-	ns[strindex]=0;
-	if(olen) *olen = strindex;
-	return ns;
-}
-
 /**
  * returns plaintext signature for the given key.
  *
@@ -325,6 +109,69 @@ char *oauth_catenc(int len, ...) {
 	return(rv);
 }
 
+int oauth_split_spans(const char *src, size_t len, short qesc, oauth_span *spans, int max) {
+	// characters that make a key or value differ from its unescaped version
+	const unsigned char esc = CODEC_PCT | ((qesc&1) ? CODEC_PLS : 0) | ((qesc&2) ? 0 : CODEC_SOH);
+	size_t i = 0;
+	int n = 0;
+	while (i < len) {
+		const size_t k = i;
+		size_t eq = 0;
+		unsigned char seen = 0, kseen = 0;
+		int haseq = 0;
+		for (;;) {
+			i += codec_span_scan(src + i, len - i, &seen);
+			if (i >= len || src[i] != '=') break;
+			if (!haseq) {
+				haseq = 1;
+				eq = i;
+				kseen = seen;
+				seen = 0;
+			}
+			i++;
+		}
+		if (i > k) {
+			if (n < max) {
+				oauth_span *sp = &spans[n];
+				sp->koff = k;
+				sp->klen = (haseq ? eq : i) - k;
+				sp->voff = haseq ? eq + 1 : i;
+				sp->vlen = i - sp->voff;
+				sp->flags = haseq ? OAUTH_SPAN_HAS_VALUE : 0;
+				if (haseq ? (kseen & esc) : (seen & esc)) sp->flags |= OAUTH_SPAN_KEY_ESCAPED;
+				if (haseq && (seen & esc)) sp->flags |= OAUTH_SPAN_VALUE_ESCAPED;
+			}
+			n++;
+		}
+		i++; // skip the delimiter
+	}
+	return n;
+}
+
+/**
+ * copy 'len' bytes of 'src' to 'dst' applying the rules of
+ * \ref oauth_split_post_paramters: '+' is a space if (qesc&1), '\001'
+ * is an alias for '&' unless (qesc&2), and %-sequences are decoded if
+ * 'unescape' is set. 'dst' must hold 'len' bytes and may be 'src'.
+ *
+ * @return number of bytes written
+ */
+static size_t oauth_span_copy(char *dst, const char *src, size_t len, short qesc, int unescape) {
+	char *p;
+	if (dst != src) memcpy(dst, src, len);
+	for (p = dst; !(qesc&2) && (p = memchr(p, '\001', dst+len-p)); ) *p++ = '&';
+	if (unescape) {
+		// '+' represents a space, in a URL query string
+		return codec_url_unescape_to(dst, dst, len, (qesc&1) ? OAUTH_UNESCAPE_PLUS : 0);
+	}
+	for (p = dst; (qesc&1) && (p = memchr(p, '+', dst+len-p)); ) *p++ = ' ';
+	return len;
+}
+
+size_t oauth_span_unescape(const char *src, size_t len, short qesc, char *dst) {
+	return oauth_span_copy(dst, src, len, qesc, 1);
+}
+
 /**
  * splits the given url into a parameter array.
  * (see \ref oauth_serialize_url and \ref oauth_serialize_url_parameters for the reverse)
@@ -349,62 +196,50 @@ char *oauth_catenc(int len, ...) {
  * @return number of parameter(s) in array.
  */
 int oauth_split_post_paramters(const char *url, char ***argv, short qesc) {
-	int argc=0;
-	char *token, *tmp, *t1;
-#ifdef HAVE_STRTOK_R
-	char *tok_buf;
-#endif
+	oauth_span stack[32], *sp = stack;
+	size_t len;
+	int n, i, argc=0;
+
 	if (!argv) return 0;
 	if (!url) return 0;
-	t1=xstrdup(url);
-
-	// '+' represents a space, in a URL query string
-	while ((qesc&1) && (tmp=strchr(t1,'+'))) *tmp=' ';
-
-	tmp=t1;
-#ifdef HAVE_STRTOK_R
-	while((token=strtok_r(tmp, "&?", &tok_buf)))
-#else
-	while((token=strtok(tmp, "&?")))
-#endif
-	{
-		if(!strncasecmp("oauth_signature=",token,16)) continue;
-		(*argv)=(char**) xrealloc(*argv,sizeof(char*)*(argc+1));
-		while (!(qesc&2) && (tmp=strchr(token,'\001'))) *tmp='&';
-		if (argc>0 || (qesc&4))
-			(*argv)[argc]=oauth_url_unescape(token, NULL);
-		else
-			(*argv)[argc]=xstrdup(token);
-		if (argc==0 && strstr(token, ":/")) {
+	len = strlen(url);
+	n = oauth_split_spans(url, len, qesc, sp, 32);
+	if (n > 32) {
+		sp = (oauth_span*) xmalloc(n * sizeof(oauth_span));
+		oauth_split_spans(url, len, qesc, sp, n);
+	}
+	if (n) (*argv)=(char**) xrealloc(*argv,sizeof(char*)*n);
+
+	for (i=0; i<n; i++) {
+		const char *token = url + sp[i].koff;
+		const size_t tl = sp[i].voff + sp[i].vlen - sp[i].koff;
+		char *d, *tmp;
+		size_t dl;
+		if (tl >= 16 && !strncasecmp("oauth_signature=",token,16)) continue;
+		d = (char*) xmalloc(tl + 2);
+		dl = oauth_span_copy(d, token, tl, qesc, argc>0 || (qesc&4));
+		d[dl] = '\0';
+		if (argc==0 && (tmp=strstr(d, ":/"))) {
 			// HTTP does not allow empty absolute paths, so the URL
 			// 'http://example.com' is equivalent to 'http://example.com/' and should
 			// be treated as such for the purposes of OAuth signing (rfc2616, section 3.2.1)
 			// see http://groups.google.com/group/oauth/browse_thread/thread/c44b6f061bfd98c?hl=en
-			char *slash=strstr(token, ":/");
-			while (slash && *(++slash) == '/')  ; // skip slashes eg /xxx:[\/]*/
-#if 0
-			// skip possibly unescaped slashes in the userinfo - they're not allowed by RFC2396 but have been seen.
-			// the hostname/IP may only contain alphanumeric characters - so we're safe there.
-			if (slash && strchr(slash,'@')) slash=strchr(slash,'@');
-#endif
-			if (slash && !strchr(slash,'/')) {
+			while (*(++tmp) == '/')  ; // skip slashes eg /xxx:[\/]*/
+			if (!strchr(tmp,'/')) {
 #ifdef DEBUG_OAUTH
-				fprintf(stderr, "\nliboauth: added trailing slash to URL: '%s'\n\n", token);
+				fprintf(stderr, "\nliboauth: added trailing slash to URL: '%s'\n\n", d);
 #endif
-				xfree((*argv)[argc]);
-				(*argv)[argc]= (char*) xmalloc(sizeof(char)*(2+strlen(token)));
-				strcpy((*argv)[argc],token);
-				strcat((*argv)[argc],"/");
+				d[dl++] = '/';
+				d[dl] = '\0';
 			}
 		}
-		if (argc==0 && (tmp=strstr((*argv)[argc],":80/"))) {
+		if (argc==0 && (tmp=strstr(d,":80/"))) {
 			memmove(tmp, tmp+3, strlen(tmp+2));
 		}
-		tmp=NULL;
-		argc++;
+		(*argv)[argc++] = d;
 	}
 
-	xfree(t1);
+	if (sp != stack) xfree(sp);
 	return argc;
 }
 
@@ -439,68 +274,97 @@ char *oauth_serialize_url (int argc, int start, char **argv) {
  * @return url string needs to be freed by the caller.
  */
 char *oauth_serialize_url_sep (int argc, int start, char **argv, char *sep, int mod) {
-	char  *tmp, *t1;
-	int i;
-	int first=1;
-	int seplen=strlen(sep);
-	char *query = (char*) xmalloc(sizeof(char));
-	*query='\0';
-	for(i=start; i< argc; i++) {
-		int len = 0;
-		if ((mod&1)==1 && (strncmp(argv[i],"oauth_",6) == 0 || strncmp(argv[i],"x_oauth_",8) == 0) ) continue;
-		if ((mod&2)==2 && (strncmp(argv[i],"oauth_",6) != 0 && strncmp(argv[i],"x_oauth_",8) != 0) && i!=0) continue;
-
-		len+=strlen(query);
-
-		if (i==start && i==0 && strstr(argv[i], ":/")) {
-			tmp=xstrdup(argv[i]);
-#if 1 // encode white-space in the base-url
-			while ((t1=strchr(tmp,' '))) {
-# if 0
-				*t1='+';
-# else
-				size_t off = t1-tmp;
-				char *t2 = (char*) xmalloc(sizeof(char)*(3+strlen(tmp)));
-				strcpy(t2, tmp);
-				strcpy(t2+off+2, tmp+off);
-				*(t2+off)='%'; *(t2+off+1)='2'; *(t2+off+2)='0';
-				xfree(tmp);
-				tmp=t2;
-# endif
-#endif
+	return oauth_serialize_url_sep2(argc, start, argv, sep, mod, NULL);
+}
+
+/**
+ * true if the array element is an [x_]oauth_ parameter.
+ */
+static int oauth_is_oauth_param(const char *arg) {
+	return (strncmp(arg,"oauth_",6) == 0 || strncmp(arg,"x_oauth_",8) == 0);
+}
+
+/**
+ * serialize (or if 'p' is NULL only measure) a single element
+ * for oauth_serialize_url_sep2().
+ *
+ * @param url 1: the element is the base URL - only white-space is escaped.
+ * @return number of bytes written (or needed)
+ */
+static size_t oauth_serialize_element(char *p, const char *arg, int url, int mod) {
+	const char *eq;
+	size_t len, kl;
+	if (url) {
+		// encode white-space in the base-url
+		const char *sp;
+		if (!p) {
+			len = strlen(arg);
+			for (sp = arg; (sp = strchr(sp, ' ')); sp++) len += 2;
+			return len;
+		}
+		len = 0;
+		while ((sp = strchr(arg, ' '))) {
+			memcpy(p+len, arg, sp-arg);
+			len += sp-arg;
+			memcpy(p+len, "%20", 3);
+			len += 3;
+			arg = sp+1;
+		}
+		kl = strlen(arg);
+		memcpy(p+len, arg, kl);
+		return len + kl;
+	}
+	if (!(eq = strchr(arg, '='))) {
+		// see http://oauth.net/core/1.0/#anchor14
+		// escape parameter names and arguments but not the '='
+		kl = strlen(arg);
+		if (!p) return codec_url_escape_len(arg, kl) + 1;
+		len = codec_url_escape_to(p, arg, kl);
+		p[len++] = '=';
+		return len;
+	}
+	kl = eq-arg;
+	if (!p) return codec_url_escape_len(arg, kl) + 1
+		+ codec_url_escape_len(eq+1, strlen(eq+1)) + (mod&4?2:0);
+	len = codec_url_escape_to(p, arg, kl);
+	p[len++] = '=';
+	if (mod&4) p[len++] = '"';
+	len += codec_url_escape_to(p+len, eq+1, strlen(eq+1));
+	if (mod&4) p[len++] = '"';
+	return len;
+}
+
+char *oauth_serialize_url_sep2 (int argc, int start, char **argv, const char *sep, int mod, size_t *olen) {
+	char *query;
+	size_t len = 0, seplen = strlen(sep);
+	int i, pass;
+
+	// 1st pass: measure, 2nd pass: write
+	for (pass=0, query=NULL; pass<2; pass++) {
+		int first=1;
+		if (pass) query = (char*) xmalloc(len+1);
+		len = 0;
+		for(i=start; i< argc; i++) {
+			int url = 0;
+			if ((mod&1)==1 && oauth_is_oauth_param(argv[i])) continue;
+			if ((mod&2)==2 && !oauth_is_oauth_param(argv[i]) && i!=0) continue;
+
+			if (!(i==start||first)) {
+				if (pass) memcpy(query+len, sep, seplen);
+				len += seplen;
+			}
+			first=0;
+			if (i==start && i==0 && strstr(argv[i], ":/")) url=1;
+			len += oauth_serialize_element(pass ? query+len : NULL, argv[i], url, mod);
+			if (url) {
+				if (pass) query[len] = '?';
+				len++;
+				first=1;
 			}
-			len+=strlen(tmp);
-		} else if(!(t1=strchr(argv[i], '='))) {
-			// see http://oauth.net/core/1.0/#anchor14
-			// escape parameter names and arguments but not the '='
-			tmp=xstrdup(argv[i]);
-			tmp=(char*) xrealloc(tmp,(strlen(tmp)+2)*sizeof(char));
-			strcat(tmp,"=");
-			len+=strlen(tmp);
-		} else {
-			*t1=0;
-			tmp = oauth_url_escape(argv[i]);
-			*t1='=';
-			t1 = oauth_url_escape((t1+1));
-			tmp=(char*) xrealloc(tmp,(strlen(tmp)+strlen(t1)+2+(mod&4?2:0))*sizeof(char));
-			strcat(tmp,"=");
-			if (mod&4) strcat(tmp,"\"");
-			strcat(tmp,t1);
-			if (mod&4) strcat(tmp,"\"");
-			xfree(t1);
-			len+=strlen(tmp);
-		}
-		len+=seplen+1;
-		query=(char*) xrealloc(query,len*sizeof(char));
-		strcat(query, ((i==start||first)?"":sep));
-		first=0;
-		strcat(query, tmp);
-		if (i==start && i==0 && strstr(tmp, ":/")) {
-			strcat(query, "?");
-			first=1;
 		}
-		xfree(tmp);
 	}
+	query[len] = '\0';
+	if (olen) *olen = len;
 	return (query);
 }
 
@@ -519,22 +383,22 @@ char *oauth_serialize_url_parameters (int argc, char **argv) {
 	return oauth_serialize_url(argc, 1, argv);
 }
 
-/**
- * generate a random string between 15 and 32 chars length
- * and return a pointer to it. The value needs to be freed by the
- * caller
- *
- * @return zero terminated random string.
- */
+#define OAUTH_NONCE_MAXLEN 31 ///< longest nonce generated by oauth_nonce_to()
+#define OAUTH_NONCE_PREFIX 12 ///< length of the random prefix of counter nonces
+#define OAUTH_NONCE_DIGITS 11 ///< base-63 digits of the counter (63^11 > 2^64)
+#define OAUTH_RNDPOOL_SIZE 4096 ///< random bytes drawn per refill of a thread's pool
+
+#if defined __GNUC__
+#  define OAUTH_TLS __thread
+#elif defined _MSC_VER
+#  define OAUTH_TLS __declspec(thread)
+#endif
+
 #if !defined HAVE_OPENSSL_HMAC_H && !defined USE_NSS
 /* pre liboauth-0.7.2 and possible future versions that don't use OpenSSL or NSS */
-char *oauth_gen_nonce() {
-	char *nc;
+static void oauth_random_bytes(unsigned char *buf, size_t len) {
 	static int rndinit = 1;
-	const char *chars = "abcdefghijklmnopqrstuvwxyz"
-		"ABCDEFGHIJKLMNOPQRSTUVWXYZ" "0123456789_";
-	unsigned int max = strlen( chars );
-	int i, len;
+	size_t i;
 
 	if(rndinit) {srand(time(NULL)
 #ifndef WIN32 // quick windows check.
@@ -542,13 +406,7 @@ char *oauth_gen_nonce() {
 #endif
 			); rndinit=0;} // seed random number generator - FIXME: we can do better ;)
 
-	len=15+floor(rand()*16.0/(double)RAND_MAX);
-	nc = (char*) xmalloc((len+1)*sizeof(char));
-	for(i=0;i<len; i++) {
-		nc[i] = chars[ rand() % max ];
-	}
-	nc[i]='\0';
-	return (nc);
+	for (i=0; i<len; i++) buf[i] = (unsigned char) (rand() >> 7);
 }
 #else // OpenSSL or NSS random number generator
 #ifdef USE_NSS
@@ -565,26 +423,176 @@ void oauth_init_nss(); //decladed in hash.c
 #  define MY_RAND RAND_bytes
 #  define MY_SRAND ;
 #endif
-char *oauth_gen_nonce() {
-	char *nc;
-	unsigned char buf;
+static void oauth_random_bytes(unsigned char *buf, size_t len) {
+	MY_SRAND
+		MY_RAND(buf, (int) len);
+}
+#endif
+
+/**
+ * random bytes, drawn from the random number generator in bulk.
+ * Every thread has its own pool, so drawing does not contend for the
+ * generator's lock. The pool is refilled in a child process after
+ * fork(2), so parent and child never share random bytes.
+ */
+typedef struct {
+	unsigned char *buf;
+	size_t pos, size; ///< next byte to use; pos == size: empty
+#ifndef WIN32
+	pid_t pid;        ///< process that filled the pool
+#endif
+} oauth_rndpool;
+
+#ifdef OAUTH_TLS
+static OAUTH_TLS unsigned char oauth_rndbuf[OAUTH_RNDPOOL_SIZE];
+static OAUTH_TLS oauth_rndpool oauth_rnd;
+#endif
+
+static unsigned char oauth_rndpool_byte(oauth_rndpool *rp) {
+	unsigned char b;
+	if (rp->pos == rp->size) {
+		oauth_random_bytes(rp->buf, rp->size);
+		rp->pos = 0;
+	}
+	b = rp->buf[rp->pos];
+#ifdef WIPE_MEMORY
+	rp->buf[rp->pos] = 0;
+#endif
+	rp->pos++;
+	return b;
+}
+
+/**
+ * write a random nonce of 15 to 30 chars to 'nc' (OAUTH_NONCE_MAXLEN+1
+ * bytes). Bytes are mapped to the 63 character alphabet by rejection
+ * sampling, so every character is equally likely.
+ *
+ * @return length of the nonce
+ */
+static size_t oauth_nonce_random(char *nc, oauth_rndpool *rp) {
 	const char *chars = "abcdefghijklmnopqrstuvwxyz"
 		"ABCDEFGHIJKLMNOPQRSTUVWXYZ" "0123456789_";
-	unsigned int max = strlen(chars);
+	const unsigned int max = 63;
 	int i, len;
 
-	MY_SRAND
-		MY_RAND(&buf, 1);
-	len=15+(((short)buf)&0x0f);
-	nc = (char*) xmalloc((len+1)*sizeof(char));
-	for(i=0;i<len; i++) {
-		MY_RAND(&buf, 1);
-		nc[i] = chars[ ((short)buf) % max ];
+#ifndef WIN32
+	if (rp->pid != getpid()) {
+		rp->pid = getpid();
+		rp->pos = rp->size;
+	}
+#endif
+	len=15+(oauth_rndpool_byte(rp)&0x0f);
+	for(i=0;i<len; ) {
+		const unsigned int b = oauth_rndpool_byte(rp);
+		if (b >= 256 - 256 % max) continue; // 252..255 would favour 'a'..'d'
+		nc[i++] = chars[b % max];
 	}
 	nc[i]='\0';
-	return (nc);
+	return len;
+}
+
+/**
+ * state of \ref OAUTH_NONCE_COUNTER, see \ref oauth_set_nonce_mode.
+ */
+static struct {
+	int mode;
+	char prefix[OAUTH_NONCE_PREFIX];
+#ifndef WIN32
+	pid_t pid;
+#endif
+	uint64_t counter;
+} oauth_nonce_state;
+
+/**
+ * write the next counter nonce (prefix and base-63 counter) to 'nc'.
+ * @return length of the nonce or 0 if the mode does not apply (anymore).
+ */
+static size_t oauth_nonce_counter(char *nc) {
+	const char *chars = "abcdefghijklmnopqrstuvwxyz"
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZ" "0123456789_";
+	uint64_t c;
+	int i;
+	if (oauth_nonce_state.mode != OAUTH_NONCE_COUNTER) return 0;
+#ifndef WIN32
+	// a forked child shares the prefix and counter of its parent
+	if (oauth_nonce_state.pid != getpid()) return 0;
+#endif
+#ifdef __GNUC__
+	c = __atomic_fetch_add(&oauth_nonce_state.counter, 1, __ATOMIC_RELAXED);
+#else
+	c = oauth_nonce_state.counter++;
+#endif
+	memcpy(nc, oauth_nonce_state.prefix, OAUTH_NONCE_PREFIX);
+	for (i = OAUTH_NONCE_PREFIX + OAUTH_NONCE_DIGITS - 1; i >= OAUTH_NONCE_PREFIX; i--) {
+		nc[i] = chars[c % 63];
+		c /= 63;
+	}
+	nc[OAUTH_NONCE_PREFIX + OAUTH_NONCE_DIGITS] = '\0';
+	return OAUTH_NONCE_PREFIX + OAUTH_NONCE_DIGITS;
+}
+
+/**
+ * write a new nonce to 'nc' (OAUTH_NONCE_MAXLEN+1 bytes).
+ * Random bytes come from the calling thread's pool.
+ *
+ * @return length of the nonce
+ */
+static size_t oauth_nonce_to(char *nc) {
+	size_t len = oauth_nonce_counter(nc);
+#ifdef OAUTH_TLS
+	if (len) return len;
+	if (!oauth_rnd.buf) {
+		oauth_rnd.buf = oauth_rndbuf;
+		oauth_rnd.pos = oauth_rnd.size = OAUTH_RNDPOOL_SIZE;
+	}
+	return oauth_nonce_random(nc, &oauth_rnd);
+#else
+	unsigned char buf[2*OAUTH_NONCE_MAXLEN];
+	oauth_rndpool rp;
+	if (len) return len;
+	rp.buf = buf;
+	rp.pos = rp.size = sizeof(buf);
+#  ifndef WIN32
+	rp.pid = getpid();
+#  endif
+	len = oauth_nonce_random(nc, &rp);
+#  ifdef WIPE_MEMORY
+	memset(buf, 0, sizeof(buf));
+#  endif
+	return len;
+#endif
 }
+
+int oauth_set_nonce_mode (int mode) {
+	const int old = oauth_nonce_state.mode;
+	if (mode != OAUTH_NONCE_RANDOM && mode != OAUTH_NONCE_COUNTER) return -1;
+	if (mode == OAUTH_NONCE_COUNTER) {
+		char nc[OAUTH_NONCE_MAXLEN+1];
+		// the prefix is the start of a random nonce (15 chars or more)
+		oauth_nonce_state.mode = OAUTH_NONCE_RANDOM;
+		oauth_nonce_to(nc);
+		memcpy(oauth_nonce_state.prefix, nc, OAUTH_NONCE_PREFIX);
+#ifndef WIN32
+		oauth_nonce_state.pid = getpid();
 #endif
+		oauth_nonce_state.counter = 0;
+	}
+	oauth_nonce_state.mode = mode;
+	return old;
+}
+
+/**
+ * generate a random string between 15 and 32 chars length
+ * and return a pointer to it. The value needs to be freed by the
+ * caller
+ *
+ * @return zero terminated random string.
+ */
+char *oauth_gen_nonce() {
+	char nc[OAUTH_NONCE_MAXLEN+1];
+	oauth_nonce_to(nc);
+	return xstrdup(nc);
+}
 
 /**
  * string compare function for oauth parameters.
@@ -597,8 +605,9 @@ int oauth_cmpstringp(const void *p1, const void *p2) {
 	char *t1,*t2;
 	int rv;
 	if (!p1 || !p2) return 0;
-	// TODO: this is not fast - we should escape the
-	// array elements (once) before sorting.
+	// NOTE: this escapes both elements on every comparison.
+	// The signing path uses oauth_norm_sort() which escapes
+	// each element once before sorting.
 	v1=oauth_url_escape(* (char * const *)p1);
 	v2=oauth_url_escape(* (char * const *)p2);
 
@@ -631,64 +640,446 @@ int oauth_cmpstringp(const void *p1, const void *p2) {
 	return rv;
 }
 
-/**
- * search array for parameter key.
- * @param argv length of array to search
- * @param argc parameter array to search
- * @param key key of parameter to check.
+/*
+ * Request parameter normalization.
  *
- * @return FALSE (0) if array does not contain a parameter with given key, TRUE (1) otherwise.
+ * Every parameter is url-escaped exactly once into a shared arena and
+ * described by an oauth_nparam record. Sorting compares the records
+ * (first by an 8 byte key prefix, then by the escaped key and value)
+ * which yields the same order as qsort() with oauth_cmpstringp().
  */
-int oauth_param_exists(char **argv, int argc, char *key) {
-	int i;
-	size_t l= strlen(key);
-	for (i=0;i<argc;i++)
-		if (strlen(argv[i])>l && !strncmp(argv[i],key,l) && argv[i][l] == '=') return 1;
-	return 0;
-}
+
+#define OAUTH_NORM_INLINE_PARAMS 16
+#define OAUTH_NORM_INLINE_BYTES 1024
+#define OAUTH_NORM_INLINE_HASH (2*OAUTH_NORM_INLINE_PARAMS)
+
+#define OAUTH_NP_VALUE 1 ///< parameter has a value ("key=value" vs "key")
+#define OAUTH_NP_OAUTH 2 ///< the key starts with "oauth_" or "x_oauth_"
+
+typedef struct {
+	size_t koff, klen; ///< escaped key in the arena
+	size_t voff, vlen; ///< escaped value in the arena
+	size_t kpct, vpct; ///< number of escaped characters ('%') in key and value
+	uint64_t kpfx;     ///< first 8 bytes of the escaped key, big-endian, zero padded
+	uint32_t khash;    ///< hash of the escaped key
+	int flags;         ///< OAUTH_NP_* bits
+	int idx;           ///< caller supplied index (eg. position in argv)
+} oauth_nparam;
 
 /**
- * add query parameter to array
- *
- * @param argcp pointer to array length int
- * @param argvp pointer to array values
- * @param addparam parameter to add (eg. "foo=bar")
+ * a parameter set: the public \ref oauth_params container and the
+ * scratch space of the signing functions (as oauth_norm).
  */
-void oauth_add_param_to_array(int *argcp, char ***argvp, const char *addparam) {
-	(*argvp)=(char**) xrealloc(*argvp,sizeof(char*)*((*argcp)+1));
-	(*argvp)[(*argcp)++]= (char*) xstrdup(addparam);
+struct oauth_params {
+	char *buf;          ///< arena holding escaped keys and values
+	size_t len, alloc;
+	oauth_nparam *p;    ///< parameter records
+	int n, palloc;
+	int *hidx;          ///< open addressing key index: record + 1, 0 = empty
+	int hsize;          ///< number of slots, a power of two > 2*n
+	size_t uoff, ulen;  ///< base URL (zero-terminated) in the arena, if any
+	char sbuf[OAUTH_NORM_INLINE_BYTES];
+	oauth_nparam sp[OAUTH_NORM_INLINE_PARAMS];
+	int shidx[OAUTH_NORM_INLINE_HASH];
+};
+typedef struct oauth_params oauth_norm;
+
+static void oauth_norm_init(oauth_norm *nm) {
+	nm->buf = nm->sbuf;
+	nm->alloc = OAUTH_NORM_INLINE_BYTES;
+	nm->len = 0;
+	nm->p = nm->sp;
+	nm->palloc = OAUTH_NORM_INLINE_PARAMS;
+	nm->n = 0;
+	nm->hidx = nm->shidx;
+	nm->hsize = OAUTH_NORM_INLINE_HASH;
+	memset(nm->shidx, 0, sizeof(nm->shidx));
+	nm->ulen = nm->uoff = 0;
+}
+
+static void oauth_norm_free(oauth_norm *nm) {
+#ifdef WIPE_MEMORY
+	memset(nm->buf, 0, nm->len);
+#endif
+	if (nm->buf != nm->sbuf) xfree(nm->buf);
+	if (nm->p != nm->sp) xfree(nm->p);
+	if (nm->hidx != nm->shidx) xfree(nm->hidx);
+	oauth_norm_init(nm);
 }
 
 /**
- *
+ * forget all records but keep the allocated storage for reuse.
  */
-void oauth_add_protocol(int *argcp, char ***argvp,
-		OAuthMethod method,
-		const char *c_key, //< consumer key - posted plain text
-		const char *t_key //< token key - posted plain text in URL
-		){
-	char oarg[1024];
+static void oauth_norm_reset(oauth_norm *nm) {
+#ifdef WIPE_MEMORY
+	memset(nm->buf, 0, nm->len);
+#endif
+	if (nm->n) memset(nm->hidx, 0, nm->hsize * sizeof(int));
+	nm->len = 0;
+	nm->n = 0;
+	nm->ulen = nm->uoff = 0;
+}
 
-	// add OAuth specific arguments
-	if (!oauth_param_exists(*argvp,*argcp,"oauth_nonce")) {
-		char *tmp;
-		snprintf(oarg, 1024, "oauth_nonce=%s", (tmp=oauth_gen_nonce()));
-		oauth_add_param_to_array(argcp, argvp, oarg);
-		xfree(tmp);
+/**
+ * make room for 'len' more bytes in the arena.
+ */
+static void oauth_norm_reserve(oauth_norm *nm, size_t len) {
+	size_t need = nm->len + len;
+	if (need <= nm->alloc) return;
+	while (nm->alloc < need) nm->alloc *= 2;
+	if (nm->buf == nm->sbuf) {
+		nm->buf = (char*) xmalloc(nm->alloc);
+		memcpy(nm->buf, nm->sbuf, nm->len);
+	} else {
+		nm->buf = (char*) xrealloc(nm->buf, nm->alloc);
 	}
+}
 
-	if (!oauth_param_exists(*argvp,*argcp,"oauth_timestamp")) {
-		snprintf(oarg, 1024, "oauth_timestamp=%li", (long int) time(NULL));
-		oauth_add_param_to_array(argcp, argvp, oarg);
+static uint64_t oauth_norm_prefix(const char *k, size_t len) {
+	uint64_t rv = 0;
+	size_t i;
+	for (i=0; i<8; i++) {
+		rv <<= 8;
+		if (i < len) rv |= (unsigned char) k[i];
 	}
+	return rv;
+}
 
-	if (t_key) {
-		snprintf(oarg, 1024, "oauth_token=%s", t_key);
-		oauth_add_param_to_array(argcp, argvp, oarg);
+static uint32_t oauth_norm_hash(const char *k, size_t len) {
+	uint32_t h = 2166136261u; // FNV-1a
+	size_t i;
+	for (i=0; i<len; i++) h = (h ^ (unsigned char) k[i]) * 16777619u;
+	return h;
+}
+
+/**
+ * enter record 'i' into the key index. For repeated keys the index
+ * keeps the first record, unless a later one has a value and it has not.
+ */
+static void oauth_norm_index(oauth_norm *nm, int i) {
+	const oauth_nparam *np = &nm->p[i];
+	const int mask = nm->hsize - 1;
+	int h = np->khash & mask;
+	for (;; h = (h+1) & mask) {
+		const oauth_nparam *o;
+		if (!nm->hidx[h]) {
+			nm->hidx[h] = i + 1;
+			return;
+		}
+		o = &nm->p[nm->hidx[h] - 1];
+		if (o->khash == np->khash && o->klen == np->klen
+				&& !memcmp(nm->buf + o->koff, nm->buf + np->koff, np->klen)) {
+			if (!(o->flags & OAUTH_NP_VALUE) && (np->flags & OAUTH_NP_VALUE))
+				nm->hidx[h] = i + 1;
+			return;
+		}
 	}
+}
 
-	snprintf(oarg, 1024, "oauth_consumer_key=%s", c_key);
-	oauth_add_param_to_array(argcp, argvp, oarg);
+/**
+ * rebuild the key index, eg. after the records have been reordered.
+ * It grows to stay at most half full.
+ */
+static void oauth_norm_reindex(oauth_norm *nm) {
+	int i, size = nm->hsize;
+	while (size <= 2 * nm->n) size *= 2;
+	if (size != nm->hsize) {
+		if (nm->hidx != nm->shidx) xfree(nm->hidx);
+		nm->hidx = (int*) xmalloc(size * sizeof(int));
+		nm->hsize = size;
+	}
+	memset(nm->hidx, 0, nm->hsize * sizeof(int));
+	for (i=0; i < nm->n; i++) oauth_norm_index(nm, i);
+}
+
+/**
+ * look up an escaped key in O(1).
+ * @return the record (preferring one with a value) or -1
+ */
+static int oauth_norm_find(const oauth_norm *nm, const char *key, size_t klen) {
+	const uint32_t kh = oauth_norm_hash(key, klen);
+	const int mask = nm->hsize - 1;
+	int h = kh & mask;
+	for (; nm->hidx[h]; h = (h+1) & mask) {
+		const oauth_nparam *o = &nm->p[nm->hidx[h] - 1];
+		if (o->khash == kh && o->klen == klen && !memcmp(nm->buf + o->koff, key, klen))
+			return nm->hidx[h] - 1;
+	}
+	return -1;
+}
+
+/**
+ * escape a key and (optional) value once and append the record.
+ * 'val' may be NULL for parameters without a value.
+ */
+static oauth_nparam *oauth_norm_add(oauth_norm *nm, int idx,
+		const char *key, size_t klen, const char *val, size_t vlen) {
+	oauth_nparam *np;
+	size_t ekl = codec_url_escape_len(key, klen);
+	size_t evl = val ? codec_url_escape_len(val, vlen) : 0;
+
+	if (nm->n == nm->palloc) {
+		nm->palloc *= 2;
+		if (nm->p == nm->sp) {
+			nm->p = (oauth_nparam*) xmalloc(nm->palloc * sizeof(oauth_nparam));
+			memcpy(nm->p, nm->sp, nm->n * sizeof(oauth_nparam));
+		} else {
+			nm->p = (oauth_nparam*) xrealloc(nm->p, nm->palloc * sizeof(oauth_nparam));
+		}
+	}
+	oauth_norm_reserve(nm, ekl + evl);
+
+	np = &nm->p[nm->n++];
+	np->idx = idx;
+	np->flags = val ? OAUTH_NP_VALUE : 0;
+	np->koff = nm->len;
+	np->klen = codec_url_escape_to(nm->buf + nm->len, key, klen);
+	np->kpct = (ekl - klen) / 2;
+	nm->len += np->klen;
+	np->voff = nm->len;
+	np->vlen = val ? codec_url_escape_to(nm->buf + nm->len, val, vlen) : 0;
+	np->vpct = (evl - vlen) / 2;
+	nm->len += np->vlen;
+	np->kpfx = oauth_norm_prefix(nm->buf + np->koff, np->klen);
+	np->khash = oauth_norm_hash(nm->buf + np->koff, np->klen);
+	if ((np->klen >= 6 && !memcmp(nm->buf + np->koff, "oauth_", 6))
+			|| (np->klen >= 8 && !memcmp(nm->buf + np->koff, "x_oauth_", 8)))
+		np->flags |= OAUTH_NP_OAUTH;
+	if (2 * nm->n >= nm->hsize) oauth_norm_reindex(nm);
+	else oauth_norm_index(nm, nm->n - 1);
+	return np;
+}
+
+/**
+ * append a record for a key and a value that is already escaped.
+ */
+static oauth_nparam *oauth_norm_add_escaped(oauth_norm *nm, int idx,
+		const char *key, size_t klen, const char *eval, size_t evlen) {
+	oauth_nparam *np = oauth_norm_add(nm, idx, key, klen, "", 0);
+	const char *p;
+	oauth_norm_reserve(nm, evlen);
+	memcpy(nm->buf + nm->len, eval, evlen);
+	np->vlen = evlen;
+	for (p = eval; (p = memchr(p, '%', evlen - (p-eval))); p++) np->vpct++;
+	nm->len += evlen;
+	return np;
+}
+
+/**
+ * append a record for a value that is known to consist of unreserved
+ * characters only (eg. timestamp, nonce) - it is copied without escaping.
+ */
+static oauth_nparam *oauth_norm_add_unreserved(oauth_norm *nm, int idx,
+		const char *key, size_t klen, const char *val, size_t vlen) {
+	oauth_nparam *np = oauth_norm_add(nm, idx, key, klen, "", 0);
+	oauth_norm_reserve(nm, vlen);
+	memcpy(nm->buf + nm->len, val, vlen);
+	np->vlen = vlen;
+	nm->len += vlen;
+	return np;
+}
+
+/**
+ * add a "key=value" string as found in argv arrays.
+ */
+static oauth_nparam *oauth_norm_add_arg(oauth_norm *nm, int idx, const char *arg) {
+	const char *eq = strchr(arg, '=');
+	if (!eq) return oauth_norm_add(nm, idx, arg, strlen(arg), NULL, 0);
+	return oauth_norm_add(nm, idx, arg, eq-arg, eq+1, strlen(eq+1));
+}
+
+/**
+ * compare two byte strings like strcmp() on their escaped representation.
+ */
+static int oauth_norm_memcmp(const char *a, size_t al, const char *b, size_t bl) {
+	int rv = memcmp(a, b, al < bl ? al : bl);
+	if (rv) return rv;
+	return (al > bl) - (al < bl);
+}
+
+static int oauth_norm_cmp(const oauth_norm *nm, const oauth_nparam *a, const oauth_nparam *b) {
+	int rv;
+	// compare parameter names
+	if (a->kpfx != b->kpfx) return a->kpfx < b->kpfx ? -1 : 1;
+	if (a->klen > 8 || b->klen > 8) {
+		rv = oauth_norm_memcmp(nm->buf + a->koff, a->klen, nm->buf + b->koff, b->klen);
+		if (rv) return rv;
+	} else if (a->klen != b->klen) {
+		return a->klen < b->klen ? -1 : 1;
+	}
+	// if parameter names are equal, sort by value.
+	if ((a->flags & OAUTH_NP_VALUE) != (b->flags & OAUTH_NP_VALUE))
+		return (a->flags & OAUTH_NP_VALUE) ? 1 : -1;
+	return oauth_norm_memcmp(nm->buf + a->voff, a->vlen, nm->buf + b->voff, b->vlen);
+}
+
+/**
+ * sort the records of a normalization set, see
+ * http://oauth.net/core/1.0/#anchor14
+ */
+static void oauth_norm_sort(oauth_norm *nm) {
+	oauth_nparam *src, *dst, *tmp;
+	int i, j, w;
+	if (nm->n < OAUTH_NORM_INLINE_PARAMS) {
+		// common case: few parameters - insertion sort
+		for (i=1; i < nm->n; i++) {
+			oauth_nparam t = nm->p[i];
+			for (j=i; j>0 && oauth_norm_cmp(nm, &t, &nm->p[j-1]) < 0; j--)
+				nm->p[j] = nm->p[j-1];
+			nm->p[j] = t;
+		}
+		oauth_norm_reindex(nm);
+		return;
+	}
+	// bottom-up merge sort (qsort() has no user-data argument)
+	src = nm->p;
+	dst = tmp = (oauth_nparam*) xmalloc(nm->n * sizeof(oauth_nparam));
+	for (w=1; w < nm->n; w*=2) {
+		for (i=0; i < nm->n; i+=2*w) {
+			int l = i, lend = i+w < nm->n ? i+w : nm->n;
+			int r = lend, rend = i+2*w < nm->n ? i+2*w : nm->n;
+			int o = i;
+			while (l < lend && r < rend)
+				dst[o++] = oauth_norm_cmp(nm, &src[r], &src[l]) < 0 ? src[r++] : src[l++];
+			while (l < lend) dst[o++] = src[l++];
+			while (r < rend) dst[o++] = src[r++];
+		}
+		{ oauth_nparam *t = src; src = dst; dst = t; }
+	}
+	if (src != nm->p) memcpy(nm->p, src, nm->n * sizeof(oauth_nparam));
+	xfree(tmp);
+	oauth_norm_reindex(nm);
+}
+
+/**
+ * write an already escaped string url-escaped a 2nd time.
+ * The only reserved character in it is the '%' of the escape sequences.
+ */
+static char *oauth_escape2_to(char *p, const char *src, size_t len, size_t pct) {
+	const char *end = src + len, *pc;
+	if (!pct) {
+		memcpy(p, src, len);
+		return p + len;
+	}
+	while ((pc = memchr(src, '%', end-src))) {
+		memcpy(p, src, pc-src);
+		p += pc-src;
+		*p++ = '%'; *p++ = '2'; *p++ = '5';
+		src = pc + 1;
+	}
+	memcpy(p, src, end-src);
+	return p + (end-src);
+}
+
+/**
+ * assemble the signature base string
+ * "METHOD&escaped(url)&escaped(key=value&key=value..)"
+ * from the sorted records in a single pass.
+ *
+ * The length is computed up front; the string is only written if
+ * 'out' is not NULL and 'size' is large enough to hold it including
+ * the terminating zero.
+ *
+ * @param method HTTP request method - converted to uppercase
+ * @param url base URL (argv[0])
+ * @param at if not NULL, receives the offset of each record's value
+ * in 'out' (when it is written)
+ * @return length of the base string (excluding the terminating zero)
+ */
+static size_t oauth_norm_base_string(const oauth_norm *nm,
+		const char *method, const char *url,
+		char *out, size_t size, size_t *at) {
+	size_t ml = strlen(method), ul = strlen(url);
+	size_t len, j;
+	char *p;
+	int i;
+
+	len = codec_url_escape_len(method, ml) + 1 + codec_url_escape_len(url, ul) + 1;
+	for (i=0; i < nm->n; i++) {
+		const oauth_nparam *np = &nm->p[i];
+		// '=' and '&' become %3D, %26; every '%' becomes %25
+		len += np->klen + np->vlen + 2*(np->kpct + np->vpct) + 3 + (i>0 ? 3 : 0);
+	}
+	if (!out || size <= len) return len;
+
+	p = out;
+	for (j=0; j < ml; j++) {
+		char c = toupper((unsigned char) method[j]);
+		p += codec_url_escape_to(p, &c, 1);
+	}
+	*p++ = '&';
+	p += codec_url_escape_to(p, url, ul);
+	*p++ = '&';
+	for (i=0; i < nm->n; i++) {
+		const oauth_nparam *np = &nm->p[i];
+		if (i>0) { *p++ = '%'; *p++ = '2'; *p++ = '6'; }
+		p = oauth_escape2_to(p, nm->buf + np->koff, np->klen, np->kpct);
+		*p++ = '%'; *p++ = '3'; *p++ = 'D';
+		if (at) at[i] = p - out;
+		p = oauth_escape2_to(p, nm->buf + np->voff, np->vlen, np->vpct);
+	}
+	*p = '\0';
+	return len;
+}
+
+/**
+ * search array for parameter key.
+ * @param argv length of array to search
+ * @param argc parameter array to search
+ * @param key key of parameter to check.
+ *
+ * @return FALSE (0) if array does not contain a parameter with given key, TRUE (1) otherwise.
+ */
+int oauth_param_exists(char **argv, int argc, char *key) {
+	int i;
+	size_t l= strlen(key);
+	for (i=0;i<argc;i++)
+		if (strlen(argv[i])>l && !strncmp(argv[i],key,l) && argv[i][l] == '=') return 1;
+	return 0;
+}
+
+/**
+ * add query parameter to array
+ *
+ * @param argcp pointer to array length int
+ * @param argvp pointer to array values
+ * @param addparam parameter to add (eg. "foo=bar")
+ */
+void oauth_add_param_to_array(int *argcp, char ***argvp, const char *addparam) {
+	(*argvp)=(char**) xrealloc(*argvp,sizeof(char*)*((*argcp)+1));
+	(*argvp)[(*argcp)++]= (char*) xstrdup(addparam);
+}
+
+/**
+ *
+ */
+void oauth_add_protocol(int *argcp, char ***argvp,
+		OAuthMethod method,
+		const char *c_key, //< consumer key - posted plain text
+		const char *t_key //< token key - posted plain text in URL
+		){
+	char oarg[1024];
+
+	// add OAuth specific arguments
+	if (!oauth_param_exists(*argvp,*argcp,"oauth_nonce")) {
+		char *tmp;
+		snprintf(oarg, 1024, "oauth_nonce=%s", (tmp=oauth_gen_nonce()));
+		oauth_add_param_to_array(argcp, argvp, oarg);
+		xfree(tmp);
+	}
+
+	if (!oauth_param_exists(*argvp,*argcp,"oauth_timestamp")) {
+		snprintf(oarg, 1024, "oauth_timestamp=%li", (long int) time(NULL));
+		oauth_add_param_to_array(argcp, argvp, oarg);
+	}
+
+	if (t_key) {
+		snprintf(oarg, 1024, "oauth_token=%s", t_key);
+		oauth_add_param_to_array(argcp, argvp, oarg);
+	}
+
+	snprintf(oarg, 1024, "oauth_consumer_key=%s", c_key);
+	oauth_add_param_to_array(argcp, argvp, oarg);
 
 	snprintf(oarg, 1024, "oauth_signature_method=%s",
 			method==0?"HMAC-SHA1":method==1?"RSA-SHA1":"PLAINTEXT");
@@ -729,20 +1120,10 @@ char *oauth_sign_url2 (const char *url, char **postargs,
 		const char *t_key, //< token key - posted plain text in URL
 		const char *t_secret //< token secret - used as 2st part of secret-key
 		) {
-	int  argc;
-	char **argv = NULL;
 	char *rv;
-
-	if (postargs)
-		argc = oauth_split_post_paramters(url, &argv, 0);
-	else
-		argc = oauth_split_url_parameters(url, &argv);
-
-	rv=oauth_sign_array2(&argc, &argv, postargs,
-			method, http_method,
-			c_key, c_secret, t_key, t_secret);
-
-	oauth_free_array(&argc, &argv);
+	oauth_signer *s = oauth_signer_new(method, c_key, c_secret, t_key, t_secret);
+	rv = oauth_signer_sign_url(s, url, postargs, http_method);
+	oauth_signer_free(s);
 	return(rv);
 }
 
@@ -761,90 +1142,230 @@ char *oauth_sign_array (int *argcp, char***argvp,
 			t_key, t_secret);
 }
 
-void oauth_sign_array2_process (int *argcp, char***argvp,
-		char **postargs,
-		OAuthMethod method,
-		const char *http_method, //< HTTP request method
+struct oauth_signer {
+	OAuthMethod method;
+	char *c_key;        ///< consumer key - posted plain text
+	char *t_key;        ///< token key or NULL
+	char *c_key_esc;    ///< url-escaped consumer key
+	char *t_key_esc;    ///< url-escaped token key or NULL
+	size_t c_key_esclen, t_key_esclen;
+	char *okey;         ///< signing key: escaped "c_secret&t_secret" or the RSA private key
+	size_t okeylen;
+	oauth_hmac_sha1 *hmac; ///< precomputed key schedule (OA_HMAC only)
+};
+
+oauth_signer *oauth_signer_new (OAuthMethod method,
 		const char *c_key, //< consumer key - posted plain text
 		const char *c_secret, //< consumer secret - used as 1st part of secret-key
 		const char *t_key, //< token key - posted plain text in URL
 		const char *t_secret //< token secret - used as 2st part of secret-key
 		) {
-	char oarg[1024];
-	char *query;
-	char *okey, *odat, *sign;
-	char *http_request_method;
+	oauth_signer *s = (oauth_signer*) xcalloc(1, sizeof(oauth_signer));
+	s->method = method;
+	if (c_key) {
+		s->c_key = xstrdup(c_key);
+		s->c_key_esc = oauth_url_escape(c_key);
+		s->c_key_esclen = strlen(s->c_key_esc);
+	}
+	if (t_key) {
+		s->t_key = xstrdup(t_key);
+		s->t_key_esc = oauth_url_escape(t_key);
+		s->t_key_esclen = strlen(s->t_key_esc);
+	}
 
-	if (!http_method) {
-		http_request_method = xstrdup(postargs?"POST":"GET");
+	// prepare signing key
+	if (method == OA_RSA) {
+		size_t len = 1;
+		if (c_secret) len += strlen(c_secret);
+		if (t_secret) len += strlen(t_secret);
+		s->okey = (char*) xmalloc(len * sizeof(char));
+		*s->okey = '\0';
+		if (c_secret) strcat(s->okey, c_secret);
+		if (t_secret) strcat(s->okey, t_secret);
 	} else {
-		int i;
-		http_request_method = xstrdup(http_method);
-		for (i=0;i<strlen(http_request_method);i++)
-			http_request_method[i]=toupper(http_request_method[i]);
+		s->okey = oauth_catenc(2, c_secret, t_secret);
 	}
+	s->okeylen = strlen(s->okey);
 
-	// add required OAuth protocol parameters
-	oauth_add_protocol(argcp, argvp, method, c_key, t_key);
+	if (method == OA_HMAC) {
+		s->hmac = oauth_hmac_sha1_new(s->okey, s->okeylen);
+		if (!s->hmac) {
+			oauth_signer_free(s);
+			return NULL;
+		}
+	}
+	return s;
+}
 
-	// sort parameters
-	qsort(&(*argvp)[1], (*argcp)-1, sizeof(char *), oauth_cmpstringp);
+void oauth_signer_free (oauth_signer *s) {
+	if (!s) return;
+	if (s->hmac) oauth_hmac_sha1_free(s->hmac);
+	if (s->okey) {
+#ifdef WIPE_MEMORY
+		memset(s->okey, 0, s->okeylen);
+#endif
+		xfree(s->okey);
+	}
+	if (s->c_key) xfree(s->c_key);
+	if (s->t_key) xfree(s->t_key);
+	if (s->c_key_esc) xfree(s->c_key_esc);
+	if (s->t_key_esc) xfree(s->t_key_esc);
+	xfree(s);
+}
 
-	// serialize URL - base-url
-	query= oauth_serialize_url_parameters(*argcp, *argvp);
+char *oauth_signer_sign (const oauth_signer *s, const char *m, const size_t ml) {
+	unsigned char digest[20];
+	if (!s || !m) return NULL;
+	switch(s->method) {
+		case OA_RSA:
+			return oauth_sign_rsa_sha1(m, s->okey); // XXX okey needs to be RSA key!
+		case OA_PLAINTEXT:
+			return oauth_sign_plaintext(m, s->okey);
+		default:
+			if (oauth_hmac_sha1_digest(s->hmac, m, ml, digest) != 20) return NULL;
+			return oauth_encode_base64(20, digest);
+	}
+}
 
-	// prepare data to sign
-	if (method == OA_RSA) {
-		size_t len = 1;
-		if (c_secret) {
-			len += strlen(c_secret);
-		}
-		if (t_secret) {
-			len += strlen(t_secret);
-		}
-		okey = (char*)xmalloc(len * sizeof(char));
-		*okey = '\0';
-		if (c_secret) {
-			okey = strcat(okey, c_secret);
-		}
-		if (t_secret) {
-			okey = strcat(okey, t_secret);
-		}
-	} else {
-		okey = oauth_catenc(2, c_secret, t_secret);
+/**
+ * TRUE if a parameter with the given key and a value exists.
+ * (see \ref oauth_param_exists)
+ */
+static int oauth_norm_exists(const oauth_norm *nm, const char *key) {
+	const int i = oauth_norm_find(nm, key, strlen(key));
+	return i >= 0 && (nm->p[i].flags & OAUTH_NP_VALUE);
+}
+
+/**
+ * add the OAuth protocol parameters, like oauth_add_protocol().
+ * @return length of the generated nonce or 0 if the request already had one.
+ */
+static size_t oauth_norm_add_protocol(oauth_norm *nm, const oauth_signer *s) {
+	char tmp[OAUTH_NONCE_MAXLEN+1];
+	const char *sm;
+	size_t nl = 0;
+	int l;
+
+	if (!oauth_norm_exists(nm, "oauth_nonce")) {
+		nl = oauth_nonce_to(tmp);
+		oauth_norm_add_unreserved(nm, -1, "oauth_nonce", 11, tmp, nl);
+	}
+	if (!oauth_norm_exists(nm, "oauth_timestamp")) {
+		l = snprintf(tmp, sizeof(tmp), "%li", (long int) time(NULL));
+		oauth_norm_add_unreserved(nm, -1, "oauth_timestamp", 15, tmp, l);
+	}
+	if (s->t_key)
+		oauth_norm_add_escaped(nm, -1, "oauth_token", 11, s->t_key_esc, s->t_key_esclen);
+	oauth_norm_add_escaped(nm, -1, "oauth_consumer_key", 18,
+			s->c_key_esc ? s->c_key_esc : "", s->c_key_esclen);
+	sm = s->method==OA_HMAC?"HMAC-SHA1":s->method==OA_RSA?"RSA-SHA1":"PLAINTEXT";
+	oauth_norm_add_unreserved(nm, -1, "oauth_signature_method", 22, sm, strlen(sm));
+	if (!oauth_norm_exists(nm, "oauth_version"))
+		oauth_norm_add_unreserved(nm, -1, "oauth_version", 13, "1.0", 3);
+	return nl;
+}
+
+/**
+ * the back-end behind \ref oauth_sign_array2_process and
+ * \ref oauth_signer_sign_array: add protocol parameters,
+ * normalize the request, sign it and append the signature.
+ */
+static void oauth_signer_process (const oauth_signer *s,
+		int *argcp, char***argvp,
+		char **postargs,
+		const char *http_method //< HTTP request method
+		) {
+	char oarg[1024];
+	char sbuf[1024];
+	char *odat, *sign;
+	char **sorted;
+	size_t blen;
+	oauth_norm nm;
+	int i, n0;
+
+	if (!http_method) http_method = postargs?"POST":"GET";
+
+	// an empty request has an empty base URL
+	if (*argcp < 1) {
+		*argvp = (char**) xrealloc(*argvp, sizeof(char*));
+		(*argvp)[0] = xstrdup("");
+		*argcp = 1;
+	}
+
+	// escape each parameter once
+	oauth_norm_init(&nm);
+	for (i=1; i < *argcp; i++) oauth_norm_add_arg(&nm, i, (*argvp)[i]);
+
+	// add required OAuth protocol parameters - to the records and the array
+	n0 = nm.n;
+	oauth_norm_add_protocol(&nm, s);
+	*argvp = (char**) xrealloc(*argvp, (*argcp + nm.n - n0 + 1) * sizeof(char*));
+	for (i=n0; i < nm.n; i++) {
+		oauth_nparam *np = &nm.p[i];
+		const char *k = nm.buf + np->koff, *v = NULL;
+		size_t vl = np->vlen;
+		char *arg;
+		// the records hold escaped values, the array the plain ones
+		if (np->klen == 18 && !memcmp(k, "oauth_consumer_key", 18)) v = s->c_key ? s->c_key : "";
+		else if (np->klen == 11 && !memcmp(k, "oauth_token", 11)) v = s->t_key;
+		if (v) vl = strlen(v);
+		else v = nm.buf + np->voff; // unreserved characters only
+		arg = (char*) xmalloc(np->klen + vl + 2);
+		memcpy(arg, k, np->klen);
+		arg[np->klen] = '=';
+		memcpy(arg + np->klen + 1, v, vl);
+		arg[np->klen + vl + 1] = '\0';
+		np->idx = *argcp;
+		(*argvp)[(*argcp)++] = arg;
 	}
 
-	odat = oauth_catenc(3, http_request_method, (*argvp)[0], query); // base-string
-	xfree(http_request_method);
+	oauth_norm_sort(&nm);
+
+	// apply the order to the parameter array
+	if (nm.n > 1) {
+		sorted = (char**) xmalloc(nm.n * sizeof(char*));
+		for (i=0; i < nm.n; i++) sorted[i] = (*argvp)[nm.p[i].idx];
+		memcpy(&(*argvp)[1], sorted, nm.n * sizeof(char*));
+		xfree(sorted);
+	}
+
+	// base-string: exact size, single buffer
+	blen = oauth_norm_base_string(&nm, http_method, (*argvp)[0], NULL, 0, NULL);
+	odat = blen < sizeof(sbuf) ? sbuf : (char*) xmalloc(blen + 1);
+	oauth_norm_base_string(&nm, http_method, (*argvp)[0], odat, blen + 1, NULL);
+	oauth_norm_free(&nm);
 
 #ifdef DEBUG_OAUTH
 	fprintf (stderr, "\nliboauth: data to sign='%s'\n\n", odat);
-	fprintf (stderr, "\nliboauth: key='%s'\n\n", okey);
+	fprintf (stderr, "\nliboauth: key='%s'\n\n", s->okey);
 #endif
 
 	// generate signature
-	switch(method) {
-		case OA_RSA:
-			sign = oauth_sign_rsa_sha1(odat,okey); // XXX okey needs to be RSA key!
-			break;
-		case OA_PLAINTEXT:
-			sign = oauth_sign_plaintext(odat,okey);
-			break;
-		default:
-			sign = oauth_sign_hmac_sha1(odat,okey);
-	}
+	sign = oauth_signer_sign(s, odat, blen);
 #ifdef WIPE_MEMORY
-	memset(okey,0, strlen(okey));
-	memset(odat,0, strlen(odat));
+	memset(odat, 0, blen);
 #endif
-	xfree(odat);
-	xfree(okey);
+	if (odat != sbuf) xfree(odat);
 
-	// append signature to query args.
+	// append signature to query args (room was made above).
 	snprintf(oarg, 1024, "oauth_signature=%s",sign);
-	oauth_add_param_to_array(argcp, argvp, oarg);
-	xfree(sign);
-	if(query) xfree(query);
+	(*argvp)[(*argcp)++] = xstrdup(oarg);
+	if(sign) xfree(sign);
+}
+
+void oauth_sign_array2_process (int *argcp, char***argvp,
+		char **postargs,
+		OAuthMethod method,
+		const char *http_method, //< HTTP request method
+		const char *c_key, //< consumer key - posted plain text
+		const char *c_secret, //< consumer secret - used as 1st part of secret-key
+		const char *t_key, //< token key - posted plain text in URL
+		const char *t_secret //< token secret - used as 2st part of secret-key
+		) {
+	oauth_signer *s = oauth_signer_new(method, c_key, c_secret, t_key, t_secret);
+	if (!s) return;
+	oauth_signer_process(s, argcp, argvp, postargs, http_method);
+	oauth_signer_free(s);
 }
 
 char *oauth_sign_array2 (int *argcp, char***argvp,
@@ -856,9 +1377,21 @@ char *oauth_sign_array2 (int *argcp, char***argvp,
 		const char *t_key, //< token key - posted plain text in URL
 		const char *t_secret //< token secret - used as 2st part of secret-key
 		) {
+	char *result;
+	oauth_signer *s = oauth_signer_new(method, c_key, c_secret, t_key, t_secret);
+	result = oauth_signer_sign_array(s, argcp, argvp, postargs, http_method);
+	oauth_signer_free(s);
+	return result;
+}
 
+char *oauth_signer_sign_array (const oauth_signer *s,
+		int *argcp, char***argvp,
+		char **postargs,
+		const char *http_method //< HTTP request method
+		) {
 	char *result;
-	oauth_sign_array2_process(argcp, argvp, postargs, method, http_method, c_key, c_secret, t_key, t_secret);
+	if (!s) return NULL;
+	oauth_signer_process(s, argcp, argvp, postargs, http_method);
 
 	// build URL params
 	result = oauth_serialize_url(*argcp, (postargs?1:0), *argvp);
@@ -871,6 +1404,2250 @@ char *oauth_sign_array2 (int *argcp, char***argvp,
 	return result;
 }
 
+static char *oauth_cache_sign(const oauth_signer *s, const char *url,
+		char **postargs, const char *http_method); // see the normalization cache
+
+char *oauth_signer_sign_url (const oauth_signer *s, const char *url,
+		char **postargs,
+		const char *http_method //< HTTP request method
+		) {
+	int  argc;
+	char **argv = NULL;
+	char *rv;
+
+	if ((rv = oauth_cache_sign(s, url, postargs, http_method))) return rv;
+
+	if (postargs)
+		argc = oauth_split_post_paramters(url, &argv, 0);
+	else
+		argc = oauth_split_url_parameters(url, &argv);
+
+	rv=oauth_signer_sign_array(s, &argc, &argv, postargs, http_method);
+
+	oauth_free_array(&argc, &argv);
+	return(rv);
+}
+
+
+/*
+ * allocation-free signing into caller supplied buffers.
+ *
+ * The request is split directly into the escape-once records of an
+ * oauth_norm (no argv array), protocol parameters are added as
+ * pre-escaped records, and the output is sized and written in one go.
+ * Typical requests fit into the inline storage of oauth_norm and the
+ * stack buffers below, so no heap memory is used.
+ */
+
+/**
+ * copy the base URL into the arena as it is, as oauth_sign_array2()
+ * uses argv[0].
+ */
+static void oauth_norm_copy_base(oauth_norm *nm, const char *url, size_t len) {
+	oauth_norm_reserve(nm, len + 1);
+	memmove(nm->buf + nm->len, url, len);
+	nm->buf[nm->len + len] = '\0';
+	nm->uoff = nm->len;
+	nm->ulen = len;
+	nm->len += len + 1;
+}
+
+/**
+ * copy the base URL into the arena and apply the normalization of
+ * oauth_split_post_paramters(): add a trailing slash to empty
+ * absolute paths and strip the default port ":80".
+ */
+static void oauth_norm_set_base(oauth_norm *nm, const char *url, size_t len) {
+	char *u, *slash, *tmp;
+	oauth_norm_reserve(nm, len + 2);
+	u = nm->buf + nm->len;
+	memmove(u, url, len);
+	u[len] = '\0';
+	if ((slash = strstr(u, ":/"))) {
+		// HTTP does not allow empty absolute paths, so the URL
+		// 'http://example.com' is equivalent to 'http://example.com/'
+		while (*(++slash) == '/')  ; // skip slashes eg /xxx:[\/]*/
+		if (!strchr(slash, '/')) {
+			u[len++] = '/';
+			u[len] = '\0';
+		}
+	}
+	if ((tmp = strstr(u, ":80/"))) {
+		memmove(tmp, tmp+3, strlen(tmp+2));
+		len -= 3;
+	}
+	nm->uoff = nm->len;
+	nm->ulen = len;
+	nm->len += len + 1;
+}
+
+/**
+ * split a URL or query string into the records of 'nm'.
+ * The same rules as \ref oauth_split_post_paramters apply.
+ */
+static void oauth_norm_split(oauth_norm *nm, const char *url, short qesc) {
+	const char *t = url;
+	int argc = 0;
+	while (*t) {
+		size_t tl = strcspn(t, "&?"), dl;
+		char *d;
+		if (!tl) { t++; continue; }
+		if (tl >= 16 && !strncasecmp("oauth_signature=", t, 16)) { t += tl; continue; }
+
+		// decode into scratch space behind the room for the escaped result
+		oauth_norm_reserve(nm, 4*tl + 2);
+		d = nm->buf + nm->len + 3*tl;
+		dl = oauth_span_copy(d, t, tl, qesc, argc>0 || (qesc&4));
+
+		if (argc == 0) {
+			oauth_norm_set_base(nm, d, dl);
+		} else {
+			const char *eq = memchr(d, '=', dl);
+			if (eq) oauth_norm_add(nm, argc, d, eq-d, eq+1, dl-(eq-d)-1);
+			else    oauth_norm_add(nm, argc, d, dl, NULL, 0);
+		}
+		argc++;
+		t += tl;
+	}
+	if (argc == 0) oauth_norm_set_base(nm, "", 0);
+}
+
+/**
+ * add one parameter, 'tl' bytes at 't', of a form (application/x-www-form-urlencoded)
+ * body or query: '+' is a space and '\001' is not special.
+ */
+static oauth_nparam *oauth_norm_add_form(oauth_norm *nm, int idx, const char *t, size_t tl) {
+	char *d, *eq;
+	size_t dl;
+	// decode into scratch space behind the room for the escaped result
+	oauth_norm_reserve(nm, 4*tl + 2);
+	d = nm->buf + nm->len + 3*tl;
+	dl = oauth_span_copy(d, t, tl, 1|2, 1);
+	if ((eq = memchr(d, '=', dl))) return oauth_norm_add(nm, idx, d, eq-d, eq+1, dl-(eq-d)-1);
+	return oauth_norm_add(nm, idx, d, dl, NULL, 0);
+}
+
+/**
+ * sign using the signer's method, writing the (unescaped) signature
+ * into 'sig' if it is large enough.
+ *
+ * @return length of the signature or 0 on error.
+ */
+static size_t oauth_signer_sign_to(const oauth_signer *s, const char *m, size_t ml, char *sig, size_t size) {
+	unsigned char digest[20];
+	size_t len;
+	char *rsa;
+	switch(s->method) {
+		case OA_RSA:
+			if (!(rsa = oauth_sign_rsa_sha1(m, s->okey))) return 0;
+			len = strlen(rsa);
+			if (len < size) memcpy(sig, rsa, len+1);
+			xfree(rsa);
+			return len;
+		case OA_PLAINTEXT:
+			len = s->okeylen;
+			if (len < size) memcpy(sig, s->okey, len+1);
+			return len;
+		default:
+			if (oauth_hmac_sha1_digest(s->hmac, m, ml, digest) != 20) return 0;
+			return oauth_encode_base64_into(digest, 20, sig, size);
+	}
+}
+
+/**
+ * write (or if 'out' is NULL only measure) the signed request.
+ *
+ * @param sig the unescaped signature
+ * @param at if not NULL, receives the offset of each record's value in
+ * the output, (size_t) -1 for records that are not written
+ * @return length of the output excluding the terminating zero
+ */
+static size_t oauth_norm_write(const oauth_norm *nm, OAuthOutput mode,
+		const char *sig, size_t siglen, char *out, size_t *at) {
+	const char *sep = mode == OA_OUT_HEADER ? ", " : "&";
+	const size_t seplen = mode == OA_OUT_HEADER ? 2 : 1;
+	const int quote = mode == OA_OUT_HEADER;
+	size_t len = 0;
+	int i, first = 1;
+
+#define OA_PUT(S,L) do { if (out) memcpy(out+len, (S), (L)); len += (L); } while(0)
+	if (mode == OA_OUT_URL) {
+		const char *base = nm->buf + nm->uoff;
+		int url = strstr(base, ":/") != NULL;
+		len += oauth_serialize_element(out, base, url, 0);
+		if (url) OA_PUT("?", 1);
+		else first = 0;
+	}
+	for (i=0; i < nm->n; i++) {
+		const oauth_nparam *np = &nm->p[i];
+		int q = quote && (np->flags & OAUTH_NP_VALUE);
+		if (at) at[i] = (size_t) -1;
+		if (mode == OA_OUT_HEADER && !(np->flags & OAUTH_NP_OAUTH)) continue;
+		if (!first) OA_PUT(sep, seplen);
+		first = 0;
+		OA_PUT(nm->buf + np->koff, np->klen);
+		OA_PUT("=", 1);
+		if (q) OA_PUT("\"", 1);
+		if (at) at[i] = len;
+		OA_PUT(nm->buf + np->voff, np->vlen);
+		if (q) OA_PUT("\"", 1);
+	}
+	if (!first) OA_PUT(sep, seplen);
+	OA_PUT("oauth_signature=", 16);
+	if (quote) OA_PUT("\"", 1);
+	if (out) codec_url_escape_to(out+len, sig, siglen);
+	len += codec_url_escape_len(sig, siglen);
+	if (quote) OA_PUT("\"", 1);
+#undef OA_PUT
+	if (out) out[len] = '\0';
+	return len;
+}
+
+/**
+ * sort the records of 'nm' and build the signature base string in 'bbuf'
+ * or, if it does not fit into 'size' bytes, in a heap buffer.
+ *
+ * @return the base string, its length in '*blen'
+ */
+static char *oauth_norm_sorted_base(oauth_norm *nm, const char *http_method,
+		char *bbuf, size_t size, size_t *blen) {
+	char *odat;
+	oauth_norm_sort(nm);
+	*blen = oauth_norm_base_string(nm, http_method, nm->buf + nm->uoff, NULL, 0, NULL);
+	odat = *blen < size ? bbuf : (char*) xmalloc(*blen + 1);
+	oauth_norm_base_string(nm, http_method, nm->buf + nm->uoff, odat, *blen + 1, NULL);
+	return odat;
+}
+
+/**
+ * sort the records of 'nm', build the signature base string and sign it.
+ * The signature is written to 'sig' or, if it does not fit into 'size'
+ * bytes, to a heap buffer. '*sigp' is set to the one used.
+ *
+ * @return length of the signature or 0 on error.
+ */
+static size_t oauth_norm_signature(const oauth_signer *s, oauth_norm *nm,
+		const char *http_method, char *sig, size_t size, char **sigp) {
+	char bbuf[1024];
+	char *odat;
+	size_t blen, siglen;
+
+	odat = oauth_norm_sorted_base(nm, http_method, bbuf, sizeof(bbuf), &blen);
+
+	// signature
+	*sigp = sig;
+	siglen = oauth_signer_sign_to(s, odat, blen, sig, size);
+	if (siglen >= size) {
+		*sigp = (char*) xmalloc(siglen + 1);
+		siglen = oauth_signer_sign_to(s, odat, blen, *sigp, siglen + 1);
+	}
+#ifdef WIPE_MEMORY
+	memset(odat, 0, blen);
+#endif
+	if (odat != bbuf) xfree(odat);
+	return siglen;
+}
+
+/**
+ * the back-end of the *_into functions: add protocol parameters to the
+ * request in 'nm', sign it and write the result, preceded by 'hl' bytes
+ * of 'head', to 'buf'. If 'outp' is set, a buffer of the exact size is
+ * allocated instead and stored there.
+ */
+static size_t oauth_norm_sign_into(const oauth_signer *s, oauth_norm *nm,
+		OAuthOutput mode, const char *http_method,
+		const char *head, size_t hl,
+		char *buf, size_t size, char **outp) {
+	char sbuf[512];
+	char *sig;
+	size_t siglen, nl, len = 0;
+
+	if (!http_method) http_method = mode==OA_OUT_POSTARGS?"POST":"GET";
+
+	nl = oauth_norm_add_protocol(nm, s);
+	siglen = oauth_norm_signature(s, nm, http_method, sbuf, sizeof(sbuf), &sig);
+	if (siglen) {
+		len = hl + oauth_norm_write(nm, mode, sig, siglen, NULL, NULL);
+		if (outp) {
+			*outp = buf = (char*) xmalloc(len + 1);
+			size = len + 1;
+		}
+		if (len < size) {
+			if (hl) memcpy(buf, head, hl);
+			oauth_norm_write(nm, mode, sig, siglen, buf + hl, NULL);
+		} else {
+			// a retry generates a new nonce and timestamp, hence a new
+			// signature - make room for the longest nonce and for a
+			// signature that needs escaping throughout.
+			if (nl) len += OAUTH_NONCE_MAXLEN - nl;
+			if (s->method != OA_PLAINTEXT) len += 3*siglen - codec_url_escape_len(sig, siglen);
+		}
+	}
+	if (sig != sbuf) xfree(sig);
+	return len;
+}
+
+size_t oauth_signer_sign_url_into (const oauth_signer *s, const char *url,
+		OAuthOutput mode,
+		const char *http_method, //< HTTP request method
+		char *buf, size_t size) {
+	oauth_norm nm;
+	size_t rv;
+	if (!s || !url) return 0;
+	oauth_norm_init(&nm);
+	oauth_norm_split(&nm, url, mode==OA_OUT_POSTARGS ? 0 : 1);
+	rv = oauth_norm_sign_into(s, &nm, mode, http_method, NULL, 0, buf, size, NULL);
+	oauth_norm_free(&nm);
+	return rv;
+}
+
+size_t oauth_signer_sign_array_into (const oauth_signer *s,
+		int argc, char **argv,
+		OAuthOutput mode,
+		const char *http_method, //< HTTP request method
+		char *buf, size_t size) {
+	oauth_norm nm;
+	size_t rv;
+	int i;
+	if (!s || argc < 1) return 0;
+	oauth_norm_init(&nm);
+	oauth_norm_copy_base(&nm, argv[0], strlen(argv[0]));
+	for (i=1; i < argc; i++) oauth_norm_add_arg(&nm, i, argv[i]);
+	rv = oauth_norm_sign_into(s, &nm, mode, http_method, NULL, 0, buf, size, NULL);
+	oauth_norm_free(&nm);
+	return rv;
+}
+
+size_t oauth_sign_url2_into (const char *url,
+		OAuthOutput mode,
+		OAuthMethod method,
+		const char *http_method, //< HTTP request method
+		const char *c_key, //< consumer key - posted plain text
+		const char *c_secret, //< consumer secret - used as 1st part of secret-key
+		const char *t_key, //< token key - posted plain text in URL
+		const char *t_secret, //< token secret - used as 2st part of secret-key
+		char *buf, size_t size) {
+	size_t rv;
+	oauth_signer *s = oauth_signer_new(method, c_key, c_secret, t_key, t_secret);
+	rv = oauth_signer_sign_url_into(s, url, mode, http_method, buf, size);
+	oauth_signer_free(s);
+	return rv;
+}
+
+size_t oauth_sign_array2_into (int argc, char **argv,
+		OAuthOutput mode,
+		OAuthMethod method,
+		const char *http_method, //< HTTP request method
+		const char *c_key, //< consumer key - posted plain text
+		const char *c_secret, //< consumer secret - used as 1st part of secret-key
+		const char *t_key, //< token key - posted plain text in URL
+		const char *t_secret, //< token secret - used as 2st part of secret-key
+		char *buf, size_t size) {
+	size_t rv;
+	oauth_signer *s = oauth_signer_new(method, c_key, c_secret, t_key, t_secret);
+	rv = oauth_signer_sign_array_into(s, argc, argv, mode, http_method, buf, size);
+	oauth_signer_free(s);
+	return rv;
+}
+
+/**
+ * write the start of an Authorization header, up to the first oauth
+ * parameter, to 'out' unless it is NULL. The realm is a quoted-string.
+ * @return its length
+ */
+static size_t oauth_header_head(char *out, const char *realm, int flags) {
+	size_t len = 0, l;
+
+#define OA_PUT(S,L) do { if (out) memcpy(out+len, (S), (L)); len += (L); } while(0)
+	if (flags & OAUTH_HEADER_NAME) OA_PUT("Authorization: ", 15);
+	OA_PUT("OAuth ", 6);
+	if (realm) {
+		OA_PUT("realm=\"", 7);
+		while (*realm) {
+			l = strcspn(realm, "\"\\");
+			OA_PUT(realm, l);
+			realm += l;
+			if (!*realm) break;
+			OA_PUT("\\", 1);
+			OA_PUT(realm, 1);
+			realm++;
+		}
+		OA_PUT("\", ", 3);
+	}
+#undef OA_PUT
+	if (out) out[len] = '\0';
+	return len;
+}
+
+/**
+ * sign 'url' with the Authorization header as output, into 'buf' or,
+ * with 'outp' set, into a new buffer.
+ */
+static size_t oauth_header_sign(const oauth_signer *s, const char *url,
+		const char *http_method, const char *realm, int flags,
+		char *buf, size_t size, char **outp) {
+	char hbuf[128];
+	char *head;
+	size_t hl, rv;
+	oauth_norm nm;
+
+	hl = oauth_header_head(NULL, realm, flags);
+	head = hl < sizeof(hbuf) ? hbuf : (char*) xmalloc(hl + 1);
+	oauth_header_head(head, realm, flags);
+	oauth_norm_init(&nm);
+	oauth_norm_split(&nm, url, 1);
+	rv = oauth_norm_sign_into(s, &nm, OA_OUT_HEADER, http_method, head, hl, buf, size, outp);
+	oauth_norm_free(&nm);
+	if (head != hbuf) xfree(head);
+	return rv;
+}
+
+size_t oauth_signer_sign_header_into (const oauth_signer *s, const char *url,
+		const char *http_method, //< HTTP request method
+		const char *realm, int flags,
+		char *buf, size_t size) {
+	if (!s || !url) return 0;
+	return oauth_header_sign(s, url, http_method, realm, flags, buf, size, NULL);
+}
+
+char *oauth_signer_sign_header (const oauth_signer *s, const char *url,
+		const char *http_method, //< HTTP request method
+		const char *realm, int flags) {
+	char *out = NULL;
+	if (!s || !url) return NULL;
+	oauth_header_sign(s, url, http_method, realm, flags, NULL, 0, &out);
+	return out;
+}
+
+/*
+ * scatter/gather output - the parts of a request that are sent as they
+ * are stay where they are; only escaped and added parameters and the
+ * signature are written to the caller's buffer.
+ */
+
+typedef struct {
+	oauth_iovec *iov;
+	int max, n;           ///< capacity of 'iov', number of segments
+	int inbuf;            ///< the last segment is in 'buf'
+	const char *ref;      ///< start of the last segment unless it is in 'buf'
+	size_t off, len;      ///< start in 'buf' and length of the last segment
+	char *buf;
+	size_t size, used;    ///< size of 'buf', bytes used or needed
+	int open;             ///< the output ends within a parameter
+} oauth_iov_out;
+
+/**
+ * store the last segment in 'iov' if there is room.
+ */
+static void oauth_iov_flush(oauth_iov_out *o) {
+	oauth_iovec *v;
+	if (!o->n || o->n > o->max) return;
+	v = &o->iov[o->n - 1];
+	if (o->inbuf)
+		v->iov_base = o->off + o->len < o->size ? o->buf + o->off : NULL;
+	else
+		v->iov_base = (void*) o->ref;
+	v->iov_len = o->len;
+}
+
+/**
+ * add 'len' bytes at 'p', which stay valid, to the output.
+ */
+static void oauth_iov_ref(oauth_iov_out *o, const char *p, size_t len) {
+	if (!len) return;
+	if (o->n && !o->inbuf && o->ref + o->len == p) {
+		o->len += len;
+	} else {
+		oauth_iov_flush(o);
+		o->n++;
+		o->inbuf = 0;
+		o->ref = p;
+		o->len = len;
+	}
+}
+
+/**
+ * add 'len' bytes to the output in 'buf'.
+ * @return where to write them or NULL if 'buf' is too small.
+ */
+static char *oauth_iov_reserve(oauth_iov_out *o, size_t len) {
+	char *d = o->used + len < o->size ? o->buf + o->used : NULL;
+	if (o->n && o->inbuf && o->off + o->len == o->used) {
+		o->len += len;
+	} else {
+		oauth_iov_flush(o);
+		o->n++;
+		o->inbuf = 1;
+		o->off = o->used;
+		o->len = len;
+	}
+	o->used += len;
+	return d;
+}
+
+static void oauth_iov_put(oauth_iov_out *o, const char *p, size_t len) {
+	char *d;
+	if (!len) return;
+	if ((d = oauth_iov_reserve(o, len))) memcpy(d, p, len);
+}
+
+/**
+ * separate the next parameter from what is in front of it.
+ */
+static void oauth_iov_sep(oauth_iov_out *o, char sep) {
+	if (o->open) oauth_iov_put(o, &sep, 1);
+	o->open = 0;
+}
+
+/**
+ * TRUE if a parameter can be sent as it is: it decodes to what is
+ * signed and needs no escaping on the wire.
+ */
+static int oauth_iov_verbatim(const char *p, size_t len) {
+	size_t i;
+	for (i=0; i < len; i++) {
+		const unsigned char c = p[i];
+		if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) continue;
+		if (c && strchr("-._~!$'()*,;:@/?=+", c)) continue;
+		if (c == '%' && i + 2 < len && isxdigit((unsigned char) p[i+1])
+				&& isxdigit((unsigned char) p[i+2])) {
+			i += 2;
+			continue;
+		}
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * add the '&'-separated parameters in 'len' bytes of 'src' to 'nm',
+ * decoding them like a form ('+' is a space). With 'o' set they are
+ * added to the output as well: runs of parameters that can be sent as
+ * they are reference 'src', the others are written escaped, and an
+ * oauth_signature is dropped.
+ */
+static void oauth_iov_params(oauth_norm *nm, const char *src, size_t len, oauth_iov_out *o) {
+	const char *t = src, *end = src + len;
+	const char *run = NULL, *rend = NULL; // parameters to be sent as they are
+	while (t < end) {
+		const char *e = memchr(t, '&', end - t);
+		const size_t tl = (e ? e : end) - t;
+		const int drop = tl >= 16 && !strncasecmp("oauth_signature=", t, 16);
+		if (tl && !drop) oauth_norm_add_form(nm, 1, t, tl);
+		if (o && tl && !drop && oauth_iov_verbatim(t, tl)) {
+			// include the '&' in front if a parameter precedes the run
+			if (!run) run = t > src && o->open ? t-1 : t;
+			rend = t + tl;
+		} else if (o && tl) {
+			if (run) {
+				oauth_iov_ref(o, run, rend - run);
+				o->open = 1;
+			}
+			run = NULL;
+			if (!drop) {
+				const oauth_nparam *np = &nm->p[nm->n - 1];
+				oauth_iov_sep(o, '&');
+				oauth_iov_put(o, nm->buf + np->koff, np->klen);
+				if (np->flags & OAUTH_NP_VALUE) {
+					oauth_iov_put(o, "=", 1);
+					oauth_iov_put(o, nm->buf + np->voff, np->vlen);
+				}
+				o->open = 1;
+			}
+		}
+		t += tl + 1;
+	}
+	if (run) {
+		oauth_iov_ref(o, run, rend - run);
+		o->open = 1;
+	}
+}
+
+size_t oauth_signer_sign_iov (const oauth_signer *s,
+		const char *url, const char *body, size_t bodylen,
+		OAuthOutput mode,
+		const char *http_method, //< HTTP request method
+		oauth_iovec *iov, int *iovcnt,
+		char *buf, size_t size) {
+	char sbuf[512];
+	char *sig, *d;
+	const char *q;
+	size_t ql, siglen, nl, len;
+	const int hdr = mode == OA_OUT_HEADER;
+	oauth_iov_out o;
+	oauth_norm nm;
+	int i;
+
+	if (!s || !url || !iovcnt || (bodylen && !body)) return 0;
+	if (!http_method) http_method = mode==OA_OUT_POSTARGS?"POST":"GET";
+	memset(&o, 0, sizeof(o));
+	o.iov = iov;
+	o.max = iov ? *iovcnt : 0;
+	o.buf = buf;
+	o.size = buf ? size : 0;
+
+	oauth_norm_init(&nm);
+	q = strchr(url, '?');
+	ql = q ? strlen(++q) : 0;
+	oauth_norm_set_base(&nm, url, q ? (size_t) (q-1 - url) : strlen(url));
+	if (mode == OA_OUT_URL) {
+		oauth_iov_ref(&o, url, q ? (size_t) (q - url) : strlen(url));
+		o.open = !q;
+	}
+	if (q) oauth_iov_params(&nm, q, ql, mode == OA_OUT_URL ? &o : NULL);
+	if (bodylen) oauth_iov_params(&nm, body, bodylen, mode == OA_OUT_POSTARGS ? &o : NULL);
+
+	// the added oauth parameters and the signature
+	nl = oauth_norm_add_protocol(&nm, s);
+	siglen = oauth_norm_signature(s, &nm, http_method, sbuf, sizeof(sbuf), &sig);
+	if (!siglen) {
+		if (sig != sbuf) xfree(sig);
+		oauth_norm_free(&nm);
+		return 0;
+	}
+	if (!hdr) oauth_iov_sep(&o, mode == OA_OUT_URL && !q ? '?' : '&');
+	for (i=0; i < nm.n; i++) {
+		const oauth_nparam *np = &nm.p[i];
+		if (np->idx >= 0) continue; // sent as part of the request
+		oauth_iov_put(&o, nm.buf + np->koff, np->klen);
+		oauth_iov_put(&o, "=\"", hdr ? 2 : 1);
+		oauth_iov_put(&o, nm.buf + np->voff, np->vlen);
+		oauth_iov_put(&o, "\", ", hdr ? 3 : 0);
+		oauth_iov_put(&o, "&", hdr ? 0 : 1);
+	}
+	oauth_iov_put(&o, "oauth_signature=\"", hdr ? 17 : 16);
+	len = codec_url_escape_len(sig, siglen);
+	if ((d = oauth_iov_reserve(&o, len))) codec_url_escape_to(d, sig, siglen);
+	oauth_iov_put(&o, "\"", hdr ? 1 : 0);
+	oauth_iov_flush(&o);
+	oauth_norm_free(&nm);
+
+	len = o.used;
+	if (len < o.size) {
+		buf[len] = '\0';
+	} else {
+		// like oauth_norm_sign_into(): a retry uses a new nonce and signature
+		if (nl) len += OAUTH_NONCE_MAXLEN - nl;
+		if (s->method != OA_PLAINTEXT) len += 3*siglen - codec_url_escape_len(sig, siglen);
+	}
+	if (sig != sbuf) xfree(sig);
+	*iovcnt = o.n;
+	return len;
+}
+
+/*
+ * request verification - the server side of the signing functions.
+ */
+
+/**
+ * add the '&'-separated parameters of a form body or query to 'nm'.
+ */
+static void oauth_verify_form(oauth_norm *nm, const char *src, size_t len) {
+	const char *t = src, *end = src + len;
+	while (t < end) {
+		const char *e = memchr(t, '&', end - t);
+		const size_t tl = (e ? e : end) - t;
+		if (tl) oauth_norm_add_form(nm, 1, t, tl);
+		t += tl + 1;
+	}
+}
+
+/**
+ * add the parameters of an Authorization header (see \ref oauth_split_header)
+ * to 'nm', but the realm.
+ *
+ * @return 0 or -1 if the header is malformed
+ */
+static int oauth_verify_header(oauth_norm *nm, const char *h) {
+	oauth_span sp[OAUTH_HEADER_MAX_PARAMS];
+	const int n = oauth_split_header(h, strlen(h), sp, OAUTH_HEADER_MAX_PARAMS);
+	int i;
+	if (n < 0) return -1;
+	for (i=0; i < n; i++) {
+		const size_t kl = sp[i].klen, vl = sp[i].vlen;
+		char *d;
+		if (kl == 5 && !strncasecmp(h + sp[i].koff, "realm", 5)) continue;
+		// decode into scratch space behind the room for the escaped result
+		oauth_norm_reserve(nm, 4*(kl+vl) + 2);
+		d = nm->buf + nm->len + 3*(kl+vl);
+		oauth_norm_add(nm, 0, h + sp[i].koff, kl, d, oauth_header_unescape(h + sp[i].voff, vl, d));
+	}
+	return 0;
+}
+
+/**
+ * the record of a parameter with the given key or NULL.
+ */
+static const oauth_nparam *oauth_verify_param(const oauth_norm *nm, const char *key) {
+	const int i = oauth_norm_find(nm, key, strlen(key));
+	return i >= 0 ? &nm->p[i] : NULL;
+}
+
+/**
+ * TRUE if the escaped value of 'np' is 'len' bytes of 'val'.
+ */
+static int oauth_verify_is(const oauth_norm *nm, const oauth_nparam *np, const char *val, size_t len) {
+	return np->vlen == len && !memcmp(nm->buf + np->voff, val, len);
+}
+
+OAuthVerifyStatus oauth_verify_request (const oauth_signer *s,
+		const char *http_method, //< HTTP request method
+		const char *url, const char *auth_header,
+		const char *body, size_t bodylen,
+		long max_skew) {
+	char sbuf[512], bbuf[1024];
+	char *sig = sbuf, *odat;
+	const char *q, *sm;
+	const oauth_nparam *ck, *np, *tk, *ts = NULL;
+	size_t siglen = 0, blen, i;
+	OAuthVerifyStatus rv;
+	oauth_norm nm;
+	int si;
+
+	if (!s || !url || (bodylen && !body)) return OA_VERIFY_ERROR;
+	if (!http_method) http_method = bodylen ? "POST" : "GET";
+
+	// collect the parameters of the query, the body and the header
+	oauth_norm_init(&nm);
+	q = strchr(url, '?');
+	oauth_norm_set_base(&nm, url, q ? (size_t) (q - url) : strlen(url));
+	if (q) oauth_verify_form(&nm, q + 1, strlen(q + 1));
+	if (bodylen) oauth_verify_form(&nm, body, bodylen);
+	rv = OA_VERIFY_MALFORMED;
+	if (auth_header && oauth_verify_header(&nm, auth_header)) goto done;
+	// protocol parameters must not be repeated
+	for (si=0; si < nm.n; si++) {
+		np = &nm.p[si];
+		if ((np->flags & OAUTH_NP_OAUTH) && oauth_norm_find(&nm, nm.buf + np->koff, np->klen) != si)
+			goto done;
+	}
+
+	// the cheap checks first
+	rv = OA_VERIFY_MISSING;
+	ck = oauth_verify_param(&nm, "oauth_consumer_key");
+	np = oauth_verify_param(&nm, "oauth_signature_method");
+	si = oauth_norm_find(&nm, "oauth_signature", 15);
+	if (!ck || !np || si < 0) goto done;
+	if (s->method != OA_PLAINTEXT) {
+		if (!(ts = oauth_verify_param(&nm, "oauth_timestamp")) || !oauth_norm_exists(&nm, "oauth_nonce"))
+			goto done;
+	}
+	rv = OA_VERIFY_METHOD;
+	sm = s->method==OA_HMAC?"HMAC-SHA1":s->method==OA_RSA?"RSA-SHA1":"PLAINTEXT";
+	if (!oauth_verify_is(&nm, np, sm, strlen(sm))) goto done;
+	rv = OA_VERIFY_KEY;
+	if (!oauth_verify_is(&nm, ck, s->c_key_esc ? s->c_key_esc : "", s->c_key_esclen)) goto done;
+	tk = oauth_verify_param(&nm, "oauth_token");
+	if (s->t_key ? !tk || !oauth_verify_is(&nm, tk, s->t_key_esc, s->t_key_esclen) : tk && tk->vlen)
+		goto done;
+	if (ts && max_skew > 0) {
+		const int64_t now = time(NULL);
+		int64_t t = 0;
+		rv = OA_VERIFY_MALFORMED;
+		if (!ts->vlen || ts->vlen > 18) goto done;
+		for (i=0; i < ts->vlen; i++) {
+			const char c = nm.buf[ts->voff + i];
+			if (c < '0' || c > '9') goto done;
+			t = 10*t + (c - '0');
+		}
+		rv = OA_VERIFY_STALE;
+		if (t < now - max_skew || t > now + max_skew) goto done;
+	}
+
+	// the signature is not part of what is signed
+	np = &nm.p[si];
+	if (np->vlen >= sizeof(sbuf)) sig = (char*) xmalloc(np->vlen + 1);
+	siglen = codec_url_unescape_to(sig, nm.buf + np->voff, np->vlen, 0);
+	sig[siglen] = '\0';
+	nm.p[si] = nm.p[--nm.n];
+
+	rv = OA_VERIFY_BAD_SIGNATURE;
+	if (s->method == OA_PLAINTEXT) {
+		if (oauth_time_independent_equals_n(s->okey, sig, s->okeylen, siglen)) rv = OA_VERIFY_OK;
+		goto done;
+	}
+	odat = oauth_norm_sorted_base(&nm, http_method, bbuf, sizeof(bbuf), &blen);
+	if (s->method == OA_RSA) {
+		const int r = oauth_verify_rsa_sha1(odat, s->okey, sig);
+		if (r == 1) rv = OA_VERIFY_OK;
+		else if (r < 0) rv = OA_VERIFY_ERROR;
+	} else {
+		unsigned char digest[20];
+		char exp[32];
+		if (oauth_hmac_sha1_digest(s->hmac, odat, blen, digest) != 20) {
+			rv = OA_VERIFY_ERROR;
+		} else {
+			const size_t l = oauth_encode_base64_into(digest, 20, exp, sizeof(exp));
+			if (oauth_time_independent_equals_n(exp, sig, l, siglen)) rv = OA_VERIFY_OK;
+		}
+	}
+#ifdef WIPE_MEMORY
+	memset(odat, 0, blen);
+#endif
+	if (odat != bbuf) xfree(odat);
+
+done:
+#ifdef WIPE_MEMORY
+	memset(sig, 0, siglen);
+#endif
+	if (sig != sbuf) xfree(sig);
+	oauth_norm_free(&nm);
+	return rv;
+}
+
+/*
+ * oauth_params - the parameter set of the signing functions as a
+ * public container.
+ */
+
+oauth_params *oauth_params_new (void) {
+	oauth_params *p = (oauth_params*) xmalloc(sizeof(oauth_params));
+	oauth_norm_init(p);
+	return p;
+}
+
+void oauth_params_free (oauth_params *p) {
+	if (!p) return;
+	oauth_norm_free(p);
+	xfree(p);
+}
+
+void oauth_params_clear (oauth_params *p) {
+	oauth_norm_reset(p);
+}
+
+int oauth_params_add (oauth_params *p, const char *key, size_t klen, const char *value, size_t vlen) {
+	oauth_norm_add(p, p->n, key, klen, value, vlen);
+	return p->n - 1;
+}
+
+int oauth_params_add_arg (oauth_params *p, const char *arg) {
+	oauth_norm_add_arg(p, p->n, arg);
+	return p->n - 1;
+}
+
+int oauth_params_add_query (oauth_params *p, const char *query, size_t len, short qesc) {
+	oauth_span stack[32], *sp = stack;
+	int n, i;
+	n = oauth_split_spans(query, len, qesc, sp, 32);
+	if (n > 32) {
+		sp = (oauth_span*) xmalloc(n * sizeof(oauth_span));
+		oauth_split_spans(query, len, qesc, sp, n);
+	}
+	for (i=0; i < n; i++) {
+		const char *k = query + sp[i].koff, *v = query + sp[i].voff;
+		size_t kl = sp[i].klen, vl = sp[i].vlen;
+		if (sp[i].flags & (OAUTH_SPAN_KEY_ESCAPED|OAUTH_SPAN_VALUE_ESCAPED)) {
+			// decode into scratch space behind the room for the escaped result
+			char *d;
+			oauth_norm_reserve(p, 4*(kl+vl));
+			d = p->buf + p->len + 3*(kl+vl);
+			if (sp[i].flags & OAUTH_SPAN_KEY_ESCAPED) {
+				kl = oauth_span_copy(d, k, kl, qesc, 1);
+				k = d;
+			}
+			if (sp[i].flags & OAUTH_SPAN_VALUE_ESCAPED) {
+				vl = oauth_span_copy(d + kl, v, vl, qesc, 1);
+				v = d + kl;
+			}
+		}
+		oauth_norm_add(p, p->n, k, kl, (sp[i].flags & OAUTH_SPAN_HAS_VALUE) ? v : NULL, vl);
+	}
+	if (sp != stack) xfree(sp);
+	return n;
+}
+
+int oauth_params_count (const oauth_params *p) {
+	return p->n;
+}
+
+int oauth_params_find (const oauth_params *p, const char *key) {
+	char tmp[256];
+	size_t kl = strlen(key), el = codec_url_escape_len(key, kl);
+	char *ek;
+	int rv;
+	if (el == kl) return oauth_norm_find(p, key, kl);
+	ek = el < sizeof(tmp) ? tmp : (char*) xmalloc(el);
+	codec_url_escape_to(ek, key, kl);
+	rv = oauth_norm_find(p, ek, el);
+	if (ek != tmp) xfree(ek);
+	return rv;
+}
+
+const char *oauth_params_key (const oauth_params *p, int i, size_t *len) {
+	if (i < 0 || i >= p->n) return NULL;
+	if (len) *len = p->p[i].klen;
+	return p->buf + p->p[i].koff;
+}
+
+const char *oauth_params_value (const oauth_params *p, int i, size_t *len) {
+	if (i < 0 || i >= p->n || !(p->p[i].flags & OAUTH_NP_VALUE)) return NULL;
+	if (len) *len = p->p[i].vlen;
+	return p->buf + p->p[i].voff;
+}
+
+int oauth_params_is_oauth (const oauth_params *p, int i) {
+	if (i < 0 || i >= p->n) return 0;
+	return (p->p[i].flags & OAUTH_NP_OAUTH) != 0;
+}
+
+size_t oauth_signer_sign_params_into (const oauth_signer *s,
+		const char *url, const oauth_params *params,
+		OAuthOutput mode,
+		const char *http_method, //< HTTP request method
+		char *buf, size_t size) {
+	oauth_norm nm;
+	size_t rv;
+	int i;
+	if (!s || !url || !params) return 0;
+	oauth_norm_init(&nm);
+	oauth_norm_set_base(&nm, url, strlen(url));
+	// the records are copied as they are, only an old signature is dropped
+	oauth_norm_reserve(&nm, params->len);
+	for (i=0; i < params->n; i++) {
+		const oauth_nparam *np = &params->p[i];
+		oauth_nparam *cp;
+		if (np->klen == 15 && !memcmp(params->buf + np->koff, "oauth_signature", 15)) continue;
+		oauth_norm_add(&nm, i, "", 0, NULL, 0);
+		cp = &nm.p[nm.n - 1];
+		memcpy(nm.buf + nm.len, params->buf + np->koff, np->klen);
+		memcpy(nm.buf + nm.len + np->klen, params->buf + np->voff, np->vlen);
+		*cp = *np;
+		cp->idx = i;
+		cp->koff = nm.len;
+		cp->voff = nm.len + np->klen;
+		nm.len += np->klen + np->vlen;
+	}
+	oauth_norm_reindex(&nm);
+	rv = oauth_norm_sign_into(s, &nm, mode, http_method, NULL, 0, buf, size, NULL);
+	oauth_norm_free(&nm);
+	return rv;
+}
+
+/*
+ * request templates - the fixed part of a request is normalized,
+ * serialized and (for HMAC-SHA1) hashed once; a signature only splices
+ * in a new nonce and timestamp and hashes what follows them.
+ */
+
+#define OAUTH_TPL_NONCE 0     ///< generated values, see oauth_tpl
+#define OAUTH_TPL_TIMESTAMP 1
+#define OAUTH_TPL_TOKEN 2
+#define OAUTH_TPL_CONSUMER 3
+#define OAUTH_TPL_VARS 4
+
+static const char * const oauth_tpl_keys[OAUTH_TPL_VARS] = {
+	"oauth_nonce", "oauth_timestamp", "oauth_token", "oauth_consumer_key"
+};
+
+/**
+ * a request serialized with empty values for the parameters that change
+ * with every signature, and the points to insert them.
+ */
+typedef struct {
+	char *url;            ///< normalized base URL
+	char *bs;             ///< signature base string with empty generated values
+	size_t bslen;
+	char *out;            ///< output with empty generated values and signature
+	size_t outlen;
+	int quote;            ///< the signature is quoted (OA_OUT_HEADER)
+	int nvar;             ///< number of generated values
+	int var[OAUTH_TPL_VARS];    ///< OAUTH_TPL_* in the order of the records
+	size_t bat[OAUTH_TPL_VARS]; ///< insertion points in 'bs', ascending
+	size_t oat[OAUTH_TPL_VARS]; ///< insertion points in 'out', ascending
+} oauth_tpl;
+
+/**
+ * prepare the request 'url'. The nonce and the timestamp are generated
+ * unless 'url' contains them; 'vars' (bits 1<<OAUTH_TPL_*) adds the
+ * oauth_token and the oauth_consumer_key (the signer must not have them).
+ * @return 0 on success or -1 if the request already has a parameter
+ * asked for by 'vars'; 'tp' is left empty then.
+ */
+static int oauth_tpl_init(oauth_tpl *tp, const oauth_signer *s,
+		const char *url, OAuthOutput mode, const char *http_method, int vars) {
+	oauth_norm nm;
+	size_t *at;
+	int rec[OAUTH_TPL_VARS];
+	int i, k;
+
+	memset(tp, 0, sizeof(oauth_tpl));
+	if (!http_method) http_method = mode==OA_OUT_POSTARGS?"POST":"GET";
+	tp->quote = mode == OA_OUT_HEADER;
+
+	oauth_norm_init(&nm);
+	oauth_norm_split(&nm, url, mode==OA_OUT_POSTARGS ? 0 : 1);
+	for (k=OAUTH_TPL_TOKEN; k < OAUTH_TPL_VARS; k++) {
+		if ((vars & 1<<k) && oauth_norm_exists(&nm, oauth_tpl_keys[k])) {
+			oauth_norm_free(&nm);
+			return -1;
+		}
+	}
+	// placeholders: oauth_norm_add_protocol() leaves them alone
+	for (k=0; k < OAUTH_TPL_VARS; k++) {
+		const char *key = oauth_tpl_keys[k];
+		if (k >= OAUTH_TPL_TOKEN ? !(vars & 1<<k) : oauth_norm_exists(&nm, key)) continue;
+		// the empty oauth_consumer_key comes with the protocol parameters
+		if (k != OAUTH_TPL_CONSUMER)
+			oauth_norm_add_unreserved(&nm, -1, key, strlen(key), "", 0);
+		tp->var[tp->nvar++] = k;
+	}
+	oauth_norm_add_protocol(&nm, s);
+	oauth_norm_sort(&nm);
+	for (k=0; k < tp->nvar; k++) {
+		const char *key = oauth_tpl_keys[tp->var[k]];
+		rec[k] = oauth_norm_find(&nm, key, strlen(key));
+	}
+	// order the generated values like their records
+	for (k=1; k < tp->nvar; k++) {
+		for (i=k; i > 0 && rec[i-1] > rec[i]; i--) {
+			int r = rec[i], v = tp->var[i];
+			rec[i] = rec[i-1]; tp->var[i] = tp->var[i-1];
+			rec[i-1] = r; tp->var[i-1] = v;
+		}
+	}
+
+	at = (size_t*) xmalloc(nm.n * sizeof(size_t));
+	tp->url = xstrdup(nm.buf + nm.uoff);
+	tp->bslen = oauth_norm_base_string(&nm, http_method, nm.buf + nm.uoff, NULL, 0, NULL);
+	tp->bs = (char*) xmalloc(tp->bslen + 1);
+	oauth_norm_base_string(&nm, http_method, nm.buf + nm.uoff, tp->bs, tp->bslen + 1, at);
+	for (k=0; k < tp->nvar; k++) tp->bat[k] = at[rec[k]];
+	tp->outlen = oauth_norm_write(&nm, mode, "", 0, NULL, NULL);
+	tp->out = (char*) xmalloc(tp->outlen + 1);
+	oauth_norm_write(&nm, mode, "", 0, tp->out, at);
+	for (k=0; k < tp->nvar; k++) tp->oat[k] = at[rec[k]];
+	xfree(at);
+	oauth_norm_free(&nm);
+	return 0;
+}
+
+static void oauth_tpl_free(oauth_tpl *tp) {
+	xfree(tp->url);
+	xfree(tp->bs);
+	xfree(tp->out);
+	memset(tp, 0, sizeof(oauth_tpl));
+}
+
+/**
+ * copy src[from..to) to 'p', inserting the generated values at their
+ * insertion points 'at' (all >= from).
+ * @return end of the copy
+ */
+static char *oauth_tpl_splice(char *p, const char *src, size_t from, size_t to,
+		const size_t *at, const char * const *val, const size_t *vl, int n) {
+	int k;
+	for (k=0; k < n; k++) {
+		memcpy(p, src + from, at[k] - from);
+		p += at[k] - from;
+		memcpy(p, val[k], vl[k]);
+		p += vl[k];
+		from = at[k];
+	}
+	memcpy(p, src + from, to - from);
+	return p + (to - from);
+}
+
+/**
+ * length of the signed output for the given values and signature.
+ */
+static size_t oauth_tpl_outlen(const oauth_tpl *tp, const size_t *vl,
+		const char *sig, size_t siglen) {
+	size_t len = tp->outlen + codec_url_escape_len(sig, siglen);
+	int k;
+	for (k=0; k < tp->nvar; k++) len += vl[k];
+	return len;
+}
+
+/**
+ * write the signed output, oauth_tpl_outlen() + 1 bytes.
+ */
+static void oauth_tpl_write(const oauth_tpl *tp, char *buf,
+		const char * const *val, const size_t *vl,
+		const char *sig, size_t siglen) {
+	const size_t sigat = tp->outlen - tp->quote;
+	char *p = oauth_tpl_splice(buf, tp->out, 0, sigat, tp->oat, val, vl, tp->nvar);
+	p += codec_url_escape_to(p, sig, siglen);
+	memcpy(p, tp->out + sigat, tp->quote);
+	p[tp->quote] = '\0';
+}
+
+struct oauth_request_template {
+	const oauth_signer *s;
+	oauth_tpl tp;
+	oauth_hmac_sha1 *hmac; ///< the signer's key extended by the cached prefix (OA_HMAC)
+	size_t cached;        ///< length of the prefix of 'bs' absorbed into 'hmac'
+};
+
+oauth_request_template *oauth_request_template_new (const oauth_signer *s,
+		const char *url, OAuthOutput mode,
+		const char *http_method //< HTTP request method
+		) {
+	oauth_request_template *t;
+
+	if (!s || !url) return NULL;
+	t = (oauth_request_template*) xcalloc(1, sizeof(oauth_request_template));
+	t->s = s;
+	oauth_tpl_init(&t->tp, s, url, mode, http_method, 0);
+
+	if (s->method == OA_HMAC) {
+		t->cached = t->tp.nvar ? t->tp.bat[0] : t->tp.bslen;
+		if (!(t->hmac = oauth_hmac_sha1_extend(s->hmac, t->tp.bs, t->cached))) {
+			oauth_request_template_free(t);
+			return NULL;
+		}
+	}
+	return t;
+}
+
+void oauth_request_template_free (oauth_request_template *t) {
+	if (!t) return;
+	if (t->hmac) oauth_hmac_sha1_free(t->hmac);
+	oauth_tpl_free(&t->tp);
+	memset(t, 0, sizeof(oauth_request_template));
+	xfree(t);
+}
+
+size_t oauth_request_template_sign_into (const oauth_request_template *t,
+		char *buf, size_t size) {
+	const oauth_tpl *tp;
+	char vbuf[OAUTH_TPL_VARS][OAUTH_NONCE_MAXLEN+1];
+	const char *val[OAUTH_TPL_VARS];
+	size_t vl[OAUTH_TPL_VARS], vsum = 0, nl = 0;
+	char tbuf[1024], sbuf[512];
+	char *tail, *sig = sbuf;
+	unsigned char digest[20];
+	size_t tl, siglen, len;
+	int k;
+
+	if (!t) return 0;
+	tp = &t->tp;
+	for (k=0; k < tp->nvar; k++) {
+		if (tp->var[k] == OAUTH_TPL_TIMESTAMP)
+			vl[k] = snprintf(vbuf[k], sizeof(vbuf[k]), "%li", (long int) time(NULL));
+		else
+			nl = vl[k] = oauth_nonce_to(vbuf[k]);
+		val[k] = vbuf[k];
+		vsum += vl[k];
+	}
+
+	// the part of the base string that is not cached yet
+	tl = tp->bslen - t->cached + vsum;
+	tail = tl < sizeof(tbuf) ? tbuf : (char*) xmalloc(tl + 1);
+	oauth_tpl_splice(tail, tp->bs, t->cached, tp->bslen, tp->bat, val, vl, tp->nvar);
+	tail[tl] = '\0';
+	if (t->hmac) {
+		siglen = 0;
+		if (oauth_hmac_sha1_digest(t->hmac, tail, tl, digest) == 20)
+			siglen = oauth_encode_base64_into(digest, 20, sbuf, sizeof(sbuf));
+	} else {
+		siglen = oauth_signer_sign_to(t->s, tail, tl, sbuf, sizeof(sbuf));
+		if (siglen >= sizeof(sbuf)) {
+			sig = (char*) xmalloc(siglen + 1);
+			siglen = oauth_signer_sign_to(t->s, tail, tl, sig, siglen + 1);
+		}
+	}
+#ifdef WIPE_MEMORY
+	memset(tail, 0, tl);
+	memset(digest, 0, sizeof(digest));
+#endif
+	if (tail != tbuf) xfree(tail);
+	if (!siglen) {
+		if (sig != sbuf) xfree(sig);
+		return 0;
+	}
+
+	len = oauth_tpl_outlen(tp, vl, sig, siglen);
+	if (len < size) {
+		oauth_tpl_write(tp, buf, val, vl, sig, siglen);
+	} else {
+		// like oauth_norm_sign_into(): a retry uses a new nonce and signature
+		if (nl) len += OAUTH_NONCE_MAXLEN - nl;
+		if (t->s->method != OA_PLAINTEXT) len += 3*siglen - codec_url_escape_len(sig, siglen);
+	}
+	if (sig != sbuf) xfree(sig);
+	return len;
+}
+
+char *oauth_request_template_sign (const oauth_request_template *t) {
+	size_t size, len;
+	char *buf;
+	if (!t) return NULL;
+	size = t->tp.outlen + OAUTH_NONCE_MAXLEN + 24 + 3*28 + 1;
+	buf = (char*) xmalloc(size);
+	while ((len = oauth_request_template_sign_into(t, buf, size)) >= size) {
+		size = len + 1;
+		buf = (char*) xrealloc(buf, size);
+	}
+	if (!len) {
+		xfree(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+/**
+ * TRUE if both strings are equal; NULL only equals NULL.
+ */
+static int oauth_streq(const char *a, const char *b) {
+	if (!a || !b) return a == b;
+	return !strcmp(a, b);
+}
+
+/**
+ * TRUE if two batch requests use the same signature method and credentials.
+ */
+static int oauth_batch_samekey(const oauth_batch_request *a, const oauth_batch_request *b) {
+	return a->method == b->method
+		&& oauth_streq(a->c_key, b->c_key) && oauth_streq(a->c_secret, b->c_secret)
+		&& oauth_streq(a->t_key, b->t_key) && oauth_streq(a->t_secret, b->t_secret);
+}
+
+#define OAUTH_BATCH_LANES 16  ///< requests prepared and hashed together
+
+/**
+ * FNV-1a over the signature method and the credentials of a request;
+ * a NULL credential hashes differently from an empty one.
+ */
+static uint32_t oauth_batch_hash(const oauth_batch_request *r) {
+	const char *f[4];
+	uint32_t h = (2166136261u ^ (uint32_t) r->method) * 16777619u;
+	int k;
+	f[0] = r->c_key; f[1] = r->c_secret; f[2] = r->t_key; f[3] = r->t_secret;
+	for (k=0; k < 4; k++) {
+		const char *p = f[k];
+		if (p) for (; *p; p++) h = (h ^ (unsigned char) *p) * 16777619u;
+		h = (h ^ (f[k] ? 0x100u : 0x200u)) * 16777619u;
+	}
+	return h;
+}
+
+/**
+ * signers of a batch, one per distinct set of credentials, with an
+ * open-addressing index so that lookups do not depend on their number.
+ */
+typedef struct {
+	oauth_signer **sg; ///< the signers
+	int *req;          ///< request that defined the credentials of sg[k]
+	int *idx;          ///< hash index: k+1 for sg[k], 0 for an empty slot
+	int mask;          ///< size of 'idx' - 1
+	int n;             ///< number of signers
+	int last;          ///< signer of the previous request or -1
+} oauth_batch_signers;
+
+static void oauth_batch_signers_init(oauth_batch_signers *bs, int n) {
+	int hsize = 16;
+	while (hsize < 2*n) hsize <<= 1;
+	bs->sg = (oauth_signer**) xmalloc(n * sizeof(oauth_signer*));
+	bs->req = (int*) xmalloc(n * sizeof(int));
+	bs->idx = (int*) xcalloc(hsize, sizeof(int));
+	bs->mask = hsize - 1;
+	bs->n = 0;
+	bs->last = -1;
+}
+
+static void oauth_batch_signers_free(oauth_batch_signers *bs) {
+	int k;
+	for (k=0; k < bs->n; k++) oauth_signer_free(bs->sg[k]);
+	xfree(bs->sg);
+	xfree(bs->req);
+	xfree(bs->idx);
+}
+
+/**
+ * find or create the signer for the credentials of request 'i'.
+ */
+static const oauth_signer *oauth_batch_signer(oauth_batch_request *reqs, int i,
+		oauth_batch_signers *bs) {
+	oauth_batch_request *r = &reqs[i];
+	int h, k;
+	if (r->signer) return r->signer;
+	if (bs->last >= 0 && oauth_batch_samekey(r, &reqs[bs->req[bs->last]]))
+		return bs->sg[bs->last];
+	for (h = oauth_batch_hash(r) & bs->mask; (k = bs->idx[h]); h = (h+1) & bs->mask)
+		if (oauth_batch_samekey(r, &reqs[bs->req[k-1]])) break;
+	if (!k) {
+		k = ++bs->n;
+		bs->sg[k-1] = oauth_signer_new(r->method, r->c_key, r->c_secret, r->t_key, r->t_secret);
+		bs->req[k-1] = i;
+		bs->idx[h] = k;
+	}
+	bs->last = k-1;
+	return bs->sg[k-1];
+}
+
+char *oauth_sign_batch (oauth_batch_request *reqs, int n) {
+	oauth_norm *nm;    // scratch space, one per lane
+	oauth_batch_signers sg; // one signer per distinct set of credentials
+	int c, i, j;
+	unsigned char digest[OAUTH_BATCH_LANES*20];
+	char sigs[OAUTH_BATCH_LANES][32];
+	char ts[24];
+	char *bs = NULL, *out;
+	size_t tslen, bsalloc = 0, olen = 0, oalloc = 4096;
+	size_t *offs;
+
+	if (!reqs || n < 1) return NULL;
+
+	oauth_batch_signers_init(&sg, n);
+	offs = (size_t*) xmalloc(n * sizeof(size_t));
+	nm = (oauth_norm*) xmalloc(OAUTH_BATCH_LANES * sizeof(oauth_norm));
+	out = (char*) xmalloc(oalloc);
+	tslen = snprintf(ts, sizeof(ts), "%li", (long int) time(NULL));
+	for (j=0; j < OAUTH_BATCH_LANES; j++) oauth_norm_init(&nm[j]);
+
+	for (c=0; c < n; c += OAUTH_BATCH_LANES) {
+		const int g = n - c < OAUTH_BATCH_LANES ? n - c : OAUTH_BATCH_LANES;
+		const oauth_signer *ls[OAUTH_BATCH_LANES];
+		const oauth_hmac_sha1 *hk[OAUTH_BATCH_LANES];
+		const char *hm[OAUTH_BATCH_LANES];
+		size_t hl[OAUTH_BATCH_LANES], boff[OAUTH_BATCH_LANES], blen[OAUTH_BATCH_LANES];
+		char *sig[OAUTH_BATCH_LANES];
+		size_t siglen[OAUTH_BATCH_LANES];
+		size_t bslen = 0;
+		int nh = 0;
+
+		// 1st: normalize the requests and build their base strings
+		for (j=0; j < g; j++) {
+			oauth_batch_request *r = &reqs[c+j];
+			const char *http_method = r->http_method;
+			int k;
+
+			offs[c+j] = (size_t) -1;
+			sig[j] = NULL;
+			ls[j] = NULL;
+			if (!r->url && (r->argc < 1 || !r->argv)) continue;
+			if (!(ls[j] = oauth_batch_signer(reqs, c+j, &sg))) continue;
+
+			oauth_norm_reset(&nm[j]);
+			if (r->url) {
+				oauth_norm_split(&nm[j], r->url, r->mode==OA_OUT_POSTARGS ? 0 : 1);
+			} else {
+				oauth_norm_copy_base(&nm[j], r->argv[0], strlen(r->argv[0]));
+				for (k=1; k < r->argc; k++) oauth_norm_add_arg(&nm[j], k, r->argv[k]);
+			}
+
+			// the timestamp is shared by the batch, nonces come from the
+			// thread's random pool
+			if (!oauth_norm_exists(&nm[j], "oauth_timestamp"))
+				oauth_norm_add_unreserved(&nm[j], -1, "oauth_timestamp", 15, ts, tslen);
+			oauth_norm_add_protocol(&nm[j], ls[j]);
+			oauth_norm_sort(&nm[j]);
+
+			if (!http_method) http_method = r->mode==OA_OUT_POSTARGS?"POST":"GET";
+			blen[j] = oauth_norm_base_string(&nm[j], http_method, nm[j].buf + nm[j].uoff, NULL, 0, NULL);
+			if (bslen + blen[j] + 1 > bsalloc) {
+				bsalloc = 2 * (bslen + blen[j] + 1);
+				bs = (char*) xrealloc(bs, bsalloc);
+			}
+			oauth_norm_base_string(&nm[j], http_method, nm[j].buf + nm[j].uoff, bs + bslen, blen[j] + 1, NULL);
+			boff[j] = bslen;
+			bslen += blen[j] + 1;
+		}
+
+		// 2nd: sign; HMAC-SHA1 requests are hashed side by side
+		for (j=0; j < g; j++) {
+			if (!ls[j]) continue;
+			if (ls[j]->method == OA_HMAC) {
+				hk[nh] = ls[j]->hmac;
+				hm[nh] = bs + boff[j];
+				hl[nh++] = blen[j];
+			} else {
+				sig[j] = oauth_signer_sign(ls[j], bs + boff[j], blen[j]);
+				siglen[j] = sig[j] ? strlen(sig[j]) : 0;
+			}
+		}
+		if (nh && oauth_hmac_sha1_digest_multi(hk, hm, hl, digest, nh) == nh) {
+			for (j=0, nh=0; j < g; j++) {
+				if (!ls[j] || ls[j]->method != OA_HMAC) continue;
+				siglen[j] = oauth_encode_base64_into(digest + 20*(nh++), 20, sigs[j], sizeof(sigs[j]));
+				sig[j] = sigs[j];
+			}
+		}
+#ifdef WIPE_MEMORY
+		if (bs) memset(bs, 0, bslen);
+#endif
+
+		// 3rd: write the results
+		for (j=0; j < g; j++) {
+			size_t len;
+			if (!sig[j]) continue;
+			len = oauth_norm_write(&nm[j], reqs[c+j].mode, sig[j], siglen[j], NULL, NULL);
+			if (olen + len + 1 > oalloc) {
+				while (olen + len + 1 > oalloc) oalloc *= 2;
+				out = (char*) xrealloc(out, oalloc);
+			}
+			oauth_norm_write(&nm[j], reqs[c+j].mode, sig[j], siglen[j], out + olen, NULL);
+			offs[c+j] = olen;
+			olen += len + 1;
+			if (sig[j] != sigs[j]) xfree(sig[j]);
+		}
+	}
+
+	// the output block does not move anymore
+	for (i=0; i < n; i++)
+		reqs[i].result = offs[i] == (size_t) -1 ? NULL : out + offs[i];
+
+#ifdef WIPE_MEMORY
+	memset(digest, 0, sizeof(digest));
+#endif
+	for (j=0; j < OAUTH_BATCH_LANES; j++) oauth_norm_free(&nm[j]);
+	oauth_batch_signers_free(&sg);
+	if (bs) xfree(bs);
+	xfree(nm);
+	xfree(offs);
+	return out;
+}
+
+char *oauth_sign_fanout (const char *url,
+		OAuthOutput mode,
+		OAuthMethod method,
+		const char *http_method, //< HTTP request method
+		const char *c_key, //< consumer key - posted plain text
+		const char *c_secret, //< consumer secret - used as 1st part of secret-key
+		oauth_fanout_token *tokens, int n) {
+	oauth_signer *s;
+	oauth_tpl tp;
+	unsigned char digest[OAUTH_BATCH_LANES*20];
+	char ts[24];
+	char *ck, *bs = NULL, *esc = NULL, *out;
+	size_t tslen, cklen, bsalloc = 0, escalloc = 0, olen = 0, oalloc;
+	size_t *offs;
+	int c, i, j, k;
+
+	if (!url || !tokens || n < 1) return NULL;
+	s = oauth_signer_new(method, c_key, c_secret, NULL, NULL);
+	if (oauth_tpl_init(&tp, s, url, mode, http_method, 1<<OAUTH_TPL_TOKEN)) {
+		oauth_signer_free(s);
+		return NULL;
+	}
+	ck = oauth_url_escape(c_secret ? c_secret : "");
+	cklen = strlen(ck);
+	tslen = snprintf(ts, sizeof(ts), "%li", (long int) time(NULL));
+	offs = (size_t*) xmalloc(n * sizeof(size_t));
+	oalloc = 4096;
+	out = (char*) xmalloc(oalloc);
+
+	for (c=0; c < n; c += OAUTH_BATCH_LANES) {
+		const int g = n - c < OAUTH_BATCH_LANES ? n - c : OAUTH_BATCH_LANES;
+		char nonce[OAUTH_BATCH_LANES][OAUTH_NONCE_MAXLEN+1];
+		const char *bval[OAUTH_BATCH_LANES][OAUTH_TPL_VARS], *oval[OAUTH_BATCH_LANES][OAUTH_TPL_VARS];
+		size_t bvl[OAUTH_BATCH_LANES][OAUTH_TPL_VARS], ovl[OAUTH_BATCH_LANES][OAUTH_TPL_VARS];
+		size_t tkl[OAUTH_BATCH_LANES], tsl[OAUTH_BATCH_LANES], boff[OAUTH_BATCH_LANES], blen[OAUTH_BATCH_LANES];
+		oauth_hmac_sha1 *key[OAUTH_BATCH_LANES];
+		const oauth_hmac_sha1 *hk[OAUTH_BATCH_LANES];
+		const char *hm[OAUTH_BATCH_LANES];
+		size_t hl[OAUTH_BATCH_LANES];
+		int hj[OAUTH_BATCH_LANES];
+		char sigs[OAUTH_BATCH_LANES][32];
+		char *sig[OAUTH_BATCH_LANES];
+		size_t siglen[OAUTH_BATCH_LANES];
+		size_t elen = 0, bslen = 0;
+		int nh = 0;
+
+		// 1st: escape the tokens - once for the output, twice for the
+		// base string - and the token secrets into one buffer
+		for (j=0; j < g; j++) {
+			const oauth_fanout_token *tk = &tokens[c+j];
+			const char *tsec = tk->t_secret ? tk->t_secret : "";
+			offs[c+j] = (size_t) -1;
+			sig[j] = NULL;
+			key[j] = NULL;
+			if (!tk->t_key) continue;
+			tkl[j] = codec_url_escape_len(tk->t_key, strlen(tk->t_key));
+			tsl[j] = codec_url_escape_len(tsec, strlen(tsec));
+			elen += 2 * tkl[j] + 3 * tkl[j] + tsl[j];
+		}
+		if (elen > escalloc) {
+			escalloc = 2 * elen;
+			esc = (char*) xrealloc(esc, escalloc);
+		}
+		for (j=0, elen=0; j < g; j++) {
+			const oauth_fanout_token *tk = &tokens[c+j];
+			const char *tsec = tk->t_secret ? tk->t_secret : "";
+			char *te, *te2, *se;
+			if (!tk->t_key) continue;
+			te = esc + elen;
+			codec_url_escape_to(te, tk->t_key, strlen(tk->t_key));
+			te2 = te + tkl[j];
+			se = te2 + codec_url_escape_to(te2, te, tkl[j]);
+			codec_url_escape_to(se, tsec, strlen(tsec));
+			for (k=0; k < tp.nvar; k++) {
+				switch (tp.var[k]) {
+					case OAUTH_TPL_NONCE:
+						bval[j][k] = oval[j][k] = nonce[j];
+						bvl[j][k] = ovl[j][k] = oauth_nonce_to(nonce[j]);
+						break;
+					case OAUTH_TPL_TIMESTAMP:
+						bval[j][k] = oval[j][k] = ts;
+						bvl[j][k] = ovl[j][k] = tslen;
+						break;
+					default:
+						bval[j][k] = te2; bvl[j][k] = se - te2;
+						oval[j][k] = te; ovl[j][k] = tkl[j];
+				}
+			}
+			// the signing key: escaped consumer secret '&' escaped token secret
+			if (method == OA_HMAC) {
+				char kbuf[256], *kp;
+				size_t kl = cklen + 1 + tsl[j];
+				kp = kl < sizeof(kbuf) ? kbuf : (char*) xmalloc(kl);
+				memcpy(kp, ck, cklen);
+				kp[cklen] = '&';
+				memcpy(kp + cklen + 1, se, tsl[j]);
+				key[j] = oauth_hmac_sha1_new(kp, kl);
+#ifdef WIPE_MEMORY
+				memset(kp, 0, kl);
+#endif
+				if (kp != kbuf) xfree(kp);
+			}
+			blen[j] = tp.bslen;
+			for (k=0; k < tp.nvar; k++) blen[j] += bvl[j][k];
+			boff[j] = bslen;
+			bslen += blen[j] + 1;
+			elen += 5 * tkl[j] + tsl[j];
+		}
+
+		// 2nd: splice the base strings and sign them
+		if (bslen > bsalloc) {
+			bsalloc = 2 * bslen;
+			bs = (char*) xrealloc(bs, bsalloc);
+		}
+		for (j=0; j < g; j++) {
+			char *b;
+			if (!tokens[c+j].t_key) continue;
+			b = bs + boff[j];
+			oauth_tpl_splice(b, tp.bs, 0, tp.bslen, tp.bat, bval[j], bvl[j], tp.nvar);
+			b[blen[j]] = '\0';
+			if (method == OA_HMAC) {
+				if (!key[j]) continue;
+				hk[nh] = key[j];
+				hm[nh] = b;
+				hl[nh] = blen[j];
+				hj[nh++] = j;
+			} else {
+				oauth_signer *ps = oauth_signer_new(method, c_key, c_secret,
+						tokens[c+j].t_key, tokens[c+j].t_secret);
+				sig[j] = oauth_signer_sign(ps, b, blen[j]);
+				siglen[j] = sig[j] ? strlen(sig[j]) : 0;
+				oauth_signer_free(ps);
+			}
+		}
+		if (nh && oauth_hmac_sha1_digest_multi(hk, hm, hl, digest, nh) == nh) {
+			for (i=0; i < nh; i++) {
+				j = hj[i];
+				siglen[j] = oauth_encode_base64_into(digest + 20*i, 20, sigs[j], sizeof(sigs[j]));
+				sig[j] = sigs[j];
+			}
+		}
+		for (j=0; j < g; j++) if (key[j]) oauth_hmac_sha1_free(key[j]);
+#ifdef WIPE_MEMORY
+		if (bs) memset(bs, 0, bslen);
+#endif
+
+		// 3rd: write the results
+		for (j=0; j < g; j++) {
+			size_t len;
+			if (!sig[j]) continue;
+			len = oauth_tpl_outlen(&tp, ovl[j], sig[j], siglen[j]);
+			if (olen + len + 1 > oalloc) {
+				while (olen + len + 1 > oalloc) oalloc *= 2;
+				out = (char*) xrealloc(out, oalloc);
+			}
+			oauth_tpl_write(&tp, out + olen, oval[j], ovl[j], sig[j], siglen[j]);
+			offs[c+j] = olen;
+			olen += len + 1;
+			if (sig[j] != sigs[j]) xfree(sig[j]);
+		}
+#ifdef WIPE_MEMORY
+		if (esc) memset(esc, 0, elen);
+#endif
+	}
+
+	// the output block does not move anymore
+	for (i=0; i < n; i++)
+		tokens[i].result = offs[i] == (size_t) -1 ? NULL : out + offs[i];
+
+#ifdef WIPE_MEMORY
+	memset(digest, 0, sizeof(digest));
+	memset(ck, 0, cklen);
+#endif
+	xfree(ck);
+	if (bs) xfree(bs);
+	if (esc) xfree(esc);
+	xfree(offs);
+	oauth_tpl_free(&tp);
+	oauth_signer_free(s);
+	return out;
+}
+
+/*
+ * normalization cache for oauth_signer_sign_url() - an opt-in LRU maps
+ * the raw request (URL, output mode, signature method, HTTP method and
+ * whether there is a token) to a template with empty credentials, nonce
+ * and timestamp, so a repeated request is not split, sorted and
+ * serialized again.
+ */
+
+#if defined(__GNUC__) && !defined(WIN32)
+#  define OAUTH_SIGN_CACHE
+#endif
+
+#ifdef OAUTH_SIGN_CACHE
+
+typedef struct oauth_cache_entry {
+	struct oauth_cache_entry *prev, *next; ///< LRU list, most recently used first
+	struct oauth_cache_entry *chain;       ///< next entry in the bucket or the free list
+	uint32_t hash;
+	char *key;
+	size_t klen;
+	int refs;             ///< signatures in progress, +1 while the entry is cached
+	int bypass;           ///< the request has its own credentials: sign it uncached
+	oauth_tpl tp;
+} oauth_cache_entry;
+
+static struct {
+	int lock;
+	int max, n;           ///< capacity and number of entries
+	uint32_t mask;        ///< number of buckets - 1
+	oauth_cache_entry **bucket;
+	oauth_cache_entry *head, *tail;
+	unsigned long hits, misses;
+} oauth_cache;
+
+static void oauth_cache_lock(void) {
+	while (__atomic_exchange_n(&oauth_cache.lock, 1, __ATOMIC_ACQUIRE))
+		while (__atomic_load_n(&oauth_cache.lock, __ATOMIC_RELAXED))
+			sched_yield();
+}
+
+static void oauth_cache_unlock(void) {
+	__atomic_store_n(&oauth_cache.lock, 0, __ATOMIC_RELEASE);
+}
+
+static void oauth_cache_entry_free(oauth_cache_entry *e) {
+	while (e) {
+		oauth_cache_entry *next = e->chain;
+		oauth_tpl_free(&e->tp);
+		xfree(e->key);
+		xfree(e);
+		e = next;
+	}
+}
+
+/**
+ * drop a reference to 'e' (lock held); the last one moves it to the
+ * free list '*dead'.
+ */
+static void oauth_cache_unref(oauth_cache_entry *e, oauth_cache_entry **dead) {
+	if (--e->refs) return;
+	e->chain = *dead;
+	*dead = e;
+}
+
+static oauth_cache_entry *oauth_cache_find(const char *key, size_t klen, uint32_t h) {
+	oauth_cache_entry *e = oauth_cache.bucket[h & oauth_cache.mask];
+	while (e && (e->hash != h || e->klen != klen || memcmp(e->key, key, klen)))
+		e = e->chain;
+	return e;
+}
+
+/**
+ * move 'e' to the front of the LRU list, inserting it if 'link' is set.
+ */
+static void oauth_cache_touch(oauth_cache_entry *e, int link) {
+	if (!link) {
+		if (!e->prev) return;
+		e->prev->next = e->next;
+		if (e->next) e->next->prev = e->prev;
+		else oauth_cache.tail = e->prev;
+	}
+	e->prev = NULL;
+	e->next = oauth_cache.head;
+	if (oauth_cache.head) oauth_cache.head->prev = e;
+	else oauth_cache.tail = e;
+	oauth_cache.head = e;
+}
+
+/**
+ * remove the least recently used entry.
+ */
+static void oauth_cache_evict(oauth_cache_entry **dead) {
+	oauth_cache_entry *e = oauth_cache.tail;
+	oauth_cache_entry **pp = &oauth_cache.bucket[e->hash & oauth_cache.mask];
+	while (*pp != e) pp = &(*pp)->chain;
+	*pp = e->chain;
+	oauth_cache.tail = e->prev;
+	if (e->prev) e->prev->next = NULL;
+	else oauth_cache.head = NULL;
+	oauth_cache.n--;
+	oauth_cache_unref(e, dead);
+}
+
+int oauth_sign_cache_size(int entries) {
+	oauth_cache_entry **bucket = NULL, **old, *dead = NULL;
+	uint32_t nb = 1;
+	int rv;
+
+	if (entries < 0) entries = 0;
+	if (entries) {
+		while (nb < (uint32_t) entries && nb < 0x40000000u) nb <<= 1;
+		bucket = (oauth_cache_entry**) xcalloc(nb, sizeof(oauth_cache_entry*));
+	}
+	oauth_cache_lock();
+	while (oauth_cache.n) oauth_cache_evict(&dead);
+	rv = oauth_cache.max;
+	old = oauth_cache.bucket;
+	oauth_cache.bucket = bucket;
+	oauth_cache.mask = nb - 1;
+	__atomic_store_n(&oauth_cache.max, entries, __ATOMIC_RELAXED);
+	oauth_cache_unlock();
+	if (old) xfree(old);
+	oauth_cache_entry_free(dead);
+	return rv;
+}
+
+void oauth_sign_cache_stats(unsigned long *hits, unsigned long *misses) {
+	oauth_cache_lock();
+	if (hits) *hits = oauth_cache.hits;
+	if (misses) *misses = oauth_cache.misses;
+	oauth_cache_unlock();
+}
+
+/**
+ * fill in the template of oauth_cache_sign() with the credentials of
+ * 's' and a new nonce and timestamp, and sign it.
+ * @return the result of oauth_signer_sign_url() or NULL if signing failed.
+ */
+static char *oauth_cache_sign_tpl(const oauth_signer *s, const oauth_tpl *tp,
+		char **postargs) {
+	char vbuf[2][OAUTH_NONCE_MAXLEN+1];
+	const char *oval[OAUTH_TPL_VARS], *bval[OAUTH_TPL_VARS];
+	size_t ovl[OAUTH_TPL_VARS], bvl[OAUTH_TPL_VARS];
+	char ebuf[256], bbuf[1024], sbuf[512];
+	char *esc, *e, *bs, *out, *sig = sbuf;
+	size_t elen = 0, blen = tp->bslen, siglen;
+	int k;
+
+	for (k=0; k < tp->nvar; k++) {
+		switch (tp->var[k]) {
+			case OAUTH_TPL_NONCE:
+				ovl[k] = oauth_nonce_to(vbuf[0]);
+				oval[k] = vbuf[0];
+				break;
+			case OAUTH_TPL_TIMESTAMP:
+				ovl[k] = snprintf(vbuf[1], sizeof(vbuf[1]), "%li", (long int) time(NULL));
+				oval[k] = vbuf[1];
+				break;
+			case OAUTH_TPL_TOKEN:
+				oval[k] = s->t_key_esc;
+				ovl[k] = s->t_key_esclen;
+				break;
+			default:
+				oval[k] = s->c_key_esc ? s->c_key_esc : "";
+				ovl[k] = s->c_key_esclen;
+		}
+		elen += codec_url_escape_len(oval[k], ovl[k]);
+	}
+	// the base string has every value escaped once more
+	esc = elen < sizeof(ebuf) ? ebuf : (char*) xmalloc(elen);
+	for (e = esc, k=0; k < tp->nvar; k++) {
+		bval[k] = e;
+		bvl[k] = codec_url_escape_to(e, oval[k], ovl[k]);
+		e += bvl[k];
+		blen += bvl[k];
+	}
+	bs = blen < sizeof(bbuf) ? bbuf : (char*) xmalloc(blen + 1);
+	oauth_tpl_splice(bs, tp->bs, 0, tp->bslen, tp->bat, bval, bvl, tp->nvar);
+	bs[blen] = '\0';
+	siglen = oauth_signer_sign_to(s, bs, blen, sbuf, sizeof(sbuf));
+	if (siglen >= sizeof(sbuf)) {
+		sig = (char*) xmalloc(siglen + 1);
+		siglen = oauth_signer_sign_to(s, bs, blen, sig, siglen + 1);
+	}
+#ifdef WIPE_MEMORY
+	memset(bs, 0, blen);
+#endif
+	if (bs != bbuf) xfree(bs);
+	if (esc != ebuf) xfree(esc);
+	if (!siglen) {
+		if (sig != sbuf) xfree(sig);
+		return NULL;
+	}
+
+	out = (char*) xmalloc(oauth_tpl_outlen(tp, ovl, sig, siglen) + 1);
+	oauth_tpl_write(tp, out, oval, ovl, sig, siglen);
+	if (sig != sbuf) xfree(sig);
+	if (postargs) {
+		*postargs = out;
+		return xstrdup(tp->url);
+	}
+	return out;
+}
+
+/**
+ * oauth_signer_sign_url() through the cache.
+ * @return NULL if the cache is disabled or does not apply.
+ */
+static char *oauth_cache_sign(const oauth_signer *s, const char *url,
+		char **postargs, const char *http_method) {
+	const OAuthOutput mode = postargs ? OA_OUT_POSTARGS : OA_OUT_URL;
+	oauth_cache_entry *e, *dead = NULL;
+	char kbuf[512], *key, *rv;
+	size_t ml, ul, klen;
+	uint32_t h;
+
+	if (!__atomic_load_n(&oauth_cache.max, __ATOMIC_RELAXED)) return NULL;
+	if (!s || !url || !*url) return NULL;
+	// the argv path truncates parameters at an escaped NUL
+	if (strstr(url, "%00")) return NULL;
+
+	if (!http_method) http_method = postargs?"POST":"GET";
+	ml = strlen(http_method);
+	ul = strlen(url);
+	klen = 3 + ml + 1 + ul;
+	key = klen < sizeof(kbuf) ? kbuf : (char*) xmalloc(klen);
+	key[0] = (char) mode;
+	key[1] = (char) s->method;
+	key[2] = s->t_key ? 1 : 0;
+	memcpy(key + 3, http_method, ml + 1);
+	memcpy(key + 4 + ml, url, ul);
+	h = oauth_norm_hash(key, klen);
+
+	oauth_cache_lock();
+	e = oauth_cache.max ? oauth_cache_find(key, klen, h) : NULL;
+	if (e) {
+		if (!e->bypass) oauth_cache.hits++;
+		oauth_cache_touch(e, 0);
+		e->refs++;
+	} else {
+		oauth_cache.misses++;
+	}
+	oauth_cache_unlock();
+
+	if (!e) {
+		oauth_cache_entry *n = (oauth_cache_entry*) xcalloc(1, sizeof(oauth_cache_entry));
+		oauth_signer ps;
+		memset(&ps, 0, sizeof(ps));
+		ps.method = s->method;
+		// credentials in the request itself do not fit the template;
+		// the entry remembers that, so the URL is parsed once only
+		n->bypass = oauth_tpl_init(&n->tp, &ps, url, mode, http_method,
+				1<<OAUTH_TPL_CONSUMER | (s->t_key ? 1<<OAUTH_TPL_TOKEN : 0)) != 0;
+		n->key = (char*) xmalloc(klen);
+		memcpy(n->key, key, klen);
+		n->klen = klen;
+		n->hash = h;
+		n->refs = 1;
+
+		oauth_cache_lock();
+		if (!oauth_cache.max) {
+			e = n;  // disabled meanwhile: used once
+		} else if ((e = oauth_cache_find(key, klen, h))) {
+			oauth_cache_touch(e, 0);  // added by another thread
+			e->refs++;
+			dead = n;
+		} else {
+			e = n;
+			n->refs++;
+			n->chain = oauth_cache.bucket[h & oauth_cache.mask];
+			oauth_cache.bucket[h & oauth_cache.mask] = n;
+			oauth_cache_touch(n, 1);
+			if (++oauth_cache.n > oauth_cache.max) oauth_cache_evict(&dead);
+		}
+		oauth_cache_unlock();
+		oauth_cache_entry_free(dead);
+		dead = NULL;
+	}
+	if (key != kbuf) xfree(key);
+
+	rv = e->bypass ? NULL : oauth_cache_sign_tpl(s, &e->tp, postargs);
+	oauth_cache_lock();
+	oauth_cache_unref(e, &dead);
+	oauth_cache_unlock();
+	oauth_cache_entry_free(dead);
+	return rv;
+}
+
+#else
+
+int oauth_sign_cache_size(int entries) {
+	return -1;
+}
+
+void oauth_sign_cache_stats(unsigned long *hits, unsigned long *misses) {
+	if (hits) *hits = 0;
+	if (misses) *misses = 0;
+}
+
+static char *oauth_cache_sign(const oauth_signer *s, const char *url,
+		char **postargs, const char *http_method) {
+	return NULL;
+}
+
+#endif
+
+/*
+ * nonce replay cache - a timing wheel of open addressing tables.
+ *
+ * A request's (consumer key, token, nonce, timestamp) is stored as a
+ * keyed 64-bit hash (SipHash-2-4) in the table of its timestamp's
+ * bucket, so a replay is searched for in one table only. The buckets
+ * form a ring spanning twice the window plus a bucket: a table is
+ * cleared, by the first thread that needs it, when the bucket it held
+ * has expired and a new one takes its place. Each bucket is sharded
+ * into several tables by the hash, so no single clear is large.
+ * Slots are claimed with compare-and-swap; there are no locks.
+ *
+ * The tables of a shared cache live in a MAP_SHARED mapping behind a
+ * header with the hash key and the layout, so that forked or unrelated
+ * processes use the same tables. A table being cleared carries the pid
+ * of the clearing process in its tag: if that process dies halfway,
+ * the next one to need the table notices and clears it again.
+ */
+
+#if defined(__GNUC__) && !defined(WIN32)
+#  define OAUTH_REPLAY_CACHE
+#endif
+
+#ifdef OAUTH_REPLAY_CACHE
+
+#define OAUTH_REPLAY_BUCKETS 32 ///< buckets of the timing wheel
+#define OAUTH_REPLAY_SHARDS 16  ///< tables per bucket
+#define OAUTH_REPLAY_PROBES 32  ///< longest probe sequence before a table counts as full
+#define OAUTH_REPLAY_OWNER 0xffffff ///< tag bits: pid of the process clearing the table
+#define OAUTH_REPLAY_TAG(b) (((uint64_t) (b) + 1) << 24) ///< tag of a table holding bucket 'b'
+#define OAUTH_REPLAY_MAGIC 0x316372687475616fULL ///< "oauthrc1", marks an initialized shared cache
+
+typedef struct {
+	uint64_t tag;     ///< (bucket + 1) << 24, plus the owner while being cleared; 0 = unused
+	uint64_t pad[7];  ///< keeps the slots off the tag's cache line
+} oauth_replay_tab;   ///< followed by the slots, 0 = empty
+
+typedef struct {
+	uint64_t magic;   ///< OAUTH_REPLAY_MAGIC once the rest is valid
+	uint64_t k0, k1;
+	int64_t window, gran;
+	uint64_t nslots, tabsize;
+	uint64_t pad;
+} oauth_replay_shm;   ///< head of a shared cache, followed by the tables
+
+struct oauth_replay_cache {
+	uint64_t k0, k1;  ///< hash key
+	long window;      ///< accepted timestamp distance from now
+	long gran;        ///< seconds per bucket
+	size_t nslots;    ///< slots per table, a power of two
+	size_t tabsize;   ///< bytes per table including its tag
+	unsigned char *mem;
+	void *map;        ///< the mapping of a shared cache, else NULL
+	size_t maplen;
+};
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define OAUTH_ROTL64(x,b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define OAUTH_SIPROUND do { \
+	v0 += v1; v1 = OAUTH_ROTL64(v1,13); v1 ^= v0; v0 = OAUTH_ROTL64(v0,32); \
+	v2 += v3; v3 = OAUTH_ROTL64(v3,16); v3 ^= v2; \
+	v0 += v3; v3 = OAUTH_ROTL64(v3,21); v3 ^= v0; \
+	v2 += v1; v1 = OAUTH_ROTL64(v1,17); v1 ^= v2; v2 = OAUTH_ROTL64(v2,32); \
+} while (0)
+
+/**
+ * SipHash-2-4 of 'len' bytes of 'm'.
+ */
+static uint64_t oauth_siphash(uint64_t k0, uint64_t k1, const unsigned char *m, size_t len) {
+	uint64_t v0 = k0 ^ 0x736f6d6570736575ULL, v1 = k1 ^ 0x646f72616e646f6dULL;
+	uint64_t v2 = k0 ^ 0x6c7967656e657261ULL, v3 = k1 ^ 0x7465646279746573ULL;
+	uint64_t b = (uint64_t) len << 56, w;
+	size_t i, j;
+	for (i=0; i + 8 <= len; i += 8) {
+		for (w=0, j=0; j < 8; j++) w |= (uint64_t) m[i+j] << (8*j);
+		v3 ^= w;
+		OAUTH_SIPROUND; OAUTH_SIPROUND;
+		v0 ^= w;
+	}
+	for (j=0; i + j < len; j++) b |= (uint64_t) m[i+j] << (8*j);
+	v3 ^= b;
+	OAUTH_SIPROUND; OAUTH_SIPROUND;
+	v0 ^= b;
+	v2 ^= 0xff;
+	OAUTH_SIPROUND; OAUTH_SIPROUND; OAUTH_SIPROUND; OAUTH_SIPROUND;
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+#undef OAUTH_SIPROUND
+#undef OAUTH_ROTL64
+
+/**
+ * append a length-prefixed string to 'm'.
+ */
+static unsigned char *oauth_replay_put(unsigned char *m, const char *str, size_t len) {
+	size_t i;
+	for (i=0; i < 4; i++) *m++ = (unsigned char) (len >> (8*i));
+	if (len) memcpy(m, str, len);
+	return m + len;
+}
+
+/**
+ * the keyed hash of a request, never 0.
+ */
+static uint64_t oauth_replay_hash(const oauth_replay_cache *c,
+		const char *c_key, const char *t_key, const char *nonce, long timestamp) {
+	unsigned char sbuf[256], *m, *p;
+	const size_t cl = strlen(c_key), tl = t_key ? strlen(t_key) : 0, nl = strlen(nonce);
+	const size_t len = cl + tl + nl + 20;
+	uint64_t h;
+	int i;
+	m = len <= sizeof(sbuf) ? sbuf : (unsigned char*) xmalloc(len);
+	p = oauth_replay_put(m, c_key, cl);
+	p = oauth_replay_put(p, t_key, tl);
+	p = oauth_replay_put(p, nonce, nl);
+	for (i=0; i < 8; i++) *p++ = (unsigned char) ((uint64_t) timestamp >> (8*i));
+	h = oauth_siphash(c->k0, c->k1, m, len);
+	if (m != sbuf) xfree(m);
+	return h ? h : 1;
+}
+
+/**
+ * set up the layout and a new hash key of a cache of 'bytes' bytes.
+ */
+static void oauth_replay_init(oauth_replay_cache *c, size_t bytes, long window) {
+	size_t n = 8;
+	unsigned char key[16];
+	int i;
+
+	// tables of the same, power of two size
+	while ((sizeof(oauth_replay_tab) + 2*n * sizeof(uint64_t))
+			* OAUTH_REPLAY_BUCKETS * OAUTH_REPLAY_SHARDS <= bytes) n *= 2;
+	c->window = window;
+	// the ring holds all timestamps from now - window to now + window
+	c->gran = (2*window + OAUTH_REPLAY_BUCKETS - 2) / (OAUTH_REPLAY_BUCKETS - 1);
+	c->nslots = n;
+	c->tabsize = sizeof(oauth_replay_tab) + n * sizeof(uint64_t);
+	oauth_random_bytes(key, sizeof(key));
+	for (i=0; i < 8; i++) {
+		c->k0 |= (uint64_t) key[i] << (8*i);
+		c->k1 |= (uint64_t) key[i+8] << (8*i);
+	}
+}
+
+oauth_replay_cache *oauth_replay_cache_new (size_t bytes, long window) {
+	oauth_replay_cache *c;
+	if (window < 1) return NULL;
+	c = (oauth_replay_cache*) xcalloc(1, sizeof(oauth_replay_cache));
+	oauth_replay_init(c, bytes, window);
+	c->mem = (unsigned char*) xcalloc(OAUTH_REPLAY_BUCKETS * OAUTH_REPLAY_SHARDS, c->tabsize);
+	return c;
+}
+
+/**
+ * attach to the shared cache 'fd', whose layout must fit 'window'.
+ * Another process may just be creating it, so wait up to about a
+ * second for it to be initialized.
+ * @return 0 on success
+ */
+static int oauth_replay_attach(oauth_replay_cache *c, int fd, long window) {
+	oauth_replay_shm *hd;
+	struct stat st;
+	int w;
+
+	for (w=0; ; w++) {
+		if (fstat(fd, &st)) return -1;
+		if (st.st_size > 0) break;
+		if (w == 1000) return -1;
+		usleep(1000);
+	}
+	c->maplen = st.st_size;
+	c->map = mmap(NULL, c->maplen, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (c->map == MAP_FAILED) {
+		c->map = NULL;
+		return -1;
+	}
+	if (c->maplen < sizeof(oauth_replay_shm)) return -1;
+	hd = (oauth_replay_shm*) c->map;
+	for (w=0; __atomic_load_n(&hd->magic, __ATOMIC_ACQUIRE) != OAUTH_REPLAY_MAGIC; w++) {
+		if (w == 1000) return -1;
+		usleep(1000);
+	}
+	if (hd->window != window || hd->nslots < 8 || (hd->nslots & (hd->nslots - 1))
+			|| hd->tabsize != sizeof(oauth_replay_tab) + hd->nslots * sizeof(uint64_t)
+			|| c->maplen != sizeof(oauth_replay_shm) + OAUTH_REPLAY_BUCKETS * OAUTH_REPLAY_SHARDS * hd->tabsize)
+		return -1;
+	c->k0 = hd->k0;
+	c->k1 = hd->k1;
+	c->gran = hd->gran;
+	c->nslots = hd->nslots;
+	c->tabsize = hd->tabsize;
+	return 0;
+}
+
+oauth_replay_cache *oauth_replay_cache_shared (const char *name, size_t bytes, long window) {
+	oauth_replay_cache *c;
+	oauth_replay_shm *hd;
+	int fd = -1;
+
+	if (window < 1) return NULL;
+	c = (oauth_replay_cache*) xcalloc(1, sizeof(oauth_replay_cache));
+	oauth_replay_init(c, bytes, window);
+	c->maplen = sizeof(oauth_replay_shm) + OAUTH_REPLAY_BUCKETS * OAUTH_REPLAY_SHARDS * c->tabsize;
+	if (name) {
+		fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0600);
+		if (fd < 0 && errno == EEXIST) {
+			// created by another process: use its key and layout
+			if ((fd = shm_open(name, O_RDWR, 0600)) < 0) goto fail;
+			if (oauth_replay_attach(c, fd, window)) goto fail;
+			goto done;
+		}
+		if (fd < 0) goto fail;
+		if (ftruncate(fd, c->maplen)) {
+			shm_unlink(name);
+			goto fail;
+		}
+	}
+	c->map = mmap(NULL, c->maplen, PROT_READ|PROT_WRITE, MAP_SHARED | (fd < 0 ? MAP_ANONYMOUS : 0), fd, 0);
+	if (c->map == MAP_FAILED) {
+		c->map = NULL;
+		if (name) shm_unlink(name);
+		goto fail;
+	}
+	hd = (oauth_replay_shm*) c->map;
+	hd->k0 = c->k0;
+	hd->k1 = c->k1;
+	hd->window = c->window;
+	hd->gran = c->gran;
+	hd->nslots = c->nslots;
+	hd->tabsize = c->tabsize;
+	__atomic_store_n(&hd->magic, OAUTH_REPLAY_MAGIC, __ATOMIC_RELEASE);
+done:
+	if (fd >= 0) close(fd);
+	c->mem = (unsigned char*) c->map + sizeof(oauth_replay_shm);
+	return c;
+fail:
+	if (fd >= 0) close(fd);
+	oauth_replay_cache_free(c);
+	return NULL;
+}
+
+void oauth_replay_cache_free (oauth_replay_cache *c) {
+	if (!c) return;
+	if (c->map) munmap(c->map, c->maplen);
+	else xfree(c->mem);
+	xfree(c);
+}
+
+/**
+ * the owner id of tables cleared by this process, a pid fits
+ * OAUTH_REPLAY_OWNER on Linux (PID_MAX_LIMIT is 2^22).
+ */
+static uint64_t oauth_replay_owner(void) {
+	const uint64_t pid = (uint64_t) getpid() & OAUTH_REPLAY_OWNER;
+	return pid ? pid : 1;
+}
+
+/**
+ * clear table 't' claimed with the tag 'want' | 'me' and publish it.
+ * @return 0 on success, -1 if it was taken over meanwhile
+ */
+static int oauth_replay_clear(const oauth_replay_cache *c, oauth_replay_tab *t, uint64_t want, uint64_t me) {
+	// a request of the expired bucket may still be probing
+	uint64_t *slot = (uint64_t*) (t + 1);
+	uint64_t tag = want | me;
+	size_t i;
+	for (i=0; i < c->nslots; i++) __atomic_store_n(&slot[i], 0, __ATOMIC_RELAXED);
+	return __atomic_compare_exchange_n(&t->tag, &tag, want, 0,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED) ? 0 : -1;
+}
+
+/**
+ * claim the table for bucket 'b': wait while it is being cleared and
+ * clear it if it holds an expired bucket.
+ * @return the table or NULL if it already holds a later bucket
+ */
+static oauth_replay_tab *oauth_replay_table(const oauth_replay_cache *c, uint64_t h, long b) {
+	const size_t i = (size_t) (b % OAUTH_REPLAY_BUCKETS) * OAUTH_REPLAY_SHARDS + (h >> 60) % OAUTH_REPLAY_SHARDS;
+	oauth_replay_tab *t = (oauth_replay_tab*) (c->mem + i * c->tabsize);
+	const uint64_t want = OAUTH_REPLAY_TAG(b);
+	uint64_t me = 0; // owner id, only needed to claim a table
+	unsigned int spins = 0;
+	for (;;) {
+		uint64_t tag = __atomic_load_n(&t->tag, __ATOMIC_ACQUIRE);
+		if (tag == want) return t;
+		if (tag & OAUTH_REPLAY_OWNER) {
+			const pid_t owner = (pid_t) (tag & OAUTH_REPLAY_OWNER);
+			// every now and then check whether the clearing process still exists
+			if (++spins % 64 == 0 && kill(owner, 0) && errno == ESRCH) {
+				if (!me) me = oauth_replay_owner();
+				if (__atomic_compare_exchange_n(&t->tag, &tag, (tag & ~(uint64_t) OAUTH_REPLAY_OWNER) | me, 0,
+							__ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+					oauth_replay_clear(c, t, tag & ~(uint64_t) OAUTH_REPLAY_OWNER, me);
+					continue;
+				}
+			}
+			sched_yield();
+			continue;
+		}
+		if (tag > want) return NULL;
+		if (!me) me = oauth_replay_owner();
+		if (__atomic_compare_exchange_n(&t->tag, &tag, want | me, 0,
+					__ATOMIC_SEQ_CST, __ATOMIC_RELAXED)
+				&& !oauth_replay_clear(c, t, want, me))
+			return t;
+	}
+}
+
+int oauth_replay_check (oauth_replay_cache *c,
+		const char *c_key, const char *t_key, const char *nonce,
+		long timestamp, long now) {
+	const size_t mask = c ? c->nslots - 1 : 0;
+	oauth_replay_tab *t;
+	uint64_t *slot, h;
+	size_t i;
+	long b;
+	int p;
+
+	if (!c || !c_key || !nonce) return -1;
+	if (timestamp < 0 || timestamp < now - c->window || timestamp > now + c->window)
+		return OAUTH_REPLAY_STALE;
+	h = oauth_replay_hash(c, c_key, t_key, nonce, timestamp);
+	b = timestamp / c->gran;
+	if (!(t = oauth_replay_table(c, h, b))) return OAUTH_REPLAY_STALE;
+	slot = (uint64_t*) (t + 1);
+	// insert-if-absent, linear probing
+	for (p=0, i = h & mask; p < OAUTH_REPLAY_PROBES; p++, i = (i+1) & mask) {
+		uint64_t v = __atomic_load_n(&slot[i], __ATOMIC_RELAXED);
+		if (!v && __atomic_compare_exchange_n(&slot[i], &v, h, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+			// the table may have been taken over by a later bucket meanwhile
+			if (__atomic_load_n(&t->tag, __ATOMIC_SEQ_CST) != OAUTH_REPLAY_TAG(b))
+				return OAUTH_REPLAY_STALE;
+			return OAUTH_REPLAY_FRESH;
+		}
+		if (v == h) return OAUTH_REPLAY_SEEN;
+	}
+	return OAUTH_REPLAY_FULL;
+}
+
+#else
+
+oauth_replay_cache *oauth_replay_cache_new (size_t bytes, long window) {
+	return NULL;
+}
+
+oauth_replay_cache *oauth_replay_cache_shared (const char *name, size_t bytes, long window) {
+	return NULL;
+}
+
+void oauth_replay_cache_free (oauth_replay_cache *c) {
+}
+
+int oauth_replay_check (oauth_replay_cache *c,
+		const char *c_key, const char *t_key, const char *nonce,
+		long timestamp, long now) {
+	return -1;
+}
+
+#endif
 
 /**
  * free array args
@@ -56,6 +56,10 @@
 
 #endif /* doxygen ignore */
 
+#ifndef WIN32
+#include <sys/uio.h> // struct iovec
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -69,6 +73,29 @@ typedef enum {
     OA_PLAINTEXT ///< use plain text signature (for testing only)
   } OAuthMethod;
 
+/** \enum OAuthOutput
+ * format of the signed request written by the *_into functions.
+ */
+typedef enum {
+    OA_OUT_URL=0, ///< full URL with query parameters (like \ref oauth_sign_url2 without postargs)
+    OA_OUT_POSTARGS, ///< query parameters only, to be used as POST body
+    OA_OUT_HEADER ///< oauth parameters formatted for an "Authorization: OAuth" header (see \ref oauth_signer_sign_header_into)
+  } OAuthOutput;
+
+/** \enum OAuthVerifyStatus
+ * result of \ref oauth_verify_request, in the order of the checks.
+ */
+typedef enum {
+    OA_VERIFY_OK=0, ///< the signature is valid
+    OA_VERIFY_MALFORMED, ///< the header or a timestamp cannot be parsed, or an oauth parameter is repeated
+    OA_VERIFY_MISSING, ///< a required oauth parameter is missing
+    OA_VERIFY_METHOD, ///< the oauth_signature_method is not the one of the signer
+    OA_VERIFY_KEY, ///< consumer key or token are not the ones of the signer
+    OA_VERIFY_STALE, ///< the oauth_timestamp is too far from the current time
+    OA_VERIFY_BAD_SIGNATURE, ///< the signature does not match
+    OA_VERIFY_ERROR ///< invalid arguments or the signature could not be checked (eg. an unreadable RSA key)
+  } OAuthVerifyStatus;
+
 /**
  * Base64 encode and return size data in 'src'. The caller must free the
  * returned string.
@@ -91,6 +118,47 @@ char *oauth_encode_base64(int size, const unsigned char *src);
  */
 int oauth_decode_base64(unsigned char *dest, const char *src);
 
+/**
+ * Base64 encode 'len' bytes of 'src' into the caller supplied buffer
+ * 'dst' of 'size' bytes. Like snprintf(3) the result is written and
+ * zero-terminated only if it fits: if the return value is >= size,
+ * nothing has been written.
+ *
+ * @param src The data to be base64 encoded
+ * @param len The size of the data in src
+ * @param dst output buffer, may be NULL if size is 0
+ * @param size size of dst
+ * @return length of the encoded string (4*((len+2)/3)), excluding the
+ * terminating zero.
+ */
+size_t oauth_encode_base64_into(const unsigned char *src, size_t len, char *dst, size_t size);
+
+/**
+ * flag for \ref oauth_decode_base64_into: accept canonical base64 only.
+ */
+#define OAUTH_B64_STRICT 1
+
+/**
+ * Decode 'len' characters of base64 'src' into 'dst' without any
+ * temporary allocation. The output is not zero-terminated.
+ *
+ * By default the input is treated like \ref oauth_decode_base64 does:
+ * characters outside the base64 alphabet are ignored and a trailing
+ * partial group is decoded as if it was padded with 'A'.
+ * With OAUTH_B64_STRICT the length must be a multiple of four, only
+ * alphabet characters are allowed, '=' may only appear as one or two
+ * trailing padding characters and unused bits must be zero.
+ *
+ * @param src base64 encoded input, need not be zero-terminated
+ * @param len length of src
+ * @param dst output buffer; at most 3*((len+3)/4) bytes are written
+ * @param size size of dst
+ * @param flags 0 or OAUTH_B64_STRICT
+ * @return number of bytes decoded, or -1 if the input is invalid
+ * (strict mode) or dst is too small.
+ */
+int oauth_decode_base64_into(const char *src, size_t len, unsigned char *dst, size_t size, int flags);
+
 /**
  * Escape 'string' according to RFC3986 and
  * http://oauth.net/core/1.0/#encoding_parameters.
@@ -101,6 +169,20 @@ int oauth_decode_base64(unsigned char *dest, const char *src);
  */
 char *oauth_url_escape(const char *string);
 
+/**
+ * Escape 'len' bytes of 'src' according to RFC3986 into the caller
+ * supplied buffer 'dst' of 'size' bytes. 'src' may contain NUL bytes.
+ * Like snprintf(3) the result is written and zero-terminated only
+ * if it fits: if the return value is >= size, nothing has been written.
+ *
+ * @param src The data to be encoded
+ * @param len length of src
+ * @param dst output buffer, may be NULL if size is 0
+ * @param size size of dst
+ * @return length of the escaped string, excluding the terminating zero.
+ */
+size_t oauth_url_escape_into(const char *src, size_t len, char *dst, size_t size);
+
 /**
  * Parse RFC3986 encoded 'string' back to  unescaped version.
  *
@@ -111,6 +193,29 @@ char *oauth_url_escape(const char *string);
  */
 char *oauth_url_unescape(const char *string, size_t *olen);
 
+/**
+ * flag for \ref oauth_url_unescape_into: decode '+' as space, as used
+ * by application/x-www-form-urlencoded bodies.
+ */
+#define OAUTH_UNESCAPE_PLUS 1
+
+/**
+ * Parse 'len' bytes of RFC3986 encoded 'src' back to the unescaped
+ * version. 'src' may contain NUL bytes and invalid or truncated
+ * %-sequences are copied as they are, like \ref oauth_url_unescape does.
+ *
+ * The result is never longer than the input, so 'dst' must hold 'len'
+ * bytes. 'dst' may be the same as 'src' to decode in place.
+ * The output is not zero-terminated.
+ *
+ * @param src The data to be unescaped
+ * @param len length of src
+ * @param dst output buffer
+ * @param flags 0 or OAUTH_UNESCAPE_PLUS
+ * @return length of the unescaped data
+ */
+size_t oauth_url_unescape_into(const char *src, size_t len, char *dst, int flags);
+
 
 /**
  * returns base64 encoded HMAC-SHA1 signature for
@@ -137,6 +242,92 @@ char *oauth_sign_hmac_sha1 (const char *m, const char *k);
  */
 char *oauth_sign_hmac_sha1_raw (const char *m, const size_t ml, const char *k, const size_t kl);
 
+/** \struct oauth_hmac_sha1
+ * opaque HMAC-SHA1 key schedule; holds the SHA-1 midstates after
+ * the inner (key ^ ipad) and outer (key ^ opad) key blocks so that
+ * signing a message only hashes the message itself.
+ */
+typedef struct oauth_hmac_sha1 oauth_hmac_sha1;
+
+/**
+ * precompute the HMAC-SHA1 key schedule for key 'k'.
+ * The returned object needs to be released with \ref oauth_hmac_sha1_free.
+ * It is not modified by \ref oauth_hmac_sha1_digest and can be shared
+ * between threads.
+ *
+ * @param k key used for signing (already urlencoded for OAuth)
+ * @param kl length of key
+ * @return key schedule or NULL if an error occurred.
+ */
+oauth_hmac_sha1 *oauth_hmac_sha1_new (const char *k, const size_t kl);
+
+/**
+ * calculate the raw HMAC-SHA1 digest of a message using a precomputed key schedule.
+ *
+ * @param h key schedule from \ref oauth_hmac_sha1_new
+ * @param m message to be signed
+ * @param ml length of message
+ * @param digest memory for at least 20 bytes receiving the digest
+ * @return length of the digest (20) or 0 if an error occurred.
+ */
+int oauth_hmac_sha1_digest (const oauth_hmac_sha1 *h, const char *m, const size_t ml, unsigned char *digest);
+
+/**
+ * derive a key schedule whose inner hash has already absorbed the
+ * message prefix 'm', so that
+ * oauth_hmac_sha1_digest(x, tail) == HMAC-SHA1(key, m + tail).
+ * This saves hashing a prefix that is common to many messages.
+ *
+ * @param h key schedule from \ref oauth_hmac_sha1_new
+ * @param m message prefix
+ * @param ml length of the prefix
+ * @return key schedule to be freed with \ref oauth_hmac_sha1_free or
+ * NULL if an error occurred.
+ */
+oauth_hmac_sha1 *oauth_hmac_sha1_extend (const oauth_hmac_sha1 *h, const char *m, const size_t ml);
+
+/**
+ * free a key schedule allocated with \ref oauth_hmac_sha1_new.
+ * The key material is wiped before it is released.
+ *
+ * @param h key schedule to free (may be NULL)
+ */
+void oauth_hmac_sha1_free (oauth_hmac_sha1 *h);
+
+/**
+ * compute several HMAC-SHA1 digests at once.
+ *
+ * Independent messages are hashed side by side in SIMD lanes (see
+ * \ref oauth_hmac_sha1_lanes). Each message may use a different key.
+ * The result is the same as calling \ref oauth_hmac_sha1_digest for
+ * every message.
+ *
+ * @param h array of 'n' precomputed keys
+ * @param m array of 'n' messages
+ * @param ml array of 'n' message lengths
+ * @param digest receives 'n' * 20 bytes of digests
+ * @param n number of messages
+ * @return n or 0 if an error occurred.
+ */
+int oauth_hmac_sha1_digest_multi (const oauth_hmac_sha1 * const *h,
+  const char * const *m, const size_t *ml, unsigned char *digest, int n);
+
+/**
+ * number of messages \ref oauth_hmac_sha1_digest_multi hashes in
+ * parallel on this CPU: 16 (AVX-512), 8 (AVX2), 4 (SSE2) or 1.
+ */
+int oauth_hmac_sha1_lanes (void);
+
+/**
+ * limit \ref oauth_hmac_sha1_digest_multi to the widest engine this
+ * CPU supports with at most 'max' lanes (1, 4, 8 or 16), eg. to test
+ * or benchmark the narrower ones. This is a process-wide setting.
+ *
+ * @param max largest number of lanes to use
+ * @return the number of lanes now in use
+ */
+int oauth_hmac_sha1_select_lanes (int max);
+
 /**
  * returns plaintext signature for the given key.
  *
@@ -185,6 +376,56 @@ int oauth_verify_rsa_sha1 (const char *m, const char *c, const char *s);
  */
 char *oauth_catenc(int len, ...);
 
+#define OAUTH_SPAN_KEY_ESCAPED   1 ///< the key differs from its unescaped version
+#define OAUTH_SPAN_VALUE_ESCAPED 2 ///< the value differs from its unescaped version
+#define OAUTH_SPAN_HAS_VALUE     4 ///< the parameter has a '=' (the value may still be empty)
+
+/**
+ * a parameter of a query-string or form body, as offsets into the
+ * original input (see \ref oauth_split_spans).
+ */
+typedef struct {
+	size_t koff; ///< offset of the key
+	size_t klen; ///< length of the key
+	size_t voff; ///< offset of the value, behind the '='
+	size_t vlen; ///< length of the value
+	int flags;   ///< OAUTH_SPAN_* bits
+} oauth_span;
+
+/**
+ * split a url, query-string or form body into parameters without
+ * copying or modifying it. The same delimiters as in
+ * \ref oauth_split_post_paramters are used and empty parameters are
+ * skipped, but 'oauth_signature' is not filtered out and the first
+ * parameter (the URL in case of a full url) is not normalized.
+ *
+ * Keys and values can be used in place unless flagged as escaped,
+ * \ref oauth_span_unescape decodes them on demand.
+ *
+ * @param src the input, need not be zero-terminated
+ * @param len length of src
+ * @param qesc escape rules, as for \ref oauth_split_post_paramters
+ * @param spans array receiving the parameters
+ * @param max number of elements in spans
+ * @return number of parameters in src. If this is larger than max, only
+ * the first max have been stored; call again with a larger array.
+ */
+int oauth_split_spans(const char *src, size_t len, short qesc, oauth_span *spans, int max);
+
+/**
+ * unescape a key or value found by \ref oauth_split_spans:
+ * '\001' is an alias for '&' unless (qesc&2), '+' is a space if
+ * (qesc&1) and %-sequences are decoded.
+ * The output is not zero-terminated.
+ *
+ * @param src start of the key or value (input + koff or voff)
+ * @param len its length (klen or vlen)
+ * @param qesc escape rules, as for \ref oauth_split_post_paramters
+ * @param dst output buffer of at least len bytes, may be src.
+ * @return length of the unescaped key or value
+ */
+size_t oauth_span_unescape(const char *src, size_t len, short qesc, char *dst);
+
 /**
  * splits the given url into a parameter array.
  * (see \ref oauth_serialize_url and \ref oauth_serialize_url_parameters for the reverse)
@@ -242,6 +483,21 @@ char *oauth_serialize_url (int argc, int start, char **argv);
  */
 char *oauth_serialize_url_sep (int argc, int start, char **argv, char *sep, int mod);
 
+/**
+ * same as \ref oauth_serialize_url_sep but also returns the length of
+ * the serialized string. The result is sized exactly in a first pass and
+ * written in a second one, so the run-time is linear in the output size.
+ *
+ * @param argc the total number of elements in the array
+ * @param start element in the array at which to start concatenating.
+ * @param argv parameter-array to concatenate.
+ * @param sep separator for parameters (usually "&")
+ * @param mod bitwise modifiers, see \ref oauth_serialize_url_sep
+ * @param olen unless NULL the length of the returned string is stored there.
+ * @return url string needs to be freed by the caller.
+ */
+char *oauth_serialize_url_sep2 (int argc, int start, char **argv, const char *sep, int mod, size_t *olen);
+
 /**
  * build a query parameter string from an array.
  *
@@ -264,6 +520,30 @@ char *oauth_serialize_url_parameters (int argc, char **argv);
  */
 char *oauth_gen_nonce();
 
+#define OAUTH_NONCE_RANDOM  0 ///< random nonces of 15 to 30 chars (default)
+#define OAUTH_NONCE_COUNTER 1 ///< a random per-process prefix followed by a counter
+
+/**
+ * select how nonces are generated by \ref oauth_gen_nonce and the
+ * signing functions.
+ *
+ * Random nonces are drawn from a per-thread pool that is refilled from
+ * the random number generator 4 KB at a time.
+ *
+ * Counter nonces (23 chars) consist of a random prefix that is drawn by
+ * this call and an atomic counter, so generating one needs no random
+ * numbers at all. They are unique but predictable. A process forked
+ * after this call falls back to random nonces until it calls this
+ * function again.
+ *
+ * This is a process-wide setting; change it before threads start to
+ * sign requests.
+ *
+ * @param mode OAUTH_NONCE_RANDOM or OAUTH_NONCE_COUNTER
+ * @return the previous mode or -1 if 'mode' is invalid
+ */
+int oauth_set_nonce_mode (int mode);
+
 /**
  * string compare function for oauth parameters.
  *
@@ -486,6 +766,794 @@ char *oauth_sign_array (int *argcp, char***argvp,
   const char *t_secret //< token secret - used as 2st part of secret-key
   ) attribute_deprecated;
 
+/** \struct oauth_signer
+ * opaque signer context for a fixed consumer/token pair.
+ *
+ * It holds the escaped signing key, the escaped consumer key and
+ * token strings and - for \ref OA_HMAC - the precomputed HMAC-SHA1
+ * key schedule (see \ref oauth_hmac_sha1_new). Creating it once and
+ * reusing it for many requests avoids re-escaping the secrets and
+ * re-hashing the key blocks on every request.
+ *
+ * A signer is immutable after creation and can be used by
+ * multiple threads concurrently.
+ */
+typedef struct oauth_signer oauth_signer;
+
+/**
+ * create a signer context for the given credentials.
+ * The returned object needs to be released with \ref oauth_signer_free.
+ *
+ * @param method specify the signature method to use. It is of type
+ * \ref OAuthMethod and most likely \ref OA_HMAC.
+ * @param c_key consumer key
+ * @param c_secret consumer secret (the private key for \ref OA_RSA, or the
+ * certificate or public key if the signer is used with \ref oauth_verify_request)
+ * @param t_key token key (may be NULL)
+ * @param t_secret token secret (may be NULL)
+ *
+ * @return signer context or NULL if an error occurred.
+ */
+oauth_signer *oauth_signer_new (OAuthMethod method,
+  const char *c_key, //< consumer key - posted plain text
+  const char *c_secret, //< consumer secret - used as 1st part of secret-key
+  const char *t_key, //< token key - posted plain text in URL
+  const char *t_secret //< token secret - used as 2st part of secret-key
+  );
+
+/**
+ * free a signer context; the key material is wiped before it is released.
+ *
+ * @param s signer to free (may be NULL)
+ */
+void oauth_signer_free (oauth_signer *s);
+
+/**
+ * sign an already assembled signature base string.
+ * Only the base string is hashed; the key schedule is reused.
+ *
+ * the returned string needs to be freed by the caller
+ *
+ * @param s signer context
+ * @param m signature base string
+ * @param ml length of the base string
+ * @return signature string (not yet url-escaped) or NULL.
+ */
+char *oauth_signer_sign (const oauth_signer *s, const char *m, const size_t ml);
+
+/**
+ * same as \ref oauth_sign_url2 using the credentials and
+ * signature method of the given signer.
+ *
+ * @param s signer context
+ * @param url The request URL to be signed.
+ * @param postargs This parameter points to an area where the return value
+ * is stored. If 'postargs' is NULL, no value is stored.
+ * @param http_method The HTTP request method to use (ie "GET", "PUT",..)
+ * or NULL for the default.
+ *
+ * @return the signed url or NULL if an error occurred.
+ */
+char *oauth_signer_sign_url (const oauth_signer *s, const char *url,
+  char **postargs, const char *http_method);
+
+/**
+ * same as \ref oauth_sign_array2 using the credentials and
+ * signature method of the given signer.
+ *
+ * @param s signer context
+ * @param argcp pointer to array length int
+ * @param argvp pointer to array values (see \ref oauth_sign_array2)
+ * @param postargs This parameter points to an area where the return value
+ * is stored. If 'postargs' is NULL, no value is stored.
+ * @param http_method The HTTP request method to use (ie "GET", "PUT",..)
+ * or NULL for the default.
+ *
+ * @return the signed url or NULL if an error occurred.
+ */
+char *oauth_signer_sign_array (const oauth_signer *s,
+  int *argcp, char***argvp,
+  char **postargs, const char *http_method);
+
+/**
+ * sign a URL and write the result into a caller supplied buffer.
+ *
+ * The output is the same as the one of \ref oauth_sign_url2 with the
+ * format selected by 'mode'. With \ref OA_OUT_HEADER only the oauth
+ * parameters are written, as in \ref oauth_serialize_url_parameters.
+ * The common case does not allocate heap memory.
+ *
+ * Like snprintf(3) the function returns the length the output needs,
+ * excluding the terminating zero. The output was written if and only
+ * if the return value is smaller than 'size'. Since a retry generates a
+ * new nonce and signature, the returned length includes room for the
+ * longest nonce and a fully escaped signature.
+ *
+ * @param s signer context
+ * @param url The request URL to be signed.
+ * @param mode output format
+ * @param http_method The HTTP request method to use (ie "GET", "PUT",..)
+ * or NULL for the default ("POST" for \ref OA_OUT_POSTARGS, else "GET").
+ * @param buf output buffer
+ * @param size size of the output buffer
+ *
+ * @return length of the signed request or 0 if an error occurred.
+ */
+size_t oauth_signer_sign_url_into (const oauth_signer *s, const char *url,
+  OAuthOutput mode, const char *http_method,
+  char *buf, size_t size);
+
+/**
+ * sign a request given as array, like \ref oauth_sign_array2 with the
+ * output written to 'buf' as by \ref oauth_signer_sign_url_into. The
+ * array is not modified. As with \ref oauth_sign_array2 the base URL
+ * argv[0] is used as it is: unlike the URL taking functions, a default
+ * port is not stripped and an empty path is not completed by a slash.
+ *
+ * @param s signer context
+ * @param argc number of elements in argv
+ * @param argv the base URL followed by the (unescaped) query parameters
+ * @param mode output format
+ * @param http_method The HTTP request method to use or NULL for the default.
+ * @param buf output buffer
+ * @param size size of the output buffer
+ *
+ * @return length of the signed request or 0 if an error occurred.
+ */
+size_t oauth_signer_sign_array_into (const oauth_signer *s,
+  int argc, char **argv,
+  OAuthOutput mode, const char *http_method,
+  char *buf, size_t size);
+
+/**
+ * same as \ref oauth_signer_sign_url_into with the credentials given
+ * as arguments. A temporary signer is created for every call; use
+ * \ref oauth_signer_sign_url_into to avoid that allocation.
+ *
+ * @return length of the signed request or 0 if an error occurred.
+ */
+size_t oauth_sign_url2_into (const char *url,
+  OAuthOutput mode,
+  OAuthMethod method,
+  const char *http_method, //< HTTP request method
+  const char *c_key, //< consumer key - posted plain text
+  const char *c_secret, //< consumer secret - used as 1st part of secret-key
+  const char *t_key, //< token key - posted plain text in URL
+  const char *t_secret, //< token secret - used as 2st part of secret-key
+  char *buf, size_t size);
+
+/**
+ * same as \ref oauth_signer_sign_array_into with the credentials given
+ * as arguments. A temporary signer is created for every call.
+ *
+ * @return length of the signed request or 0 if an error occurred.
+ */
+size_t oauth_sign_array2_into (int argc, char **argv,
+  OAuthOutput mode,
+  OAuthMethod method,
+  const char *http_method, //< HTTP request method
+  const char *c_key, //< consumer key - posted plain text
+  const char *c_secret, //< consumer secret - used as 1st part of secret-key
+  const char *t_key, //< token key - posted plain text in URL
+  const char *t_secret, //< token secret - used as 2st part of secret-key
+  char *buf, size_t size);
+
+#define OAUTH_HEADER_NAME 1 ///< start with the header name, "Authorization: "
+
+/**
+ * sign a URL and write a complete HTTP Authorization header value,
+ * ie. 'OAuth realm="..", oauth_consumer_key="..", ..,
+ * oauth_signature=".."', into a caller supplied buffer.
+ *
+ * The oauth parameters are written in one pass from their escaped form
+ * (see \ref OA_OUT_HEADER), the length is computed beforehand. The
+ * request parameters that do not start with 'oauth_' are signed but
+ * not written; they go into the URL or the body of the request.
+ * Return value and retries are the same as for
+ * \ref oauth_signer_sign_url_into.
+ *
+ * @param s signer context
+ * @param url The request URL to be signed, including POST parameters
+ * (as in \ref oauth_sign_url2 with postargs).
+ * @param http_method The HTTP request method to use (ie "GET", "POST",..)
+ * or NULL for "GET".
+ * @param realm the realm to add as first parameter or NULL; it is written
+ * as quoted-string, not URL-escaped.
+ * @param flags OAUTH_HEADER_NAME to start with "Authorization: ", or 0
+ * @param buf output buffer
+ * @param size size of the output buffer
+ *
+ * @return length of the header or 0 if an error occurred.
+ */
+size_t oauth_signer_sign_header_into (const oauth_signer *s, const char *url,
+  const char *http_method, const char *realm, int flags,
+  char *buf, size_t size);
+
+/**
+ * same as \ref oauth_signer_sign_header_into, returning the header in
+ * a buffer of the exact size.
+ *
+ * @return the header (to be freed by the caller) or NULL if an error occurred.
+ */
+char *oauth_signer_sign_header (const oauth_signer *s, const char *url,
+  const char *http_method, const char *realm, int flags);
+
+#define OAUTH_HEADER_MAX_PARAMS 32 ///< maximum number of parameters of an Authorization header
+
+/**
+ * split the value of an "Authorization: OAuth" header into its
+ * parameters without copying or modifying it, the reverse of
+ * \ref oauth_signer_sign_header_into.
+ *
+ * The header is parsed strictly in one pass: an optional "Authorization:"
+ * followed by the scheme "OAuth" and a comma separated list of key="value"
+ * pairs. Keys consist of unreserved characters, values are quoted-strings
+ * and may contain quoted-pairs. Empty list elements, a repeated key and
+ * more than \ref OAUTH_HEADER_MAX_PARAMS parameters are rejected.
+ *
+ * Each parameter is stored as \ref oauth_span with offsets into 'src',
+ * the value without the quotes. All parameters, including the realm,
+ * are returned in their order. Values flagged OAUTH_SPAN_VALUE_ESCAPED
+ * are decoded with \ref oauth_header_unescape, in place if 'src' is
+ * writable.
+ *
+ * @param src the header value, need not be zero-terminated
+ * @param len length of src
+ * @param spans array receiving the parameters
+ * @param max number of elements in spans
+ * @return number of parameters or -1 if the header is malformed. If
+ * this is larger than max, only the first max have been stored; call
+ * again with a larger array.
+ */
+int oauth_split_header(const char *src, size_t len, oauth_span *spans, int max);
+
+/**
+ * unescape a value found by \ref oauth_split_header: quoted-pairs and
+ * %-sequences are decoded. The output is not zero-terminated.
+ *
+ * @param src start of the value (input + voff)
+ * @param len its length (vlen)
+ * @param dst output buffer of at least len bytes, may be src.
+ * @return length of the unescaped value
+ */
+size_t oauth_header_unescape(const char *src, size_t len, char *dst);
+
+#ifndef WIN32
+typedef struct iovec oauth_iovec; ///< a segment of a request, for writev(2)
+#else
+typedef struct {
+  void *iov_base;
+  size_t iov_len;
+} oauth_iovec;
+#endif
+
+/**
+ * sign a request and describe the signed URL (\ref OA_OUT_URL) or
+ * form body (\ref OA_OUT_POSTARGS) as a list of segments, eg. to send
+ * it with writev(2) without copying it.
+ *
+ * 'url' and 'body' are taken as they are sent: parameters are separated
+ * by '&' only and decoded like a form, ie. '+' is a space. Runs of
+ * parameters that can be sent as they are reference 'url' or 'body'
+ * directly. Only parameters that need escaping, the added oauth
+ * parameters and the signature are written to 'buf'; segments that
+ * follow each other in memory are merged. A given oauth_signature is
+ * dropped. With \ref OA_OUT_HEADER 'url' and 'body' are sent unchanged;
+ * the only segment is formatted like \ref OA_OUT_HEADER output but holds
+ * only the added oauth parameters and the signature.
+ *
+ * The return value is the number of bytes 'buf' needs, as for
+ * \ref oauth_signer_sign_url_into, and '*iovcnt' is set to the number
+ * of segments. The request was described if and only if the return
+ * value is smaller than 'size' and '*iovcnt' is not larger than it
+ * was on input. The segments stay valid as long as 'url', 'body' and
+ * 'buf' do.
+ *
+ * @param s signer context
+ * @param url The request URL with its query parameters.
+ * @param body the form body (application/x-www-form-urlencoded) or NULL;
+ * its parameters are signed as well.
+ * @param bodylen length of 'body'
+ * @param mode \ref OA_OUT_URL for the URL, \ref OA_OUT_POSTARGS for the body
+ * @param http_method The HTTP request method to use or NULL for the default.
+ * @param iov array of segments
+ * @param iovcnt [in,out] number of elements in 'iov', number of segments
+ * @param buf buffer for the segments that are written
+ * @param size size of 'buf'
+ *
+ * @return number of bytes in 'buf' or 0 if an error occurred.
+ */
+size_t oauth_signer_sign_iov (const oauth_signer *s,
+  const char *url, const char *body, size_t bodylen,
+  OAuthOutput mode, const char *http_method,
+  oauth_iovec *iov, int *iovcnt,
+  char *buf, size_t size);
+
+/**
+ * verify a signed request on the server side.
+ *
+ * The parameters of the query of 'url', of the form body and of the
+ * Authorization header (but its realm) are collected and normalized
+ * like the signing functions do; no argv arrays are built. The request
+ * is checked in order of cost: it must carry each oauth parameter at
+ * most once, the consumer key, signature method and signature (and,
+ * unless for \ref OA_PLAINTEXT, a timestamp and nonce), match the
+ * signer's method, consumer key and token, and be recent. Only then is
+ * the signature computed and compared in constant time, or for
+ * \ref OA_RSA checked with \ref oauth_verify_rsa_sha1.
+ *
+ * The nonce is not checked against earlier requests.
+ *
+ * @param s signer with the credentials the request is expected to be
+ * signed with; for \ref OA_RSA its c_secret is the certificate or public key
+ * @param http_method The HTTP request method (ie "GET", "POST",..)
+ * or NULL for "POST" with a body and "GET" without.
+ * @param url the request URL including its query
+ * @param auth_header the value of the Authorization header, 'OAuth ..',
+ * optionally preceded by "Authorization:", or NULL
+ * @param body the form body (application/x-www-form-urlencoded) or NULL;
+ * a body of another content type is not signed and must not be passed.
+ * @param bodylen length of 'body'
+ * @param max_skew the maximum difference between oauth_timestamp and
+ * the current time in seconds, or 0 to accept any timestamp
+ *
+ * @return \ref OA_VERIFY_OK for a valid signature or the reason to reject it
+ */
+OAuthVerifyStatus oauth_verify_request (const oauth_signer *s,
+  const char *http_method, const char *url, const char *auth_header,
+  const char *body, size_t bodylen, long max_skew);
+
+/** \struct oauth_replay_cache
+ * opaque in-process cache of the (consumer key, token, nonce, timestamp)
+ * tuples of verified requests, to reject replays.
+ *
+ * Each tuple is kept as a 64-bit hash, keyed with a random key per
+ * cache, in the open addressing table of its timestamp: the tables form
+ * a timing wheel of 32 buckets spanning twice the window, each split
+ * into 16 shards. A table is cleared when its bucket expires, by the
+ * first request that needs it for a new one; there is no sweep of the
+ * whole cache. Slots are claimed with atomic compare-and-swap, so any
+ * number of threads can use a cache without locking.
+ */
+typedef struct oauth_replay_cache oauth_replay_cache;
+
+#define OAUTH_REPLAY_FRESH 0 ///< the tuple was not seen before and has been recorded
+#define OAUTH_REPLAY_SEEN  1 ///< the tuple has been recorded before: a replay
+#define OAUTH_REPLAY_STALE 2 ///< the timestamp is outside of the window and cannot be tracked
+#define OAUTH_REPLAY_FULL  3 ///< the table for the timestamp has no room left
+
+/**
+ * create a replay cache.
+ *
+ * A tuple is remembered as long as its timestamp is within 'window'
+ * seconds of the current time, ie. for up to twice the window. Each
+ * tuple takes 8 bytes and probing stays short while the tables are at
+ * most half full, so for 'r' requests per second 'bytes' should be at
+ * least 8 * 2 * 2 * window * r; the minimum is 64 KiB.
+ *
+ * @param bytes memory to use for the tables
+ * @param window the largest accepted distance of a timestamp from
+ * the current time in seconds, as max_skew of \ref oauth_verify_request
+ * @return the cache (to be freed with \ref oauth_replay_cache_free) or
+ * NULL if replay caches are not supported on this platform
+ */
+oauth_replay_cache *oauth_replay_cache_new (size_t bytes, long window);
+
+/**
+ * create or attach to a replay cache in shared memory, for servers
+ * that verify requests in several processes.
+ *
+ * With 'name' NULL the tables are in an anonymous shared mapping,
+ * which is used by all processes fork()ed after the call: create it in
+ * the parent of prefork workers and restarted workers keep using it.
+ * Otherwise 'name' is a POSIX shared memory object (see shm_open(3),
+ * eg. "/myserver-replay"), created if it does not exist yet and
+ * attached to if it does, in which case 'bytes' is ignored and
+ * 'window' must be the one it was created with. The object lives on
+ * until it is removed with shm_unlink(3).
+ *
+ * The processes need no broker: slots are claimed with atomic
+ * compare-and-swap in the shared tables, and a table left half cleared
+ * by a process that died is cleared again by the next one to use it.
+ *
+ * @param name the shared memory object or NULL
+ * @param bytes memory to use for the tables, see \ref oauth_replay_cache_new
+ * @param window the largest accepted distance of a timestamp from
+ * the current time in seconds
+ * @return the cache (to be freed with \ref oauth_replay_cache_free,
+ * which unmaps it in the calling process only) or NULL on error
+ */
+oauth_replay_cache *oauth_replay_cache_shared (const char *name, size_t bytes, long window);
+
+/**
+ * free a replay cache. No thread may use it any more.
+ */
+void oauth_replay_cache_free (oauth_replay_cache *c);
+
+/**
+ * check whether a request is a replay and record it if it is not.
+ * The strings are compared as they are, so pass either the escaped
+ * or the decoded values, but always the same.
+ *
+ * @param c replay cache
+ * @param c_key consumer key
+ * @param t_key token or NULL; NULL and "" are the same
+ * @param nonce the oauth_nonce
+ * @param timestamp the oauth_timestamp
+ * @param now the current time, eg. time(NULL)
+ * @return OAUTH_REPLAY_FRESH if the request may be accepted, another
+ * OAUTH_REPLAY_* value if not, or -1 for invalid arguments
+ */
+int oauth_replay_check (oauth_replay_cache *c,
+  const char *c_key, const char *t_key, const char *nonce,
+  long timestamp, long now);
+
+/**
+ * the replay tuple of a request, see \ref oauth_replay_check.
+ */
+typedef struct {
+  const char *c_key; ///< consumer key
+  const char *t_key; ///< token or NULL
+  const char *nonce; ///< the oauth_nonce
+  long timestamp;    ///< the oauth_timestamp
+} oauth_nonce;
+
+/** \struct oauth_nonce_store
+ * opaque nonce store: a backend recording the replay tuples of
+ * requests, eg. in a server shared by several nodes, that checks them
+ * in batches. A store must not be used by several threads at a time.
+ */
+typedef struct oauth_nonce_store oauth_nonce_store;
+
+/**
+ * create a nonce store with a custom backend.
+ *
+ * @param check records the 'cnt' tuples 'n' unless they have been seen
+ * before and stores an OAUTH_REPLAY_* value, or -1 if a tuple could not
+ * be checked, for each in 'res'. It is passed 'data' and the current time.
+ * @param release frees 'data' when the store is freed, may be NULL
+ * @param data backend data
+ * @return the store, to be freed with \ref oauth_nonce_store_free
+ */
+oauth_nonce_store *oauth_nonce_store_new (
+  int (*check)(void *data, const oauth_nonce *n, int *res, int cnt, long now),
+  void (*release)(void *data), void *data);
+
+/**
+ * create a nonce store that records tuples in a replay cache, as
+ * \ref oauth_replay_check does. The cache is freed with the store.
+ *
+ * @param c a cache from \ref oauth_replay_cache_new or
+ * \ref oauth_replay_cache_shared
+ * @return the store or NULL if 'c' is NULL
+ */
+oauth_nonce_store *oauth_nonce_store_local (oauth_replay_cache *c);
+
+/**
+ * create a nonce store that records tuples in a memcached server,
+ * with the text protocol over one persistent connection.
+ *
+ * A tuple is stored with an "add" command under a key derived from
+ * the tuple, expiring when its timestamp leaves the window; "add"
+ * fails for a key that exists, ie. for a replay. The commands of a
+ * batch are pipelined: all are sent before the replies are read, so a
+ * batch takes one round trip however many tuples it holds (up to 256).
+ *
+ * While the server cannot be reached the tuples are checked with
+ * 'fallback' instead, and connecting is retried at most once a
+ * second. Tuples recorded in the fallback are unknown to the other
+ * nodes, so this protects against replays to the same node only.
+ *
+ * Writing to a connection the server has closed does not raise
+ * SIGPIPE where MSG_NOSIGNAL or SO_NOSIGPIPE is available (Linux, the
+ * BSDs, macOS); on other platforms the caller must ignore SIGPIPE.
+ *
+ * @param host server name or address
+ * @param port port, usually "11211"
+ * @param window the largest accepted distance of a timestamp from
+ * the current time in seconds, at most about two weeks
+ * @param timeout_ms time to wait for connecting, sending or
+ * receiving before the server counts as unreachable
+ * @param fallback store to use while the server is unreachable, eg.
+ * from \ref oauth_nonce_store_local, or NULL. It is freed with the
+ * returned store, but not if NULL is returned.
+ * @return the store or NULL if the arguments are invalid or the
+ * platform is not supported. It does not connect before it is used.
+ */
+oauth_nonce_store *oauth_nonce_store_memcached (const char *host, const char *port,
+  long window, int timeout_ms, oauth_nonce_store *fallback);
+
+/**
+ * check a batch of requests for replays and record them.
+ *
+ * @param st the store
+ * @param n the tuples of the requests
+ * @param res receives an OAUTH_REPLAY_* value for each tuple, or -1
+ * if it could not be checked; only OAUTH_REPLAY_FRESH requests may be
+ * accepted. A tuple repeated within the batch is OAUTH_REPLAY_SEEN
+ * after its first occurrence.
+ * @param cnt number of tuples
+ * @param now the current time, eg. time(NULL)
+ * @return 0 if every tuple has been checked, otherwise -1
+ */
+int oauth_nonce_store_check (oauth_nonce_store *st, const oauth_nonce *n, int *res, int cnt, long now);
+
+/**
+ * free a nonce store, its backend data and its connection.
+ */
+void oauth_nonce_store_free (oauth_nonce_store *st);
+
+/**
+ * a set of request parameters, as used internally by the signing
+ * functions: keys and values are stored URL-escaped in one arena with
+ * inline storage for typical requests, and can be looked up by key in
+ * O(1). See \ref oauth_params_new and \ref oauth_signer_sign_params_into.
+ */
+typedef struct oauth_params oauth_params;
+
+/**
+ * create an empty parameter set.
+ * @return the new set, to be freed with \ref oauth_params_free
+ */
+oauth_params *oauth_params_new (void);
+
+/**
+ * free a parameter set created by \ref oauth_params_new.
+ */
+void oauth_params_free (oauth_params *p);
+
+/**
+ * remove all parameters, keeping the allocated storage for reuse.
+ */
+void oauth_params_clear (oauth_params *p);
+
+/**
+ * append a parameter.
+ *
+ * @param p parameter set
+ * @param key the (unescaped) key
+ * @param klen length of key
+ * @param value the (unescaped) value or NULL for a parameter without '='
+ * @param vlen length of value
+ * @return index of the new parameter
+ */
+int oauth_params_add (oauth_params *p, const char *key, size_t klen, const char *value, size_t vlen);
+
+/**
+ * append a "key=value" string as found in the argv arrays of
+ * \ref oauth_sign_array2.
+ * @return index of the new parameter
+ */
+int oauth_params_add_arg (oauth_params *p, const char *arg);
+
+/**
+ * append all parameters of a query-string or form body. Every token is a
+ * parameter; pass the query part only, not a full URL.
+ *
+ * @param p parameter set
+ * @param query the input, need not be zero-terminated
+ * @param len length of query
+ * @param qesc escape rules, as for \ref oauth_split_post_paramters
+ * @return number of parameters added
+ */
+int oauth_params_add_query (oauth_params *p, const char *query, size_t len, short qesc);
+
+/**
+ * @return number of parameters in the set
+ */
+int oauth_params_count (const oauth_params *p);
+
+/**
+ * look up a parameter by its (unescaped) key.
+ * @return index of the first parameter with that key - preferring one
+ * that has a value - or -1 if there is none
+ */
+int oauth_params_find (const oauth_params *p, const char *key);
+
+/**
+ * get the URL-escaped key of parameter 'i'; not zero-terminated.
+ * @param len receives the length of the key, may be NULL
+ * @return the key or NULL if 'i' is out of range
+ */
+const char *oauth_params_key (const oauth_params *p, int i, size_t *len);
+
+/**
+ * get the URL-escaped value of parameter 'i'; not zero-terminated.
+ * @param len receives the length of the value, may be NULL
+ * @return the value or NULL if 'i' is out of range or has no value
+ */
+const char *oauth_params_value (const oauth_params *p, int i, size_t *len);
+
+/**
+ * @return 1 if the key of parameter 'i' starts with "oauth_" or
+ * "x_oauth_", else 0
+ */
+int oauth_params_is_oauth (const oauth_params *p, int i);
+
+/**
+ * same as \ref oauth_signer_sign_url_into for a request given as base
+ * URL and parameter set. Missing protocol parameters are added and an
+ * 'oauth_signature' in 'params' is ignored; 'params' is not modified.
+ *
+ * @param s signer context
+ * @param url base URL of the request, without query parameters
+ * @param params request parameters
+ * @param mode output format
+ * @param http_method The HTTP request method to use or NULL for the default.
+ * @param buf output buffer
+ * @param size size of the output buffer
+ *
+ * @return length of the signed request or 0 if an error occurred.
+ */
+size_t oauth_signer_sign_params_into (const oauth_signer *s,
+  const char *url, const oauth_params *params,
+  OAuthOutput mode, const char *http_method,
+  char *buf, size_t size);
+
+/**
+ * a request that is signed repeatedly with a new nonce and timestamp,
+ * eg. when polling an endpoint. See \ref oauth_request_template_new.
+ */
+typedef struct oauth_request_template oauth_request_template;
+
+/**
+ * prepare a request for repeated signing: its parameters are normalized
+ * and serialized once. For HMAC-SHA1 the hash of the signature base
+ * string up to the first generated parameter is cached as well, so
+ * every signature only hashes the remaining part.
+ *
+ * oauth_nonce and oauth_timestamp are generated for each signature
+ * unless 'url' contains them.
+ *
+ * @param s signer context; it must outlive the template
+ * @param url The request URL including the fixed query parameters.
+ * @param mode output format
+ * @param http_method The HTTP request method to use or NULL for the default.
+ *
+ * @return the template, to be freed with \ref oauth_request_template_free,
+ * or NULL on error
+ */
+oauth_request_template *oauth_request_template_new (const oauth_signer *s,
+  const char *url, OAuthOutput mode, const char *http_method);
+
+/**
+ * free a template created by \ref oauth_request_template_new.
+ */
+void oauth_request_template_free (oauth_request_template *t);
+
+/**
+ * sign a new instance of the request, with the same output and return
+ * value as \ref oauth_signer_sign_url_into. A template is not modified
+ * by signing and can be shared by threads.
+ *
+ * @param t the template
+ * @param buf output buffer
+ * @param size size of the output buffer
+ *
+ * @return length of the signed request or 0 if an error occurred.
+ */
+size_t oauth_request_template_sign_into (const oauth_request_template *t,
+  char *buf, size_t size);
+
+/**
+ * same as \ref oauth_request_template_sign_into, allocating the result.
+ *
+ * @return the signed request, to be freed by the caller, or NULL
+ */
+char *oauth_request_template_sign (const oauth_request_template *t);
+
+/**
+ * a single request of a batch, see \ref oauth_sign_batch.
+ * The request is either given as 'url' or as array ('argc', 'argv').
+ * Credentials are taken from 'signer' if it is not NULL.
+ */
+typedef struct {
+  const char *url; ///< request URL including query parameters, or NULL
+  int argc; ///< number of elements in argv (if url is NULL)
+  char **argv; ///< base URL and parameters (see \ref oauth_sign_array2)
+  const char *http_method; ///< HTTP request method or NULL for the default
+  OAuthOutput mode; ///< output format
+  const oauth_signer *signer; ///< signer to use or NULL
+  OAuthMethod method; ///< signature method (if signer is NULL)
+  const char *c_key; ///< consumer key (if signer is NULL)
+  const char *c_secret; ///< consumer secret (if signer is NULL)
+  const char *t_key; ///< token key or NULL (if signer is NULL)
+  const char *t_secret; ///< token secret or NULL (if signer is NULL)
+  const char *result; ///< [out] signed request or NULL if an error occurred
+} oauth_batch_request;
+
+/**
+ * sign a number of requests at once.
+ *
+ * Set-up is shared by the batch: requests with the same credentials
+ * share one signer, nonces are drawn in bulk from the random number
+ * generator, one timestamp is used for all requests and the
+ * normalization scratch space is reused. The output of each request
+ * is the same as the one of \ref oauth_sign_url2_into.
+ *
+ * All results are stored in one block of memory that is returned by
+ * this function; 'result' of every request points into it.
+ *
+ * @param reqs array of requests
+ * @param n number of requests
+ * @return the result block (to be freed by the caller) or NULL if n < 1.
+ */
+char *oauth_sign_batch (oauth_batch_request *reqs, int n);
+
+/**
+ * a token holder of a fan-out request, see \ref oauth_sign_fanout.
+ */
+typedef struct {
+  const char *t_key; ///< token key
+  const char *t_secret; ///< token secret or NULL
+  const char *result; ///< [out] signed request or NULL if an error occurred
+} oauth_fanout_token;
+
+/**
+ * sign one request on behalf of many token holders, eg. to post the
+ * same payload for a number of users.
+ *
+ * The request is normalized and serialized once; for every token only
+ * the oauth_token, a nonce and the signature are spliced in. One
+ * timestamp is used for all tokens. HMAC-SHA1 signatures are computed
+ * side by side with \ref oauth_hmac_sha1_digest_multi.
+ *
+ * The output of each token is the same as the one of
+ * \ref oauth_sign_url2_into with that token, eg. the oauth parameters
+ * of an Authorization header (OA_OUT_HEADER) or the postargs
+ * (OA_OUT_POSTARGS). All results are stored in one block of memory
+ * that is returned by this function; 'result' of every token points
+ * into it.
+ *
+ * @param url The request URL with its parameters, not including oauth_token.
+ * @param mode output format
+ * @param method signature method
+ * @param http_method The HTTP request method to use or NULL for the default.
+ * @param c_key consumer key
+ * @param c_secret consumer secret
+ * @param tokens array of token holders
+ * @param n number of tokens
+ * @return the result block (to be freed by the caller) or NULL if n < 1
+ * or the URL has an oauth_token parameter.
+ */
+char *oauth_sign_fanout (const char *url,
+  OAuthOutput mode,
+  OAuthMethod method,
+  const char *http_method, //< HTTP request method
+  const char *c_key, //< consumer key - posted plain text
+  const char *c_secret, //< consumer secret - used as 1st part of secret-key
+  oauth_fanout_token *tokens, int n);
+
+/**
+ * enable the normalization cache of \ref oauth_sign_url2 and
+ * \ref oauth_signer_sign_url (disabled by default).
+ *
+ * The cache maps a request - the URL with its parameters, the output
+ * format, the signature and HTTP methods and whether a token is used -
+ * to the request in split, escaped and sorted form, with placeholders
+ * for the consumer key, the token, the nonce and the timestamp. A
+ * repeated request only fills these in and is signed; any credentials
+ * can use the same entry. Requests that contain an oauth_consumer_key
+ * or oauth_token parameter are not cached.
+ *
+ * The least recently used entry is evicted once the cache is full.
+ * The cache may be used by several threads. Changing its size drops
+ * all entries.
+ *
+ * @param entries maximum number of cached requests, 0 disables the cache
+ * @return the previous size or -1 if the cache is not supported on
+ * this platform
+ */
+int oauth_sign_cache_size (int entries);
+
+/**
+ * counters of the normalization cache, see \ref oauth_sign_cache_size.
+ *
+ * @param hits [out] number of requests signed from the cache or NULL
+ * @param misses [out] number of requests added to the cache or NULL
+ */
+void oauth_sign_cache_stats (unsigned long *hits, unsigned long *misses);
+
 
 /**
  * calculate body hash (sha1sum) of given file and return
@@ -0,0 +1,936 @@
+/*
+ * OAuth string codecs: base64 and url-escaping.
+ *
+ * The original base64 functions are by Jan-Henrik Haukeland,
+ * <hauk@tildeslash.com>, url-escaping was inspired by libcurl's
+ * curl_escape under ISC-license.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+/*
+ * The kernels come in three flavours: portable table driven code and
+ * SSSE3 / AVX2 versions that are compiled with target attributes and
+ * selected at run-time. The SIMD loops only handle the "easy" bulk of
+ * the input and leave everything else (tails, padding, characters
+ * outside the alphabet) to the scalar code, so all flavours produce
+ * identical results.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "xmalloc.h"
+#include "oauth.h"
+#include "oauth_codec.h"
+
+#if defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__)) \
+	&& (defined(__x86_64__) || defined(__i386__))
+# define OAUTH_CODEC_X86 1
+# include <immintrin.h>
+#endif
+
+#define OAUTH_CPU_SSSE3 1
+#define OAUTH_CPU_AVX2  2
+
+/**
+ * SIMD features of this CPU (OAUTH_CPU_* bits).
+ */
+static int oauth_codec_cpu(void) {
+	static int cpu = -1;
+	if (cpu < 0) {
+		int f = 0;
+#ifdef OAUTH_CODEC_X86
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("ssse3")) f |= OAUTH_CPU_SSSE3;
+		if (__builtin_cpu_supports("avx2")) f |= OAUTH_CPU_AVX2;
+#endif
+		cpu = f;
+	}
+	return cpu;
+}
+
+/**
+ * Base64 encode one byte
+ */
+char oauth_b64_encode(unsigned char u) {
+  if(u < 26)  return 'A'+u;
+  if(u < 52)  return 'a'+(u-26);
+  if(u < 62)  return '0'+(u-52);
+  if(u == 62) return '+';
+  return '/';
+}
+
+/**
+ * Decode a single base64 character.
+ */
+unsigned char oauth_b64_decode(char c) {
+  if(c >= 'A' && c <= 'Z') return(c - 'A');
+  if(c >= 'a' && c <= 'z') return(c - 'a' + 26);
+  if(c >= '0' && c <= '9') return(c - '0' + 52);
+  if(c == '+')             return 62;
+  return 63;
+}
+
+/**
+ * Return TRUE if 'c' is a valid base64 character, otherwise FALSE
+ */
+int oauth_b64_is_base64(char c) {
+  if((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+     (c >= '0' && c <= '9') || (c == '+')             ||
+     (c == '/')             || (c == '=')) {
+    return 1;
+  }
+  return 0;
+}
+
+static const char oauth_b64_alphabet[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+#define B64_PAD 0xfe ///< oauth_b64_value[] of '='
+#define B64_BAD 0xff ///< oauth_b64_value[] of characters outside the alphabet
+
+/**
+ * 6 bit value of a base64 character, B64_PAD or B64_BAD.
+ */
+static const unsigned char oauth_b64_value[256] = {
+#define X B64_BAD
+	X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X, X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,
+	X,X,X,X,X,X,X,X,X,X,X,62,X,X,X,63,
+	52,53,54,55,56,57,58,59,60,61,X,X,X,B64_PAD,X,X,
+	X,0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,
+	15,16,17,18,19,20,21,22,23,24,25,X,X,X,X,X,
+	X,26,27,28,29,30,31,32,33,34,35,36,37,38,39,40,
+	41,42,43,44,45,46,47,48,49,50,51,X,X,X,X,X,
+	X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X, X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,
+	X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X, X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,
+	X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X, X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,
+	X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X, X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,
+#undef X
+};
+
+#ifdef OAUTH_CODEC_X86
+/*
+ * SIMD base64, after the algorithms described by Wojciech Muła and
+ * Daniel Lemire ("Faster Base64 Encoding and Decoding using AVX2
+ * Instructions") and used in Alfred Klomp's libbase64.
+ */
+
+/* 12 input bytes (in the low 12 bytes of each 128 bit lane) to 16 sextets */
+#define B64_ENC_SPLIT(PFX, W, in) \
+	PFX##_or_si##W( \
+		PFX##_mulhi_epu16(PFX##_and_si##W(in, PFX##_set1_epi32(0x0fc0fc00)), PFX##_set1_epi32(0x04000040)), \
+		PFX##_mullo_epi16(PFX##_and_si##W(in, PFX##_set1_epi32(0x003f03f0)), PFX##_set1_epi32(0x01000010)))
+
+__attribute__ ((target ("ssse3")))
+static size_t oauth_b64_enc_ssse3(char *dst, const unsigned char *src, size_t size) {
+	const __m128i split = _mm_setr_epi8(1,0,2,1, 4,3,5,4, 7,6,8,7, 10,9,11,10);
+	const __m128i shift = _mm_setr_epi8('a'-26, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52,
+			'0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '+'-62, '/'-63, 'A', 0, 0);
+	size_t i = 0;
+	for (; i + 16 <= size; i += 12, dst += 16) {
+		__m128i in = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (src + i)), split);
+		__m128i idx, r;
+		idx = B64_ENC_SPLIT(_mm, 128, in);
+		r = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+		r = _mm_or_si128(r, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), idx), _mm_set1_epi8(13)));
+		r = _mm_add_epi8(_mm_shuffle_epi8(shift, r), idx);
+		_mm_storeu_si128((__m128i*) dst, r);
+	}
+	return i;
+}
+
+__attribute__ ((target ("avx2")))
+static size_t oauth_b64_enc_avx2(char *dst, const unsigned char *src, size_t size) {
+	const __m256i split = _mm256_setr_epi8(1,0,2,1, 4,3,5,4, 7,6,8,7, 10,9,11,10,
+			1,0,2,1, 4,3,5,4, 7,6,8,7, 10,9,11,10);
+	const __m256i shift = _mm256_setr_epi8('a'-26, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52,
+			'0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '+'-62, '/'-63, 'A', 0, 0,
+			'a'-26, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52,
+			'0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '+'-62, '/'-63, 'A', 0, 0);
+	size_t i = 0;
+	for (; i + 28 <= size; i += 24, dst += 32) {
+		__m256i in = _mm256_inserti128_si256(_mm256_castsi128_si256(
+					_mm_loadu_si128((const __m128i*) (src + i))),
+				_mm_loadu_si128((const __m128i*) (src + i + 12)), 1);
+		__m256i idx, r;
+		in = _mm256_shuffle_epi8(in, split);
+		idx = B64_ENC_SPLIT(_mm256, 256, in);
+		r = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+		r = _mm256_or_si256(r, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx), _mm256_set1_epi8(13)));
+		r = _mm256_add_epi8(_mm256_shuffle_epi8(shift, r), idx);
+		_mm256_storeu_si256((__m256i*) dst, r);
+	}
+	return i;
+}
+
+/*
+ * decode 16 (32) characters to 12 (24) bytes while the input consists of
+ * alphabet characters only. Nothing is written past the decoded bytes.
+ *
+ * @return number of characters consumed.
+ */
+__attribute__ ((target ("ssse3")))
+static size_t oauth_b64_dec_ssse3(unsigned char *dst, size_t size, const unsigned char *src, size_t len) {
+	const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+			0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+			0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+			0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i mask_2f = _mm_set1_epi8(0x2f);
+	const __m128i pack = _mm_setr_epi8(2,1,0, 6,5,4, 10,9,8, 14,13,12, -1,-1,-1,-1);
+	size_t i = 0, o = 0;
+	for (; i + 16 <= len && o + 12 <= size; i += 16, o += 12) {
+		__m128i in = _mm_loadu_si128((const __m128i*) (src + i));
+		__m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(in, 4), mask_2f);
+		__m128i lo_nibbles = _mm_and_si128(in, mask_2f);
+		__m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+		__m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+		__m128i roll;
+		if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())))
+			break;
+		roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(_mm_cmpeq_epi8(in, mask_2f), hi_nibbles));
+		in = _mm_add_epi8(in, roll);
+		in = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+		in = _mm_madd_epi16(in, _mm_set1_epi32(0x00011000));
+		in = _mm_shuffle_epi8(in, pack);
+		_mm_storel_epi64((__m128i*) (dst + o), in);
+		{
+			const uint32_t w = (uint32_t) _mm_cvtsi128_si32(_mm_srli_si128(in, 8));
+			memcpy(dst + o + 8, &w, 4);
+		}
+	}
+	return i;
+}
+
+__attribute__ ((target ("avx2")))
+static size_t oauth_b64_dec_avx2(unsigned char *dst, size_t size, const unsigned char *src, size_t len) {
+	const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+			0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+			0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+			0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+			0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+			0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+			0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+			0, 0, 0, 0, 0, 0, 0, 0,
+			0, 16, 19, 4, -65, -65, -71, -71,
+			0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+	const __m256i pack = _mm256_setr_epi8(2,1,0, 6,5,4, 10,9,8, 14,13,12, -1,-1,-1,-1,
+			2,1,0, 6,5,4, 10,9,8, 14,13,12, -1,-1,-1,-1);
+	const __m256i perm = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+	size_t i = 0, o = 0;
+	for (; i + 32 <= len && o + 24 <= size; i += 32, o += 24) {
+		__m256i in = _mm256_loadu_si256((const __m256i*) (src + i));
+		__m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(in, 4), mask_2f);
+		__m256i lo_nibbles = _mm256_and_si256(in, mask_2f);
+		__m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+		__m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+		__m256i roll;
+		if (_mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_and_si256(lo, hi), _mm256_setzero_si256())))
+			break;
+		roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(_mm256_cmpeq_epi8(in, mask_2f), hi_nibbles));
+		in = _mm256_add_epi8(in, roll);
+		in = _mm256_maddubs_epi16(in, _mm256_set1_epi32(0x01400140));
+		in = _mm256_madd_epi16(in, _mm256_set1_epi32(0x00011000));
+		in = _mm256_shuffle_epi8(in, pack);
+		in = _mm256_permutevar8x32_epi32(in, perm);
+		_mm_storeu_si128((__m128i*) (dst + o), _mm256_castsi256_si128(in));
+		_mm_storel_epi64((__m128i*) (dst + o + 16), _mm256_extracti128_si256(in, 1));
+	}
+	return i;
+}
+#endif
+
+size_t oauth_encode_base64_into(const unsigned char *src, size_t size, char *dst, size_t dstsize) {
+	const size_t olen = 4 * ((size + 2) / 3);
+	size_t i = 0;
+	char *p = dst;
+
+	if (olen >= dstsize) return olen;
+#ifdef OAUTH_CODEC_X86
+	if (oauth_codec_cpu() & OAUTH_CPU_AVX2) i = oauth_b64_enc_avx2(p, src, size);
+	if (oauth_codec_cpu() & OAUTH_CPU_SSSE3) i += oauth_b64_enc_ssse3(p + i/3*4, src + i, size - i);
+	p += i / 3 * 4;
+#endif
+	for (; i + 3 <= size; i += 3) {
+		const unsigned int v = (src[i] << 16) | (src[i+1] << 8) | src[i+2];
+		*p++ = oauth_b64_alphabet[v >> 18];
+		*p++ = oauth_b64_alphabet[(v >> 12) & 0x3f];
+		*p++ = oauth_b64_alphabet[(v >> 6) & 0x3f];
+		*p++ = oauth_b64_alphabet[v & 0x3f];
+	}
+	if (i < size) {
+		const unsigned int v = (src[i] << 16) | (i + 1 < size ? src[i+1] << 8 : 0);
+		*p++ = oauth_b64_alphabet[v >> 18];
+		*p++ = oauth_b64_alphabet[(v >> 12) & 0x3f];
+		*p++ = i + 1 < size ? oauth_b64_alphabet[(v >> 6) & 0x3f] : '=';
+		*p++ = '=';
+	}
+	*p = '\0';
+	return olen;
+}
+
+/**
+ * Base64 encode and return size data in 'src'. The caller must free the
+ * returned string.
+ *
+ * @param size The size of the data in src
+ * @param src The data to be base64 encode
+ * @return encoded string otherwise NULL
+ */
+char *oauth_encode_base64(int size, const unsigned char *src) {
+	size_t olen;
+	char *out;
+
+	if(!src) return NULL;
+	if(!size) size= strlen((char *)src);
+	olen = 4 * (((size_t) size + 2) / 3);
+	out= (char*) xmalloc(olen + 1);
+	oauth_encode_base64_into(src, size, out, olen + 1);
+	return out;
+}
+
+/**
+ * bulk-decode whole quads of alphabet characters with the SIMD kernels.
+ * @return number of characters consumed (a multiple of 4).
+ */
+static size_t oauth_b64_dec_bulk(unsigned char *dst, size_t size, const unsigned char *src, size_t len) {
+	size_t i = 0;
+#ifdef OAUTH_CODEC_X86
+	const int cpu = oauth_codec_cpu();
+	if (cpu & OAUTH_CPU_AVX2) i = oauth_b64_dec_avx2(dst, size, src, len);
+	if (cpu & OAUTH_CPU_SSSE3) i += oauth_b64_dec_ssse3(dst + i/4*3, size - i/4*3, src + i, len - i);
+#endif
+	return i;
+}
+
+int oauth_decode_base64_into(const char *src, size_t len, unsigned char *dst, size_t size, int flags) {
+	const unsigned char *s = (const unsigned char*) src;
+	size_t i = 0, o = 0;
+
+	if (!src || (!dst && size)) return -1;
+
+	if (flags & OAUTH_B64_STRICT) {
+		size_t pad = 0, n;
+		unsigned int v;
+		if (len % 4) return -1;
+		if (len && s[len-1] == '=') pad++;
+		if (len && s[len-2] == '=') pad++;
+		n = len / 4 * 3 - pad;
+		if (n > size) return -1;
+		if (len == 0) return 0;
+
+		// all quads but the last one
+		i = oauth_b64_dec_bulk(dst, size, s, len - 4);
+		o = i / 4 * 3;
+		for (; i < len - 4; i += 4) {
+			const unsigned char a = oauth_b64_value[s[i]], b = oauth_b64_value[s[i+1]],
+				c = oauth_b64_value[s[i+2]], d = oauth_b64_value[s[i+3]];
+			if ((a | b | c | d) & 0xc0) return -1;
+			v = (a << 18) | (b << 12) | (c << 6) | d;
+			dst[o++] = v >> 16;
+			dst[o++] = v >> 8;
+			dst[o++] = v;
+		}
+		// last quad, with padding; unused bits must be zero
+		{
+			const unsigned char a = oauth_b64_value[s[i]], b = oauth_b64_value[s[i+1]];
+			const unsigned char c = pad > 1 ? 0 : oauth_b64_value[s[i+2]];
+			const unsigned char d = pad > 0 ? 0 : oauth_b64_value[s[i+3]];
+			if ((a | b | c | d) & 0xc0) return -1;
+			v = (a << 18) | (b << 12) | (c << 6) | d;
+			if (v & (pad == 2 ? 0xffff : pad == 1 ? 0xff : 0)) return -1;
+			dst[o++] = v >> 16;
+			if (pad < 2) dst[o++] = v >> 8;
+			if (pad < 1) dst[o++] = v;
+		}
+		return (int) o;
+	}
+
+	// lenient: the rules of the original oauth_decode_base64()
+	while (i < len) {
+		unsigned char c[4], b[4];
+		int k = 0;
+		size_t n = oauth_b64_dec_bulk(dst + o, size - o, s + i, len - i);
+		i += n;
+		o += n / 4 * 3;
+		if (i >= len) break;
+
+		// collect the next quad, skipping characters that are not base64
+		for (; i < len && k < 4; i++) {
+			const unsigned char v = oauth_b64_value[s[i]];
+			if (v == B64_BAD) continue;
+			c[k] = s[i];
+			b[k++] = v == B64_PAD ? 63 : v;
+		}
+		if (!k) break;
+		for (; k < 4; k++) { c[k] = 'A'; b[k] = 0; }
+		if (o + (c[2] != '=') + (c[3] != '=') >= size) return -1;
+		dst[o++] = (b[0] << 2) | (b[1] >> 4);
+		if (c[2] != '=') dst[o++] = ((b[1] & 0xf) << 4) | (b[2] >> 2);
+		if (c[3] != '=') dst[o++] = ((b[2] & 0x3) << 6) | b[3];
+	}
+	return (int) o;
+}
+
+/**
+ * Decode the base64 encoded string 'src' into the memory pointed to by
+ * 'dest'.
+ *
+ * @param dest Pointer to memory for holding the decoded string.
+ * Must be large enough to receive the decoded string.
+ * @param src A base64 encoded string.
+ * @return the length of the decoded string if decode
+ * succeeded otherwise 0.
+ */
+int oauth_decode_base64(unsigned char *dest, const char *src) {
+	int rv;
+	if (!src || !*src) return 0;
+	// the caller guarantees the size, the old API had no way to pass it
+	rv = oauth_decode_base64_into(src, strlen(src), dest, ((size_t) -1) / 2, 0);
+	if (rv < 0) return 0;
+	dest[rv] = '\0';
+	return rv;
+}
+
+/**
+ * unreserved characters according to RFC3986 and
+ * http://oauth.net/core/1.0/#encoding_parameters
+ */
+static const unsigned char oauth_unreserved[256] = {
+	['0']=1, ['1']=1, ['2']=1, ['3']=1, ['4']=1, ['5']=1, ['6']=1, ['7']=1, ['8']=1, ['9']=1,
+	['a']=1, ['b']=1, ['c']=1, ['d']=1, ['e']=1, ['f']=1, ['g']=1, ['h']=1, ['i']=1,
+	['j']=1, ['k']=1, ['l']=1, ['m']=1, ['n']=1, ['o']=1, ['p']=1, ['q']=1, ['r']=1,
+	['s']=1, ['t']=1, ['u']=1, ['v']=1, ['w']=1, ['x']=1, ['y']=1, ['z']=1,
+	['A']=1, ['B']=1, ['C']=1, ['D']=1, ['E']=1, ['F']=1, ['G']=1, ['H']=1, ['I']=1,
+	['J']=1, ['K']=1, ['L']=1, ['M']=1, ['N']=1, ['O']=1, ['P']=1, ['Q']=1, ['R']=1,
+	['S']=1, ['T']=1, ['U']=1, ['V']=1, ['W']=1, ['X']=1, ['Y']=1, ['Z']=1,
+	['_']=1, ['~']=1, ['.']=1, ['-']=1
+};
+
+#define H1(h) #h "0" #h "1" #h "2" #h "3" #h "4" #h "5" #h "6" #h "7" \
+	#h "8" #h "9" #h "A" #h "B" #h "C" #h "D" #h "E" #h "F"
+/**
+ * upper-case hex representation of all byte values, two characters each.
+ */
+static const char oauth_hexpairs[513] =
+	H1(0) H1(1) H1(2) H1(3) H1(4) H1(5) H1(6) H1(7)
+	H1(8) H1(9) H1(A) H1(B) H1(C) H1(D) H1(E) H1(F);
+#undef H1
+
+#ifdef OAUTH_CODEC_X86
+/*
+ * bit-mask of the bytes in a 16 (32) byte chunk that need escaping.
+ * Unsigned range checks are done as (c - lo) == min(c - lo, hi - lo).
+ */
+#define URL_RESERVED_MASK(PFX, W, c) ({ \
+	const __m##W##i a = PFX##_sub_epi8(PFX##_or_si##W(c, PFX##_set1_epi8(0x20)), PFX##_set1_epi8('a')); \
+	const __m##W##i d = PFX##_sub_epi8(c, PFX##_set1_epi8('0')); \
+	const __m##W##i m = PFX##_sub_epi8(c, PFX##_set1_epi8('-')); \
+	__m##W##i ok = PFX##_cmpeq_epi8(PFX##_min_epu8(a, PFX##_set1_epi8(25)), a); \
+	ok = PFX##_or_si##W(ok, PFX##_cmpeq_epi8(PFX##_min_epu8(d, PFX##_set1_epi8(9)), d)); \
+	ok = PFX##_or_si##W(ok, PFX##_cmpeq_epi8(PFX##_min_epu8(m, PFX##_set1_epi8(1)), m)); \
+	ok = PFX##_or_si##W(ok, PFX##_cmpeq_epi8(c, PFX##_set1_epi8('_'))); \
+	ok = PFX##_or_si##W(ok, PFX##_cmpeq_epi8(c, PFX##_set1_epi8('~'))); \
+	~(uint32_t) PFX##_movemask_epi8(ok); })
+
+__attribute__ ((target ("ssse3")))
+static size_t oauth_url_reserved_ssse3(const char *src, size_t len, size_t *n) {
+	size_t i, cnt = 0;
+	for (i = 0; i + 16 <= len; i += 16) {
+		const __m128i c = _mm_loadu_si128((const __m128i*) (src + i));
+		cnt += __builtin_popcount(URL_RESERVED_MASK(_mm, 128, c) & 0xffff);
+	}
+	*n = cnt;
+	return i;
+}
+
+__attribute__ ((target ("avx2")))
+static size_t oauth_url_reserved_avx2(const char *src, size_t len, size_t *n) {
+	size_t i, cnt = 0;
+	for (i = 0; i + 32 <= len; i += 32) {
+		const __m256i c = _mm256_loadu_si256((const __m256i*) (src + i));
+		cnt += __builtin_popcount(URL_RESERVED_MASK(_mm256, 256, c));
+	}
+	*n = cnt;
+	return i;
+}
+
+/*
+ * escape 16 (32) byte chunks: chunks without reserved characters are
+ * stored as they are, others copy the runs between reserved bytes.
+ */
+__attribute__ ((target ("ssse3")))
+static size_t oauth_url_escape_ssse3(char **dst, const char *src, size_t len) {
+	char *p = *dst;
+	size_t i;
+	for (i = 0; i + 16 <= len; i += 16) {
+		const __m128i c = _mm_loadu_si128((const __m128i*) (src + i));
+		uint32_t m = URL_RESERVED_MASK(_mm, 128, c) & 0xffff;
+		size_t k = 0;
+		if (!m) {
+			_mm_storeu_si128((__m128i*) p, c);
+			p += 16;
+			continue;
+		}
+		while (m) {
+			const size_t r = __builtin_ctz(m);
+			const unsigned char in = src[i + r];
+			memcpy(p, src + i + k, r - k);
+			p += r - k;
+			*p++ = '%';
+			memcpy(p, oauth_hexpairs + 2 * in, 2);
+			p += 2;
+			k = r + 1;
+			m &= m - 1;
+		}
+		memcpy(p, src + i + k, 16 - k);
+		p += 16 - k;
+	}
+	*dst = p;
+	return i;
+}
+
+__attribute__ ((target ("avx2")))
+static size_t oauth_url_escape_avx2(char **dst, const char *src, size_t len) {
+	char *p = *dst;
+	size_t i;
+	for (i = 0; i + 32 <= len; i += 32) {
+		const __m256i c = _mm256_loadu_si256((const __m256i*) (src + i));
+		uint32_t m = URL_RESERVED_MASK(_mm256, 256, c);
+		size_t k = 0;
+		if (!m) {
+			_mm256_storeu_si256((__m256i*) p, c);
+			p += 32;
+			continue;
+		}
+		while (m) {
+			const size_t r = __builtin_ctz(m);
+			const unsigned char in = src[i + r];
+			memcpy(p, src + i + k, r - k);
+			p += r - k;
+			*p++ = '%';
+			memcpy(p, oauth_hexpairs + 2 * in, 2);
+			p += 2;
+			k = r + 1;
+			m &= m - 1;
+		}
+		memcpy(p, src + i + k, 32 - k);
+		p += 32 - k;
+	}
+	*dst = p;
+	return i;
+}
+#endif
+
+size_t codec_url_escape_len(const char *src, size_t len) {
+	size_t i = 0, rv = len;
+#ifdef OAUTH_CODEC_X86
+	const int cpu = oauth_codec_cpu();
+	size_t n;
+	if (cpu & OAUTH_CPU_AVX2) {
+		i = oauth_url_reserved_avx2(src, len, &n);
+		rv += 2 * n;
+	}
+	if (cpu & OAUTH_CPU_SSSE3) {
+		i += oauth_url_reserved_ssse3(src + i, len - i, &n);
+		rv += 2 * n;
+	}
+#endif
+	for (; i < len; i++)
+		if (!oauth_unreserved[(unsigned char) src[i]]) rv+=2;
+	return rv;
+}
+
+size_t codec_url_escape_to(char *dst, const char *src, size_t len) {
+	char *p = dst;
+	size_t i = 0;
+#ifdef OAUTH_CODEC_X86
+	const int cpu = oauth_codec_cpu();
+	if (cpu & OAUTH_CPU_AVX2) i = oauth_url_escape_avx2(&p, src, len);
+	if (cpu & OAUTH_CPU_SSSE3) i += oauth_url_escape_ssse3(&p, src + i, len - i);
+#endif
+	for (; i < len; i++) {
+		const unsigned char in = src[i];
+		if (oauth_unreserved[in]) {
+			*p++ = in;
+		} else {
+			*p++ = '%';
+			*p++ = oauth_hexpairs[2*in];
+			*p++ = oauth_hexpairs[2*in+1];
+		}
+	}
+	return p-dst;
+}
+
+size_t oauth_url_escape_into(const char *src, size_t len, char *dst, size_t size) {
+	const size_t n = codec_url_escape_len(src, len);
+	if (n < size) {
+		codec_url_escape_to(dst, src, len);
+		dst[n] = '\0';
+	}
+	return n;
+}
+
+/**
+ * Escape 'string' according to RFC3986 and
+ * http://oauth.net/core/1.0/#encoding_parameters.
+ *
+ * @param string The data to be encoded
+ * @return encoded string otherwise NULL
+ * The caller must free the returned string.
+ */
+char *oauth_url_escape(const char *string) {
+	size_t len, n;
+	char *ns;
+
+	if (!string) return xstrdup("");
+	len = strlen(string);
+	n = codec_url_escape_len(string, len);
+	ns = (char*) xmalloc(n + 1);
+	codec_url_escape_to(ns, string, len);
+	ns[n] = '\0';
+	return ns;
+}
+
+/**
+ * value of a hex digit, 0xff for anything else.
+ */
+static const unsigned char oauth_hexval[256] = {
+#define X 0xff
+	X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X, X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,
+	X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X, 0,1,2,3,4,5,6,7,8,9,X,X,X,X,X,X,
+	X,10,11,12,13,14,15,X,X,X,X,X,X,X,X,X, X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,
+	X,10,11,12,13,14,15,X,X,X,X,X,X,X,X,X, X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,
+	X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X, X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,
+	X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X, X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,
+	X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X, X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,
+	X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X, X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,
+#undef X
+};
+
+/**
+ * unescape the byte at src[i] (and the two hex digits following a '%').
+ * @return index of the next input byte
+ */
+static inline size_t oauth_url_unescape_step(char *dst, size_t *o, const char *src, size_t i, size_t len, int plus) {
+	unsigned char c = src[i++];
+	if (c == '%' && i + 1 < len) {
+		const unsigned char h = oauth_hexval[(unsigned char) src[i]];
+		const unsigned char l = oauth_hexval[(unsigned char) src[i+1]];
+		if ((h | l) != 0xff) {
+			c = (h << 4) | l;
+			i += 2;
+		}
+	} else if (c == '+' && plus) {
+		c = ' ';
+	}
+	dst[(*o)++] = c;
+	return i;
+}
+
+#ifdef OAUTH_CODEC_X86
+/*
+ * unescape 16 (32) byte chunks: chunks without '%' (or '+' if plus
+ * is set) are stored as they are, others are done byte by byte.
+ * The output never gets ahead of the input, so dst may be src.
+ * @return number of input bytes consumed
+ */
+__attribute__ ((target ("ssse3")))
+static size_t oauth_url_unescape_ssse3(char *dst, size_t *po, const char *src, size_t len, int plus) {
+	const __m128i pct = _mm_set1_epi8('%');
+	const __m128i pls = _mm_set1_epi8(plus ? '+' : '%');
+	size_t i = 0, o = 0;
+	while (i + 16 <= len) {
+		const __m128i c = _mm_loadu_si128((const __m128i*) (src + i));
+		const uint32_t m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(c, pct), _mm_cmpeq_epi8(c, pls)));
+		const size_t end = i + 16, r = m ? __builtin_ctz(m) : 16;
+		if (!m) {
+			_mm_storeu_si128((__m128i*) (dst + o), c);
+			i += 16; o += 16;
+			continue;
+		}
+		memmove(dst + o, src + i, r);
+		i += r; o += r;
+		while (i < end) i = oauth_url_unescape_step(dst, &o, src, i, len, plus);
+	}
+	*po = o;
+	return i;
+}
+
+__attribute__ ((target ("avx2")))
+static size_t oauth_url_unescape_avx2(char *dst, size_t *po, const char *src, size_t len, int plus) {
+	const __m256i pct = _mm256_set1_epi8('%');
+	const __m256i pls = _mm256_set1_epi8(plus ? '+' : '%');
+	size_t i = 0, o = 0;
+	while (i + 32 <= len) {
+		const __m256i c = _mm256_loadu_si256((const __m256i*) (src + i));
+		const uint32_t m = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(c, pct), _mm256_cmpeq_epi8(c, pls)));
+		const size_t end = i + 32, r = m ? __builtin_ctz(m) : 32;
+		if (!m) {
+			_mm256_storeu_si256((__m256i*) (dst + o), c);
+			i += 32; o += 32;
+			continue;
+		}
+		memmove(dst + o, src + i, r);
+		i += r; o += r;
+		while (i < end) i = oauth_url_unescape_step(dst, &o, src, i, len, plus);
+	}
+	*po = o;
+	return i;
+}
+#endif
+
+size_t codec_url_unescape_to(char *dst, const char *src, size_t len, int flags) {
+	const int plus = flags & OAUTH_UNESCAPE_PLUS;
+	size_t i = 0, o = 0;
+#ifdef OAUTH_CODEC_X86
+	const int cpu = oauth_codec_cpu();
+	size_t n;
+	if (cpu & OAUTH_CPU_AVX2) {
+		i = oauth_url_unescape_avx2(dst, &o, src, len, plus);
+	}
+	if (cpu & OAUTH_CPU_SSSE3) {
+		i += oauth_url_unescape_ssse3(dst + o, &n, src + i, len - i, plus);
+		o += n;
+	}
+#endif
+	while (i < len) i = oauth_url_unescape_step(dst, &o, src, i, len, plus);
+	return o;
+}
+
+static const unsigned char oauth_span_class[256] = {
+	['&']=CODEC_SEP, ['?']=CODEC_SEP, ['=']=CODEC_EQ,
+	['%']=CODEC_PCT, ['+']=CODEC_PLS, ['\001']=CODEC_SOH
+};
+
+#ifdef OAUTH_CODEC_X86
+/*
+ * delimiters stop the scan, the other classes are collected from the
+ * bytes flagged in the 'mark' mask.
+ */
+#define SPAN_SCAN_CHUNK(W, PFX, SI) { \
+	const __m##W##i c = PFX##_loadu_si##SI((const __m##W##i*) (src + i)); \
+	const uint32_t stop = PFX##_movemask_epi8(PFX##_or_si##SI(PFX##_or_si##SI( \
+			PFX##_cmpeq_epi8(c, PFX##_set1_epi8('&')), PFX##_cmpeq_epi8(c, PFX##_set1_epi8('?'))), \
+			PFX##_cmpeq_epi8(c, PFX##_set1_epi8('=')))); \
+	uint32_t mark = PFX##_movemask_epi8(PFX##_or_si##SI(PFX##_or_si##SI( \
+			PFX##_cmpeq_epi8(c, PFX##_set1_epi8('%')), PFX##_cmpeq_epi8(c, PFX##_set1_epi8('+'))), \
+			PFX##_cmpeq_epi8(c, PFX##_set1_epi8('\001')))); \
+	const size_t r = stop ? (size_t) __builtin_ctz(stop) : W / 8; \
+	if (r < 32) mark &= (1u << r) - 1; \
+	for (; mark; mark &= mark - 1) \
+		s |= oauth_span_class[(unsigned char) src[i + __builtin_ctz(mark)]]; \
+	if (stop) { *seen |= s; return i + r; } \
+}
+
+__attribute__ ((target ("ssse3")))
+static size_t oauth_span_scan_ssse3(const char *src, size_t len, unsigned char *seen) {
+	unsigned char s = 0;
+	size_t i;
+	for (i = 0; i + 16 <= len; i += 16) SPAN_SCAN_CHUNK(128, _mm, 128)
+	*seen |= s;
+	return i;
+}
+
+__attribute__ ((target ("avx2")))
+static size_t oauth_span_scan_avx2(const char *src, size_t len, unsigned char *seen) {
+	unsigned char s = 0;
+	size_t i;
+	for (i = 0; i + 32 <= len; i += 32) SPAN_SCAN_CHUNK(256, _mm256, 256)
+	*seen |= s;
+	return i;
+}
+#undef SPAN_SCAN_CHUNK
+#endif
+
+size_t codec_span_scan(const char *src, size_t len, unsigned char *seen) {
+	unsigned char s = 0;
+	size_t i = 0;
+#ifdef OAUTH_CODEC_X86
+	const int cpu = oauth_codec_cpu();
+	// a kernel stopping at a delimiter leaves it to the others to stop there, too
+	if ((cpu & OAUTH_CPU_AVX2) && len >= 32) i = oauth_span_scan_avx2(src, len, seen);
+	if ((cpu & OAUTH_CPU_SSSE3) && len - i >= 16) i += oauth_span_scan_ssse3(src + i, len - i, seen);
+#endif
+	for (; i < len; i++) {
+		const unsigned char c = oauth_span_class[(unsigned char) src[i]];
+		if (c & (CODEC_SEP | CODEC_EQ)) break;
+		s |= c;
+	}
+	*seen |= s;
+	return i;
+}
+
+size_t oauth_url_unescape_into(const char *src, size_t len, char *dst, int flags) {
+	return codec_url_unescape_to(dst, src, len, flags);
+}
+
+/**
+ * Parse RFC3986 encoded 'string' back to  unescaped version.
+ *
+ * @param string The data to be unescaped
+ * @param olen unless NULL the length of the returned string is stored there.
+ * @return decoded string or NULL
+ * The caller must free the returned string.
+ */
+char *oauth_url_unescape(const char *string, size_t *olen) {
+	size_t len;
+	char *ns;
+
+	if (!string) return NULL;
+	len = strlen(string);
+	ns = (char*) xmalloc(len + 1);
+	len = codec_url_unescape_to(ns, string, len, 0);
+	ns[len] = '\0';
+	if (olen) *olen = len;
+	return ns;
+}
+
+/*
+ * Authorization header parsing.
+ */
+
+#define HDR_QUOTE 1 ///< '"', the end of a quoted-string
+#define HDR_BSL   2 ///< '\\', a quoted-pair follows
+#define HDR_CTL   4 ///< a control character, not allowed in a quoted-string
+#define HDR_PCT   8 ///< '%'
+#define HDR_STOP  (HDR_QUOTE | HDR_BSL | HDR_CTL)
+
+/**
+ * classes of the characters of a quoted-string (RFC 2616, 2.2):
+ * the ones that end a run of qdtext, and '%'.
+ */
+static const unsigned char oauth_qdtext_class[256] = {
+	[0]=HDR_CTL, [1]=HDR_CTL, [2]=HDR_CTL, [3]=HDR_CTL, [4]=HDR_CTL, [5]=HDR_CTL,
+	[6]=HDR_CTL, [7]=HDR_CTL, [8]=HDR_CTL, [10]=HDR_CTL, [11]=HDR_CTL,
+	[12]=HDR_CTL, [13]=HDR_CTL, [14]=HDR_CTL, [15]=HDR_CTL, [16]=HDR_CTL,
+	[17]=HDR_CTL, [18]=HDR_CTL, [19]=HDR_CTL, [20]=HDR_CTL, [21]=HDR_CTL,
+	[22]=HDR_CTL, [23]=HDR_CTL, [24]=HDR_CTL, [25]=HDR_CTL, [26]=HDR_CTL,
+	[27]=HDR_CTL, [28]=HDR_CTL, [29]=HDR_CTL, [30]=HDR_CTL, [31]=HDR_CTL,
+	[127]=HDR_CTL, ['"']=HDR_QUOTE, ['\\']=HDR_BSL, ['%']=HDR_PCT
+};
+
+/**
+ * skip optional white space.
+ */
+static size_t oauth_hdr_ows(const char *src, size_t i, size_t len) {
+	while (i < len && (src[i] == ' ' || src[i] == '\t')) i++;
+	return i;
+}
+
+/**
+ * TRUE if 'len' bytes of 'src' start with the lower-case 'word',
+ * ignoring case.
+ */
+static int oauth_hdr_word(const char *src, size_t len, const char *word) {
+	size_t i;
+	for (i=0; word[i]; i++) {
+		unsigned char c = i < len ? src[i] : 0;
+		if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+		if (c != (unsigned char) word[i]) return 0;
+	}
+	return 1;
+}
+
+int oauth_split_header(const char *src, size_t len, oauth_span *spans, int max) {
+	struct { size_t off, len; } keys[OAUTH_HEADER_MAX_PARAMS];
+	unsigned char slot[2*OAUTH_HEADER_MAX_PARAMS]; // key index: keys + 1, 0 = empty
+	const int mask = 2*OAUTH_HEADER_MAX_PARAMS - 1;
+	size_t i;
+	int n = 0;
+
+	memset(slot, 0, sizeof(slot));
+	i = oauth_hdr_ows(src, 0, len);
+	if (oauth_hdr_word(src + i, len - i, "authorization:")) i = oauth_hdr_ows(src, i + 14, len);
+	if (!oauth_hdr_word(src + i, len - i, "oauth")) return -1;
+	i += 5;
+	if (i < len && src[i] != ' ' && src[i] != '\t') return -1;
+	i = oauth_hdr_ows(src, i, len);
+
+	while (i < len) {
+		const size_t k = i;
+		size_t v, kl;
+		uint32_t h = 2166136261u; // FNV-1a
+		unsigned char c = 0, seen = 0;
+		int s;
+
+		if (n == OAUTH_HEADER_MAX_PARAMS) return -1;
+		// key=", the key consisting of unreserved characters
+		for (; i < len && oauth_unreserved[(unsigned char) src[i]]; i++)
+			h = (h ^ (unsigned char) src[i]) * 16777619u;
+		kl = i - k;
+		if (!kl || len - i < 2 || src[i] != '=' || src[i+1] != '"') return -1;
+		// the value up to the closing quote, quoted-pairs included
+		for (v = i += 2; ; i++) {
+			for (; i < len && !((c = oauth_qdtext_class[(unsigned char) src[i]]) & HDR_STOP); i++)
+				seen |= c;
+			if (i >= len || (c & HDR_CTL)) return -1;
+			if (c & HDR_QUOTE) break;
+			seen |= c;
+			if (++i >= len || (oauth_qdtext_class[(unsigned char) src[i]] & HDR_CTL)) return -1;
+		}
+
+		// each key at most once
+		for (s = h & mask; slot[s]; s = (s+1) & mask) {
+			const int o = slot[s] - 1;
+			if (keys[o].len == kl && !memcmp(src + keys[o].off, src + k, kl)) return -1;
+		}
+		slot[s] = n + 1;
+		keys[n].off = k;
+		keys[n].len = kl;
+		if (n < max) {
+			oauth_span *sp = &spans[n];
+			sp->koff = k;
+			sp->klen = kl;
+			sp->voff = v;
+			sp->vlen = i - v;
+			sp->flags = OAUTH_SPAN_HAS_VALUE | ((seen & (HDR_BSL | HDR_PCT)) ? OAUTH_SPAN_VALUE_ESCAPED : 0);
+		}
+		n++;
+
+		// a comma separates the parameters
+		i = oauth_hdr_ows(src, i + 1, len);
+		if (i >= len) break;
+		if (src[i] != ',') return -1;
+		i = oauth_hdr_ows(src, i + 1, len);
+		if (i >= len) return -1;
+	}
+	return n;
+}
+
+size_t oauth_header_unescape(const char *src, size_t len, char *dst) {
+	size_t i, o = 0;
+	if (!memchr(src, '\\', len)) return codec_url_unescape_to(dst, src, len, 0);
+	for (i=0; i < len; i++) {
+		if (src[i] == '\\' && i + 1 < len) i++;
+		dst[o++] = src[i];
+	}
+	return codec_url_unescape_to(dst, dst, o, 0);
+}
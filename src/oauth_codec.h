@@ -0,0 +1,48 @@
+/*
+ * string codecs - internal interface, not exported.
+ *
+ * Length based url-escaping and -unescaping helpers shared by oauth.c
+ * and oauth_codec.c. The public variants are declared in oauth.h.
+ */
+#ifndef _OAUTH_CODEC_H
+#define _OAUTH_CODEC_H      1
+
+#include <stddef.h>
+
+/**
+ * length of 'len' bytes of 'src' after url-escaping them.
+ */
+size_t codec_url_escape_len(const char *src, size_t len);
+
+/**
+ * url-escape 'len' bytes of 'src' into 'dst', which must hold
+ * codec_url_escape_len() bytes. Not zero-terminated.
+ *
+ * @return number of bytes written
+ */
+size_t codec_url_escape_to(char *dst, const char *src, size_t len);
+
+/**
+ * url-unescape 'len' bytes of 'src' into 'dst', which may be 'src'.
+ * (see \ref oauth_url_unescape_into)
+ *
+ * @return number of bytes written
+ */
+size_t codec_url_unescape_to(char *dst, const char *src, size_t len, int flags);
+
+#define CODEC_SEP 1  ///< parameter delimiter, '&' or '?'
+#define CODEC_EQ  2  ///< key/value delimiter, '='
+#define CODEC_PCT 4  ///< '%'
+#define CODEC_PLS 8  ///< '+'
+#define CODEC_SOH 16 ///< '\001', alias for '&'
+
+/**
+ * find the first delimiter ('&', '?' or '=') in 'len' bytes of 'src'.
+ *
+ * @param seen the CODEC_* classes of the bytes in front of it are or'ed
+ * into *seen
+ * @return index of the delimiter, or len if there is none
+ */
+size_t codec_span_scan(const char *src, size_t len, unsigned char *seen);
+
+#endif
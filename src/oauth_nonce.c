@@ -0,0 +1,373 @@
+/*
+ * OAuth nonce stores: replay protection shared by several servers.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+/*
+ * A nonce store is a check function with its data. The memcached
+ * client records each tuple with "add", which only succeeds for a key
+ * that does not exist yet, and lets it expire once its timestamp has
+ * left the window. The commands of a batch are written back to back
+ * and the replies, which memcached sends in order, are read afterwards,
+ * so a batch costs one round trip per OAUTH_MC_PIPELINE tuples.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#endif
+
+#include "xmalloc.h"
+#include "oauth.h"
+
+struct oauth_nonce_store {
+	int (*check)(void *data, const oauth_nonce *n, int *res, int cnt, long now);
+	void (*release)(void *data);
+	void *data;
+};
+
+oauth_nonce_store *oauth_nonce_store_new (
+		int (*check)(void *data, const oauth_nonce *n, int *res, int cnt, long now),
+		void (*release)(void *data), void *data) {
+	oauth_nonce_store *st;
+	if (!check) return NULL;
+	st = (oauth_nonce_store*) xcalloc(1, sizeof(oauth_nonce_store));
+	st->check = check;
+	st->release = release;
+	st->data = data;
+	return st;
+}
+
+int oauth_nonce_store_check (oauth_nonce_store *st, const oauth_nonce *n, int *res, int cnt, long now) {
+	int i, rv;
+	if (!st || cnt < 0 || (cnt && (!n || !res))) return -1;
+	if (!cnt) return 0;
+	rv = st->check(st->data, n, res, cnt, now);
+	for (i=0; i < cnt; i++)
+		if (res[i] < 0) rv = -1;
+	return rv;
+}
+
+void oauth_nonce_store_free (oauth_nonce_store *st) {
+	if (!st) return;
+	if (st->release) st->release(st->data);
+	xfree(st);
+}
+
+static int oauth_local_check(void *data, const oauth_nonce *n, int *res, int cnt, long now) {
+	int i;
+	for (i=0; i < cnt; i++)
+		res[i] = oauth_replay_check((oauth_replay_cache*) data, n[i].c_key, n[i].t_key, n[i].nonce, n[i].timestamp, now);
+	return 0;
+}
+
+static void oauth_local_release(void *data) {
+	oauth_replay_cache_free((oauth_replay_cache*) data);
+}
+
+oauth_nonce_store *oauth_nonce_store_local (oauth_replay_cache *c) {
+	if (!c) return NULL;
+	return oauth_nonce_store_new(oauth_local_check, oauth_local_release, c);
+}
+
+#ifndef WIN32
+
+#define OAUTH_MC_PIPELINE 256 ///< most commands in flight on the connection
+#define OAUTH_MC_KEYLEN 52    ///< "oauth_nonce:" and 40 hex digits
+#define OAUTH_MC_LINE 128     ///< room for a command or a reply line
+#define OAUTH_MC_MAXTTL 2592000 ///< longer expiration times are taken as absolute times
+
+#ifndef MSG_NOSIGNAL
+// the BSDs and macOS set SO_NOSIGPIPE on the socket instead
+#define MSG_NOSIGNAL 0
+#endif
+
+typedef struct {
+	char *host, *port;
+	long window;
+	int timeout;        ///< milliseconds for connecting and each send or receive
+	int fd;             ///< -1 while not connected
+	long retry;         ///< earliest time to reconnect after a failure
+	oauth_hmac_sha1 *kh;
+	oauth_nonce_store *fallback;
+	char rbuf[4096];    ///< received, unparsed replies
+	size_t rlen;
+} oauth_memcached;
+
+/**
+ * append a length-prefixed string to 'm'.
+ */
+static char *oauth_mc_put(char *m, const char *str) {
+	const size_t len = str ? strlen(str) : 0;
+	int i;
+	for (i=0; i < 4; i++) *m++ = (char) (len >> (8*i));
+	if (len) memcpy(m, str, len);
+	return m + len;
+}
+
+/**
+ * write the memcached key of 'n' to 'key', OAUTH_MC_KEYLEN bytes.
+ * The key is the same on every node, and short and free of spaces
+ * whatever the tuple contains.
+ * @return 0 on success
+ */
+static int oauth_mc_key(const oauth_memcached *mc, const oauth_nonce *n, char *key) {
+	static const char hex[] = "0123456789abcdef";
+	const size_t len = (n->c_key ? strlen(n->c_key) : 0) + (n->t_key ? strlen(n->t_key) : 0)
+		+ (n->nonce ? strlen(n->nonce) : 0) + 20;
+	char sbuf[256], *m, *p;
+	unsigned char digest[20];
+	int i, rv;
+
+	m = len <= sizeof(sbuf) ? sbuf : (char*) xmalloc(len);
+	p = oauth_mc_put(m, n->c_key);
+	p = oauth_mc_put(p, n->t_key);
+	p = oauth_mc_put(p, n->nonce);
+	for (i=0; i < 8; i++) *p++ = (char) ((unsigned long long) n->timestamp >> (8*i));
+	rv = oauth_hmac_sha1_digest(mc->kh, m, len, digest) == 20 ? 0 : -1;
+	if (m != sbuf) xfree(m);
+	memcpy(key, "oauth_nonce:", 12);
+	for (i=0; i < 20; i++) {
+		key[12 + 2*i] = hex[digest[i] >> 4];
+		key[13 + 2*i] = hex[digest[i] & 15];
+	}
+	return rv;
+}
+
+static void oauth_mc_close(oauth_memcached *mc, long now) {
+	if (mc->fd >= 0) close(mc->fd);
+	mc->fd = -1;
+	mc->rlen = 0;
+	mc->retry = now + 1;
+}
+
+/**
+ * connect to the server, waiting at most mc->timeout for each address.
+ * @return 0 on success
+ */
+static int oauth_mc_connect(oauth_memcached *mc) {
+	struct addrinfo hints, *ai, *a;
+	struct timeval tv;
+	int one = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(mc->host, mc->port, &hints, &ai)) return -1;
+	for (a = ai; a; a = a->ai_next) {
+		struct pollfd pfd;
+		int fd, err = 0;
+		socklen_t el = sizeof(err);
+		if ((fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol)) < 0) continue;
+#ifdef SO_NOSIGPIPE
+		// a server that dropped the connection must not kill the process
+		setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		if (connect(fd, a->ai_addr, a->ai_addrlen) && errno != EINPROGRESS) {
+			close(fd);
+			continue;
+		}
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+		if (poll(&pfd, 1, mc->timeout) != 1
+				|| getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &el) || err) {
+			close(fd);
+			continue;
+		}
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+		tv.tv_sec = mc->timeout / 1000;
+		tv.tv_usec = (mc->timeout % 1000) * 1000;
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		mc->fd = fd;
+		break;
+	}
+	freeaddrinfo(ai);
+	return mc->fd >= 0 ? 0 : -1;
+}
+
+/**
+ * read the next reply line into 'line' without its CRLF.
+ * @return 0 on success
+ */
+static int oauth_mc_line(oauth_memcached *mc, char *line, size_t size) {
+	for (;;) {
+		char *e = (char*) memchr(mc->rbuf, '\n', mc->rlen);
+		ssize_t r;
+		if (e) {
+			size_t l = e - mc->rbuf;
+			if (l < 1 || mc->rbuf[l-1] != '\r' || l > size) return -1;
+			memcpy(line, mc->rbuf, l-1);
+			line[l-1] = '\0';
+			mc->rlen -= l+1;
+			memmove(mc->rbuf, e+1, mc->rlen);
+			return 0;
+		}
+		if (mc->rlen == sizeof(mc->rbuf)) return -1;
+		r = recv(mc->fd, mc->rbuf + mc->rlen, sizeof(mc->rbuf) - mc->rlen, 0);
+		if (r <= 0) {
+			if (r < 0 && errno == EINTR) continue;
+			return -1;
+		}
+		mc->rlen += r;
+	}
+}
+
+static int oauth_mc_send(oauth_memcached *mc, const char *buf, size_t len) {
+	while (len) {
+		ssize_t w = send(mc->fd, buf, len, MSG_NOSIGNAL);
+		if (w < 0 && errno == EINTR) continue;
+		if (w <= 0) return -1;
+		buf += w;
+		len -= w;
+	}
+	return 0;
+}
+
+/**
+ * record the tuples 'n' with one pipelined round trip, at most
+ * OAUTH_MC_PIPELINE of them.
+ * @return the number of tuples whose reply was read
+ */
+static int oauth_mc_round(oauth_memcached *mc, const oauth_nonce *n, int *res, int cnt, long now) {
+	char *buf = (char*) xmalloc(cnt * OAUTH_MC_LINE), *p = buf;
+	char line[OAUTH_MC_LINE];
+	int i;
+
+	for (i=0; i < cnt; i++) {
+		// keep the key until the timestamp has left the window
+		long ttl = n[i].timestamp + mc->window - now + 1;
+		if (oauth_mc_key(mc, &n[i], p + 4)) break;
+		memcpy(p, "add ", 4);
+		p += 4 + OAUTH_MC_KEYLEN;
+		p += sprintf(p, " 0 %ld 1\r\n1\r\n", ttl < 1 ? 1 : ttl);
+	}
+	if (i < cnt || oauth_mc_send(mc, buf, p - buf)) i = 0;
+	else {
+		for (i=0; i < cnt; i++) {
+			if (oauth_mc_line(mc, line, sizeof(line))) break;
+			if (!strcmp(line, "STORED")) res[i] = OAUTH_REPLAY_FRESH;
+			else if (!strcmp(line, "NOT_STORED") || !strcmp(line, "EXISTS")) res[i] = OAUTH_REPLAY_SEEN;
+			else break;
+		}
+	}
+	xfree(buf);
+	return i;
+}
+
+static int oauth_mc_check(void *data, const oauth_nonce *n, int *res, int cnt, long now) {
+	oauth_memcached *mc = (oauth_memcached*) data;
+	oauth_nonce *todo = (oauth_nonce*) xmalloc(cnt * sizeof(oauth_nonce));
+	int *idx = (int*) xmalloc(cnt * sizeof(int));
+	int *tres = (int*) xmalloc(cnt * sizeof(int));
+	int i, k, done = 0, rv = 0;
+
+	// stale tuples need no round trip
+	for (k=0, i=0; i < cnt; i++) {
+		res[i] = -1;
+		if (!n[i].c_key || !n[i].nonce) continue;
+		if (n[i].timestamp < 0 || n[i].timestamp < now - mc->window || n[i].timestamp > now + mc->window) {
+			res[i] = OAUTH_REPLAY_STALE;
+			continue;
+		}
+		todo[k] = n[i];
+		idx[k++] = i;
+	}
+	if (k && mc->fd < 0 && now >= mc->retry && oauth_mc_connect(mc))
+		mc->retry = now + 1;
+	while (mc->fd >= 0 && done < k) {
+		const int m = k - done < OAUTH_MC_PIPELINE ? k - done : OAUTH_MC_PIPELINE;
+		const int got = oauth_mc_round(mc, todo + done, tres + done, m, now);
+		done += got;
+		if (got < m) oauth_mc_close(mc, now);
+	}
+	// the rest is recorded locally while the server is unreachable
+	if (done < k && mc->fallback)
+		rv = oauth_nonce_store_check(mc->fallback, todo + done, tres + done, k - done, now);
+	else if (done < k) {
+		for (i=done; i < k; i++) tres[i] = -1;
+		rv = -1;
+	}
+	for (i=0; i < k; i++) res[idx[i]] = tres[i];
+	xfree(tres);
+	xfree(idx);
+	xfree(todo);
+	return rv;
+}
+
+static void oauth_mc_release(void *data) {
+	oauth_memcached *mc = (oauth_memcached*) data;
+	if (mc->fd >= 0) close(mc->fd);
+	oauth_nonce_store_free(mc->fallback);
+	oauth_hmac_sha1_free(mc->kh);
+	xfree(mc->host);
+	xfree(mc->port);
+	xfree(mc);
+}
+
+oauth_nonce_store *oauth_nonce_store_memcached (const char *host, const char *port,
+		long window, int timeout_ms, oauth_nonce_store *fallback) {
+	oauth_memcached *mc;
+	oauth_nonce_store *st;
+
+	if (!host || !port || window < 1 || 2*window + 1 > OAUTH_MC_MAXTTL || timeout_ms < 1) return NULL;
+	mc = (oauth_memcached*) xcalloc(1, sizeof(oauth_memcached));
+	mc->host = xstrdup(host);
+	mc->port = xstrdup(port);
+	mc->window = window;
+	mc->timeout = timeout_ms;
+	mc->fd = -1;
+	mc->kh = oauth_hmac_sha1_new("oauth_nonce", 11);
+	mc->fallback = fallback;
+	if (!mc->kh || !(st = oauth_nonce_store_new(oauth_mc_check, oauth_mc_release, mc))) {
+		mc->fallback = NULL;
+		oauth_mc_release(mc);
+		return NULL;
+	}
+	return st;
+}
+
+#else
+
+oauth_nonce_store *oauth_nonce_store_memcached (const char *host, const char *port,
+		long window, int timeout_ms, oauth_nonce_store *fallback) {
+	return NULL;
+}
+
+#endif
@@ -29,9 +29,9 @@
 #define BLOCK_LENGTH 64
 
 typedef struct sha1nfo {
-	uint32_t buffer[BLOCK_LENGTH/4];
+	uint8_t buffer[BLOCK_LENGTH];
 	uint32_t state[HASH_LENGTH/4];
-	uint32_t byteCount;
+	uint64_t byteCount;
 	uint8_t bufferOffset;
 	uint8_t keyBuffer[BLOCK_LENGTH];
 	uint8_t innerHash[HASH_LENGTH];
@@ -79,82 +79,196 @@ uint32_t sha1_rol32(uint32_t number, uint8_t bits) {
 	return ((number << bits) | (number >> (32-bits)));
 }
 
-void sha1_hashBlock(sha1nfo *s) {
-	uint8_t i;
-	uint32_t a,b,c,d,e,t;
-
-	a=s->state[0];
-	b=s->state[1];
-	c=s->state[2];
-	d=s->state[3];
-	e=s->state[4];
-	for (i=0; i<80; i++) {
-		if (i>=16) {
-			t = s->buffer[(i+13)&15] ^ s->buffer[(i+8)&15] ^ s->buffer[(i+2)&15] ^ s->buffer[i&15];
-			s->buffer[i&15] = sha1_rol32(t,1);
-		}
-		if (i<20) {
-			t = (d ^ (b & (c ^ d))) + SHA1_K0;
-		} else if (i<40) {
-			t = (b ^ c ^ d) + SHA1_K20;
-		} else if (i<60) {
-			t = ((b & c) | (d & (b | c))) + SHA1_K40;
-		} else {
-			t = (b ^ c ^ d) + SHA1_K60;
+static uint32_t sha1_load32(const uint8_t *p) {
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16)
+		| ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+}
+
+/* SHA-NI: x86 SHA extensions, selected at run-time */
+#if defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__)) \
+	&& (defined(__x86_64__) || defined(__i386__))
+#define SHA1_SHANI 1
+#include <cpuid.h>
+#include <immintrin.h>
+
+static int sha1_have_shani(void) {
+	static int have = -1; // -1: not probed yet, shared by all threads
+	int rv = __atomic_load_n(&have, __ATOMIC_ACQUIRE);
+	if (rv < 0) {
+		unsigned int a, b, c, d;
+		rv = 0;
+		if (__get_cpuid(1, &a, &b, &c, &d)
+				&& (c & (1 << 9))    // SSSE3
+				&& (c & (1 << 19))   // SSE4.1
+				&& __get_cpuid_max(0, NULL) >= 7) {
+			__cpuid_count(7, 0, a, b, c, d);
+			rv = (b & (1 << 29)) ? 1 : 0; // SHA
 		}
-		t+=sha1_rol32(a,5) + e + s->buffer[i&15];
-		e=d;
-		d=c;
-		c=sha1_rol32(b,30);
-		b=a;
-		a=t;
+		__atomic_store_n(&have, rv, __ATOMIC_RELEASE);
 	}
-	s->state[0] += a;
-	s->state[1] += b;
-	s->state[2] += c;
-	s->state[3] += d;
-	s->state[4] += e;
+	return rv;
 }
 
-void sha1_addUncounted(sha1nfo *s, uint8_t data) {
-	uint8_t * const b = (uint8_t*) s->buffer;
-#ifdef SHA_BIG_ENDIAN
-	b[s->bufferOffset] = data;
-#else
-	b[s->bufferOffset ^ 3] = data;
+/* four rounds; 'g' is the index of the 4-round group (0..19) */
+#define SHA1_NI_GROUP(g, EA, EB, F, MC, MN, M2, MP) \
+	EA = _mm_sha1nexte_epu32(EA, MC); \
+	EB = abcd; \
+	if ((g) >= 3 && (g) <= 18) MN = _mm_sha1msg2_epu32(MN, MC); \
+	abcd = _mm_sha1rnds4_epu32(abcd, EA, F); \
+	if ((g) <= 16) MP = _mm_sha1msg1_epu32(MP, MC); \
+	if ((g) >= 2 && (g) <= 17) M2 = _mm_xor_si128(M2, MC);
+
+__attribute__ ((target ("sha,sse4.1")))
+static void sha1_compress_shani(uint32_t *state, const uint8_t *data, size_t nblocks) {
+	const __m128i bswap = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+	__m128i abcd, abcd0, e0, e00, e1, m0, m1, m2, m3;
+
+	abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) state), 0x1B);
+	e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+	for (; nblocks--; data += BLOCK_LENGTH) {
+		abcd0 = abcd;
+		e00 = e0;
+
+		m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + 0)), bswap);
+		m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + 16)), bswap);
+		m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + 32)), bswap);
+		m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + 48)), bswap);
+
+		// rounds 0-3
+		e0 = _mm_add_epi32(e0, m0);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+		SHA1_NI_GROUP( 1, e1, e0, 0, m1, m2, m3, m0)
+		SHA1_NI_GROUP( 2, e0, e1, 0, m2, m3, m0, m1)
+		SHA1_NI_GROUP( 3, e1, e0, 0, m3, m0, m1, m2)
+		SHA1_NI_GROUP( 4, e0, e1, 0, m0, m1, m2, m3)
+		SHA1_NI_GROUP( 5, e1, e0, 1, m1, m2, m3, m0)
+		SHA1_NI_GROUP( 6, e0, e1, 1, m2, m3, m0, m1)
+		SHA1_NI_GROUP( 7, e1, e0, 1, m3, m0, m1, m2)
+		SHA1_NI_GROUP( 8, e0, e1, 1, m0, m1, m2, m3)
+		SHA1_NI_GROUP( 9, e1, e0, 1, m1, m2, m3, m0)
+		SHA1_NI_GROUP(10, e0, e1, 2, m2, m3, m0, m1)
+		SHA1_NI_GROUP(11, e1, e0, 2, m3, m0, m1, m2)
+		SHA1_NI_GROUP(12, e0, e1, 2, m0, m1, m2, m3)
+		SHA1_NI_GROUP(13, e1, e0, 2, m1, m2, m3, m0)
+		SHA1_NI_GROUP(14, e0, e1, 2, m2, m3, m0, m1)
+		SHA1_NI_GROUP(15, e1, e0, 3, m3, m0, m1, m2)
+		SHA1_NI_GROUP(16, e0, e1, 3, m0, m1, m2, m3)
+		SHA1_NI_GROUP(17, e1, e0, 3, m1, m2, m3, m0)
+		SHA1_NI_GROUP(18, e0, e1, 3, m2, m3, m0, m1)
+		SHA1_NI_GROUP(19, e1, e0, 3, m3, m0, m1, m2)
+
+		e0 = _mm_sha1nexte_epu32(e0, e00);
+		abcd = _mm_add_epi32(abcd, abcd0);
+	}
+
+	_mm_storeu_si128((__m128i*) state, _mm_shuffle_epi32(abcd, 0x1B));
+	state[4] = _mm_extract_epi32(e0, 3);
+}
 #endif
-	s->bufferOffset++;
-	if (s->bufferOffset == BLOCK_LENGTH) {
-		sha1_hashBlock(s);
-		s->bufferOffset = 0;
+
+/* one round; the message word is computed in place for rounds >= 16 */
+#define SHA1_W(i) (w[(i)&15] = sha1_rol32(w[((i)+13)&15] ^ w[((i)+8)&15] ^ w[((i)+2)&15] ^ w[(i)&15], 1))
+#define SHA1_ROUND(F, K, X) do { \
+	t = sha1_rol32(a,5) + (F) + e + (K) + (X); \
+	e = d; d = c; c = sha1_rol32(b,30); b = a; a = t; \
+} while (0)
+
+/**
+ * hash 'nblocks' 64 byte blocks read directly from 'data'.
+ */
+static void sha1_compress(uint32_t *state, const uint8_t *data, size_t nblocks) {
+	uint32_t a,b,c,d,e,t,w[16];
+	int i;
+
+#ifdef SHA1_SHANI
+	if (sha1_have_shani()) {
+		sha1_compress_shani(state, data, nblocks);
+		return;
 	}
+#endif
+	for (; nblocks--; data += BLOCK_LENGTH) {
+		for (i=0; i<16; i++) w[i] = sha1_load32(data + 4*i);
+		a=state[0];
+		b=state[1];
+		c=state[2];
+		d=state[3];
+		e=state[4];
+		for (i=0; i<16; i++) SHA1_ROUND(d ^ (b & (c ^ d)), SHA1_K0, w[i]);
+		for (; i<20; i++) SHA1_ROUND(d ^ (b & (c ^ d)), SHA1_K0, SHA1_W(i));
+		for (; i<40; i++) SHA1_ROUND(b ^ c ^ d, SHA1_K20, SHA1_W(i));
+		for (; i<60; i++) SHA1_ROUND((b & c) | (d & (b | c)), SHA1_K40, SHA1_W(i));
+		for (; i<80; i++) SHA1_ROUND(b ^ c ^ d, SHA1_K60, SHA1_W(i));
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+	}
+}
+
+void sha1_hashBlock(sha1nfo *s) {
+	sha1_compress(s->state, s->buffer, 1);
 }
 
 void sha1_writebyte(sha1nfo *s, uint8_t data) {
 	++s->byteCount;
-	sha1_addUncounted(s, data);
+	s->buffer[s->bufferOffset++] = data;
+	if (s->bufferOffset == BLOCK_LENGTH) {
+		sha1_hashBlock(s);
+		s->bufferOffset = 0;
+	}
 }
 
 void sha1_write(sha1nfo *s, const char *data, size_t len) {
-	for (;len--;) sha1_writebyte(s, (uint8_t) *data++);
+	const uint8_t *p = (const uint8_t*) data;
+	size_t n;
+
+	if (!len) return;
+	s->byteCount += len;
+	// complete a partially filled buffer
+	if (s->bufferOffset) {
+		n = BLOCK_LENGTH - s->bufferOffset;
+		if (n > len) n = len;
+		memcpy(s->buffer + s->bufferOffset, p, n);
+		s->bufferOffset += n;
+		p += n;
+		len -= n;
+		if (s->bufferOffset < BLOCK_LENGTH) return;
+		sha1_hashBlock(s);
+		s->bufferOffset = 0;
+	}
+	// whole blocks straight from the input
+	n = len / BLOCK_LENGTH;
+	if (n) {
+		sha1_compress(s->state, p, n);
+		p += n * BLOCK_LENGTH;
+		len -= n * BLOCK_LENGTH;
+	}
+	memcpy(s->buffer, p, len);
+	s->bufferOffset = len;
 }
 
 void sha1_pad(sha1nfo *s) {
 	// Implement SHA-1 padding (fips180-2 §5.1.1)
+	const uint64_t bits = s->byteCount << 3;
+	int i;
 
 	// Pad with 0x80 followed by 0x00 until the end of the block
-	sha1_addUncounted(s, 0x80);
-	while (s->bufferOffset != 56) sha1_addUncounted(s, 0x00);
-
-	// Append length in the last 8 bytes
-	sha1_addUncounted(s, 0); // We're only using 32 bit lengths
-	sha1_addUncounted(s, 0); // But SHA-1 supports 64 bit lengths
-	sha1_addUncounted(s, 0); // So zero pad the top bits
-	sha1_addUncounted(s, s->byteCount >> 29); // Shifting to multiply by 8
-	sha1_addUncounted(s, s->byteCount >> 21); // as SHA-1 supports bitstreams as well as
-	sha1_addUncounted(s, s->byteCount >> 13); // byte.
-	sha1_addUncounted(s, s->byteCount >> 5);
-	sha1_addUncounted(s, s->byteCount << 3);
+	s->buffer[s->bufferOffset++] = 0x80;
+	if (s->bufferOffset > BLOCK_LENGTH - 8) {
+		memset(s->buffer + s->bufferOffset, 0, BLOCK_LENGTH - s->bufferOffset);
+		sha1_hashBlock(s);
+		s->bufferOffset = 0;
+	}
+	memset(s->buffer + s->bufferOffset, 0, BLOCK_LENGTH - 8 - s->bufferOffset);
+
+	// Append the 64 bit length in bits, big-endian
+	for (i=0; i<8; i++) s->buffer[BLOCK_LENGTH - 1 - i] = (uint8_t) (bits >> (8*i));
+	sha1_hashBlock(s);
+	s->bufferOffset = 0;
 }
 
 uint8_t* sha1_result(sha1nfo *s) {
@@ -180,13 +294,23 @@ uint8_t* sha1_result(sha1nfo *s) {
 #define HMAC_IPAD 0x36
 #define HMAC_OPAD 0x5c
 
-void sha1_initHmac(sha1nfo *s, const uint8_t* key, int keyLength) {
+/**
+ * hash the key block xor'ed with 'pad'.
+ */
+static void sha1_writeKeyPad(sha1nfo *s, const uint8_t *key, uint8_t pad) {
+	uint8_t b[BLOCK_LENGTH];
 	uint8_t i;
+	for (i=0; i<BLOCK_LENGTH; i++) b[i] = key[i] ^ pad;
+	sha1_write(s, (const char*) b, BLOCK_LENGTH);
+	memset(b, 0, BLOCK_LENGTH);
+}
+
+void sha1_initHmac(sha1nfo *s, const uint8_t* key, int keyLength) {
 	memset(s->keyBuffer, 0, BLOCK_LENGTH);
 	if (keyLength > BLOCK_LENGTH) {
 		// Hash long keys
 		sha1_init(s);
-		for (;keyLength--;) sha1_writebyte(s, *key++);
+		sha1_write(s, (const char*) key, keyLength);
 		memcpy(s->keyBuffer, sha1_result(s), HASH_LENGTH);
 	} else {
 		// Block length keys are used as is
@@ -194,19 +318,16 @@ void sha1_initHmac(sha1nfo *s, const uint8_t* key, int keyLength) {
 	}
 	// Start inner hash
 	sha1_init(s);
-	for (i=0; i<BLOCK_LENGTH; i++) {
-		sha1_writebyte(s, s->keyBuffer[i] ^ HMAC_IPAD);
-	}
+	sha1_writeKeyPad(s, s->keyBuffer, HMAC_IPAD);
 }
 
 uint8_t* sha1_resultHmac(sha1nfo *s) {
-	uint8_t i;
 	// Complete inner hash
 	memcpy(s->innerHash,sha1_result(s),HASH_LENGTH);
 	// Calculate outer hash
 	sha1_init(s);
-	for (i=0; i<BLOCK_LENGTH; i++) sha1_writebyte(s, s->keyBuffer[i] ^ HMAC_OPAD);
-	for (i=0; i<HASH_LENGTH; i++) sha1_writebyte(s, s->innerHash[i]);
+	sha1_writeKeyPad(s, s->keyBuffer, HMAC_OPAD);
+	sha1_write(s, (const char*) s->innerHash, HASH_LENGTH);
 	return sha1_result(s);
 }
 
@@ -0,0 +1,302 @@
+/* sha1mb.c -- multi-buffer SHA-1 / HMAC-SHA1
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+/*
+ * An HMAC of a short signature base string is only a few SHA-1 blocks,
+ * so a single hash is bound by the latency of the 80 dependent rounds.
+ * This engine runs independent messages side by side, one per 32 bit
+ * SIMD lane: 4 lanes with SSE2, 8 with AVX2 and 16 with AVX-512. The
+ * widest kernel the CPU supports is selected at run-time; other
+ * platforms use the portable one-lane kernel.
+ *
+ * All kernels are generated from the same round code using GCC vector
+ * extensions. The state and message words are kept transposed, ie.
+ * word 'i' of lane 'j' is stored at [i*lanes + j].
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#define WIPE_MEMORY ///< overwrite intermediate hash state and key material.
+
+#include <string.h>
+#include "sha1mb.h"
+
+#if defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__)) \
+	&& (defined(__x86_64__) || defined(__i386__))
+# define SHA1MB_X86 1
+#endif
+
+#define SHA1MB_MAXLANES 16
+
+#define SHA1MB_ROL(x,n) (((x) << (n)) | ((x) >> (32-(n))))
+#define SHA1MB_F1(b,c,d) ((d) ^ ((b) & ((c) ^ (d))))
+#define SHA1MB_F2(b,c,d) ((b) ^ (c) ^ (d))
+#define SHA1MB_F3(b,c,d) (((b) & (c)) | ((d) & ((b) | (c))))
+#define SHA1MB_W(i) (w[(i)&15] = SHA1MB_ROL(w[((i)+13)&15] ^ w[((i)+8)&15] ^ w[((i)+2)&15] ^ w[(i)&15], 1))
+#define SHA1MB_STEP(F,K,X) do { \
+	t = SHA1MB_ROL(a,5) + F(b,c,d) + e + (K) + (X); \
+	e = d; d = c; c = SHA1MB_ROL(b,30); b = a; a = t; \
+} while (0)
+
+/* compress one block in every lane; 'V' is the lane vector type */
+#define SHA1MB_BLOCK(V) { \
+	const int L = sizeof(V) / sizeof(uint32_t); \
+	V a, b, c, d, e, t, w[16], s[5]; \
+	int i; \
+	for (i=0; i<5; i++) memcpy(&s[i], st + i*L, sizeof(V)); \
+	for (i=0; i<16; i++) memcpy(&w[i], blk + i*L, sizeof(V)); \
+	a = s[0]; b = s[1]; c = s[2]; d = s[3]; e = s[4]; \
+	for (i=0; i<16; i++) SHA1MB_STEP(SHA1MB_F1, 0x5a827999u, w[i]); \
+	for (; i<20; i++) SHA1MB_STEP(SHA1MB_F1, 0x5a827999u, SHA1MB_W(i)); \
+	for (; i<40; i++) SHA1MB_STEP(SHA1MB_F2, 0x6ed9eba1u, SHA1MB_W(i)); \
+	for (; i<60; i++) SHA1MB_STEP(SHA1MB_F3, 0x8f1bbcdcu, SHA1MB_W(i)); \
+	for (; i<80; i++) SHA1MB_STEP(SHA1MB_F2, 0xca62c1d6u, SHA1MB_W(i)); \
+	s[0] += a; s[1] += b; s[2] += c; s[3] += d; s[4] += e; \
+	for (i=0; i<5; i++) memcpy(st + i*L, &s[i], sizeof(V)); \
+}
+
+typedef void (*sha1mb_fn)(uint32_t *st, const uint32_t *blk);
+
+static void sha1mb_x1(uint32_t *st, const uint32_t *blk) SHA1MB_BLOCK(uint32_t)
+
+#ifdef SHA1MB_X86
+typedef uint32_t sha1mb_v4 __attribute__ ((vector_size (16)));
+typedef uint32_t sha1mb_v8 __attribute__ ((vector_size (32)));
+typedef uint32_t sha1mb_v16 __attribute__ ((vector_size (64)));
+
+__attribute__ ((target ("sse2")))
+static void sha1mb_x4(uint32_t *st, const uint32_t *blk) SHA1MB_BLOCK(sha1mb_v4)
+
+__attribute__ ((target ("avx2")))
+static void sha1mb_x8(uint32_t *st, const uint32_t *blk) SHA1MB_BLOCK(sha1mb_v8)
+
+__attribute__ ((target ("avx512f")))
+static void sha1mb_x16(uint32_t *st, const uint32_t *blk) SHA1MB_BLOCK(sha1mb_v16)
+#endif
+
+typedef struct {
+	sha1mb_fn fn;
+	int lanes;
+} sha1mb_impl;
+
+static const sha1mb_impl sha1mb_impls[] = {
+	{ sha1mb_x1, 1 },
+#ifdef SHA1MB_X86
+	{ sha1mb_x4, 4 },
+	{ sha1mb_x8, 8 },
+	{ sha1mb_x16, 16 },
+#endif
+};
+
+static const sha1mb_impl *sha1mb_sel = NULL; ///< selected kernel, NULL: not yet selected
+
+int sha1mb_select(int max) {
+	const sha1mb_impl *impl = &sha1mb_impls[0];
+#ifdef SHA1MB_X86
+	__builtin_cpu_init();
+	if (max >= 16 && __builtin_cpu_supports("avx512f")) impl = &sha1mb_impls[3];
+	else if (max >= 8 && __builtin_cpu_supports("avx2")) impl = &sha1mb_impls[2];
+	else if (max >= 4 && __builtin_cpu_supports("sse2")) impl = &sha1mb_impls[1];
+#endif
+	__atomic_store_n(&sha1mb_sel, impl, __ATOMIC_RELEASE);
+	return impl->lanes;
+}
+
+/**
+ * the selected kernel, selecting the widest one on first use.
+ */
+static const sha1mb_impl *sha1mb_impl_get(void) {
+	const sha1mb_impl *impl = __atomic_load_n(&sha1mb_sel, __ATOMIC_ACQUIRE);
+	if (!impl) {
+		sha1mb_select(SHA1MB_MAXLANES);
+		impl = __atomic_load_n(&sha1mb_sel, __ATOMIC_ACQUIRE);
+	}
+	return impl;
+}
+
+int sha1mb_lanes(void) {
+	return sha1mb_impl_get()->lanes;
+}
+
+static uint32_t sha1mb_be32(const unsigned char *p) {
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16)
+		| ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+}
+
+static void sha1mb_put32(unsigned char *p, uint32_t v) {
+	p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+/**
+ * build the padded final block(s) of a message into 'tail' (128 bytes).
+ *
+ * @param prefix number of bytes hashed before the message
+ * @return number of tail blocks (1 or 2)
+ */
+static int sha1mb_tail(unsigned char *tail, const unsigned char *m, size_t ml, uint64_t prefix) {
+	size_t rem = ml % 64;
+	uint64_t bits = (prefix + ml) * 8;
+	int nb = rem + 9 <= 64 ? 1 : 2, i;
+	memcpy(tail, m + ml - rem, rem);
+	tail[rem] = 0x80;
+	memset(tail + rem + 1, 0, nb*64 - rem - 1);
+	for (i=0; i<8; i++) tail[nb*64 - 1 - i] = (unsigned char) (bits >> (8*i));
+	return nb;
+}
+
+static const uint32_t sha1mb_iv[5] = {
+	0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+};
+
+/**
+ * hash one message on the one-lane kernel, starting at state 'st'.
+ */
+static void sha1mb_hash1(uint32_t *st, const unsigned char *m, size_t ml, uint64_t prefix) {
+	unsigned char tail[128];
+	uint32_t w[16];
+	size_t k, full = ml / 64;
+	int nb, i;
+	for (k=0; k < full; k++) {
+		for (i=0; i<16; i++) w[i] = sha1mb_be32(m + 64*k + 4*i);
+		sha1mb_x1(st, w);
+	}
+	nb = sha1mb_tail(tail, m, ml, prefix);
+	for (k=0; k < (size_t) nb; k++) {
+		for (i=0; i<16; i++) w[i] = sha1mb_be32(tail + 64*k + 4*i);
+		sha1mb_x1(st, w);
+	}
+#ifdef WIPE_MEMORY
+	memset(tail, 0, sizeof(tail));
+	memset(w, 0, sizeof(w));
+#endif
+}
+
+void sha1mb_hmac_init(uint32_t *inner, uint32_t *outer, const unsigned char *k, size_t kl) {
+	unsigned char kb[64];
+	uint32_t w[16];
+	int i;
+
+	memset(kb, 0, sizeof(kb));
+	if (kl > 64) {
+		uint32_t st[5];
+		memcpy(st, sha1mb_iv, sizeof(st));
+		sha1mb_hash1(st, k, kl, 0);
+		for (i=0; i<5; i++) sha1mb_put32(kb + 4*i, st[i]);
+	} else {
+		memcpy(kb, k, kl);
+	}
+
+	for (i=0; i<16; i++) w[i] = sha1mb_be32(kb + 4*i) ^ 0x36363636;
+	memcpy(inner, sha1mb_iv, 5 * sizeof(uint32_t));
+	sha1mb_x1(inner, w);
+	for (i=0; i<16; i++) w[i] = sha1mb_be32(kb + 4*i) ^ 0x5c5c5c5c;
+	memcpy(outer, sha1mb_iv, 5 * sizeof(uint32_t));
+	sha1mb_x1(outer, w);
+
+	memset(kb, 0, sizeof(kb));
+	memset(w, 0, sizeof(w));
+}
+
+/**
+ * HMAC of up to 'L' messages on the 'L' lane kernel 'fn'.
+ */
+static void sha1mb_group(sha1mb_fn fn, const int L, const int g,
+		const uint32_t * const *inner, const uint32_t * const *outer,
+		const unsigned char * const *m, const size_t *ml,
+		unsigned char *digest) {
+	static const unsigned char zero[64];
+	unsigned char tail[SHA1MB_MAXLANES][128];
+	uint32_t st[5*SHA1MB_MAXLANES], sv[5*SHA1MB_MAXLANES], w[16*SHA1MB_MAXLANES];
+	size_t full[SHA1MB_MAXLANES], nb[SHA1MB_MAXLANES], maxnb = 0, k;
+	int i, j;
+
+	for (j=0; j < L; j++) {
+		if (j < g) {
+			full[j] = ml[j] / 64;
+			nb[j] = full[j] + sha1mb_tail(tail[j], m[j], ml[j], 64);
+			if (nb[j] > maxnb) maxnb = nb[j];
+			for (i=0; i<5; i++) st[i*L + j] = inner[j][i];
+		} else {
+			// unused lane
+			full[j] = nb[j] = 0;
+			for (i=0; i<5; i++) st[i*L + j] = 0;
+		}
+	}
+
+	// inner hash; lanes that are done hash a dummy block and keep their state
+	for (k=0; k < maxnb; k++) {
+		int done = 0;
+		for (j=0; j < L; j++) {
+			const unsigned char *p;
+			if (k < full[j]) p = m[j] + 64*k;
+			else if (k < nb[j]) p = tail[j] + 64*(k - full[j]);
+			else { p = zero; done = 1; }
+			for (i=0; i<16; i++) w[i*L + j] = sha1mb_be32(p + 4*i);
+		}
+		if (done) memcpy(sv, st, 5 * L * sizeof(uint32_t));
+		fn(st, w);
+		if (done) {
+			for (j=0; j < L; j++) {
+				if (k < nb[j]) continue;
+				for (i=0; i<5; i++) st[i*L + j] = sv[i*L + j];
+			}
+		}
+	}
+
+	// outer hash: the 20 byte inner digest is a single padded block
+	for (j=0; j < L; j++) {
+		for (i=0; i<5; i++) w[i*L + j] = st[i*L + j];
+		w[5*L + j] = 0x80000000;
+		for (i=6; i<15; i++) w[i*L + j] = 0;
+		w[15*L + j] = (64 + 20) * 8;
+		for (i=0; i<5; i++) st[i*L + j] = j < g ? outer[j][i] : 0;
+	}
+	fn(st, w);
+
+	for (j=0; j < g; j++)
+		for (i=0; i<5; i++) sha1mb_put32(digest + 20*j + 4*i, st[i*L + j]);
+
+#ifdef WIPE_MEMORY
+	memset(st, 0, sizeof(st));
+	memset(sv, 0, sizeof(sv));
+	memset(w, 0, sizeof(w));
+	memset(tail, 0, sizeof(tail));
+#endif
+}
+
+void sha1mb_hmac(const uint32_t * const *inner, const uint32_t * const *outer,
+		const unsigned char * const *m, const size_t *ml,
+		unsigned char *digest, int n) {
+	const sha1mb_impl *impl = sha1mb_impl_get();
+	int i;
+	for (i=0; i < n; i += impl->lanes) {
+		int g = n - i < impl->lanes ? n - i : impl->lanes;
+		if (g == 1) {
+			// a single message does not need the wide kernel
+			sha1mb_group(sha1mb_x1, 1, 1, inner+i, outer+i, m+i, ml+i, digest + 20*i);
+		} else {
+			sha1mb_group(impl->fn, impl->lanes, g, inner+i, outer+i, m+i, ml+i, digest + 20*i);
+		}
+	}
+}
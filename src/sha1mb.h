@@ -0,0 +1,51 @@
+/*
+ * multi-buffer SHA-1 - internal interface, not exported.
+ *
+ * Computes independent HMAC-SHA1 digests in parallel SIMD lanes.
+ * The key midstates are plain host order SHA-1 state words, so they
+ * can be used with any of the hash backends.
+ */
+#ifndef _OAUTH_SHA1MB_H
+#define _OAUTH_SHA1MB_H      1
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * compute the HMAC-SHA1 midstates for the given key.
+ *
+ * @param inner receives the state after absorbing key ^ ipad
+ * @param outer receives the state after absorbing key ^ opad
+ * @param k the key
+ * @param kl length of the key
+ */
+void sha1mb_hmac_init(uint32_t *inner, uint32_t *outer, const unsigned char *k, size_t kl);
+
+/**
+ * compute 'n' HMAC-SHA1 digests in parallel.
+ *
+ * @param inner array of 'n' inner midstates (see \ref sha1mb_hmac_init)
+ * @param outer array of 'n' outer midstates
+ * @param m array of 'n' messages
+ * @param ml array of 'n' message lengths
+ * @param digest output, n * 20 bytes
+ * @param n number of digests
+ */
+void sha1mb_hmac(const uint32_t * const *inner, const uint32_t * const *outer,
+		const unsigned char * const *m, const size_t *ml,
+		unsigned char *digest, int n);
+
+/**
+ * number of lanes of the engine selected for this CPU.
+ */
+int sha1mb_lanes(void);
+
+/**
+ * limit the engine to at most 'max' lanes (1, 4, 8 or 16), see
+ * \ref oauth_hmac_sha1_select_lanes.
+ *
+ * @return the number of lanes in use
+ */
+int sha1mb_select(int max);
+
+#endif
@@ -43,7 +43,14 @@ extern int loglevel; //< report each successful test
 int test_encoding(char *param, char *expected) {
   int rv=0;
   char *testcase=NULL;
+  char buf[256];
   testcase = oauth_url_escape(param);
+  if (oauth_url_escape_into(param, strlen(param), NULL, 0) != strlen(expected)
+      || oauth_url_escape_into(param, strlen(param), buf, sizeof(buf)) != strlen(expected)
+      || strcmp(buf, expected)) {
+    rv=1;
+    printf("buffer encoding test for '%s' failed.\n", param);
+  }
   if (strcmp(testcase,expected)) {
     rv=1;
     printf("parameter encoding test for '%s' failed.\n"
@@ -54,6 +61,44 @@ int test_encoding(char *param, char *expected) {
   return (rv);
 }
 
+/*
+ * test base64 encoding and decoding into caller supplied buffers
+ */
+int test_base64(char *plain, char *expected) {
+  int rv=0, i;
+  size_t len = strlen(plain);
+  char enc[128];
+  unsigned char dec[128], data[300];
+
+  if (oauth_encode_base64_into((unsigned char*) plain, len, NULL, 0) != strlen(expected)
+      || oauth_encode_base64_into((unsigned char*) plain, len, enc, sizeof(enc)) != strlen(expected)
+      || strcmp(enc, expected)) {
+    rv=1;
+    printf("base64 encoding test for '%s' failed.\n", plain);
+  }
+  if (oauth_decode_base64_into(expected, strlen(expected), dec, sizeof(dec), OAUTH_B64_STRICT) != (int) len
+      || memcmp(dec, plain, len)
+      || oauth_decode_base64_into(expected, strlen(expected), dec, len ? len - 1 : 0, OAUTH_B64_STRICT) != (len ? -1 : 0)) {
+    rv=1;
+    printf("base64 decoding test for '%s' failed.\n", expected);
+  }
+
+  // round trip, long enough for the vectorized code paths
+  for (i=0; i < (int) sizeof(data); i++) data[i] = (i * 131 + len) & 0xff;
+  for (i=0; i <= (int) sizeof(data) && !rv; i+=7) {
+    char b64[401];
+    unsigned char out[300];
+    size_t n = oauth_encode_base64_into(data, i, b64, sizeof(b64));
+    if (oauth_decode_base64_into(b64, n, out, i, OAUTH_B64_STRICT) != i || memcmp(out, data, i)
+        || oauth_decode_base64_into(b64, n, out, i, 0) != i || memcmp(out, data, i)) {
+      rv=1;
+      printf("base64 round trip failed for %d bytes.\n", i);
+    }
+  }
+  if (!rv && loglevel) printf("base64 ok. ('%s')\n", expected);
+  return (rv);
+}
+
 #ifdef TEST_UNICODE
 /*
  * test unicode paramter encoding
@@ -151,6 +196,83 @@ int test_sha1(char *c_secret, char *t_secret, char *base, char *expected) {
   } else if (loglevel) printf("HMAC-SHA1 test sucessful.\n");
   free(b64d);
   free(okey);
+
+  // same key, precomputed signer context - used twice.
+  oauth_signer *s = oauth_signer_new(OA_HMAC, "ck", c_secret, "tk", t_secret);
+  int i;
+  for (i=0; s && i<2; i++) {
+    b64d = oauth_signer_sign(s, base, strlen(base));
+    if (!b64d || strcmp(b64d,expected)) {
+      printf("HMAC-SHA1 signer invalid. base:'%s'\n"
+             " got: '%s' expected: '%s'\n", base, b64d?b64d:"(null)", expected);
+      rv=1;
+    }
+    if (b64d) free(b64d);
+  }
+  if (!s) rv=1;
+  oauth_signer_free(s);
+
+  // multi-buffer: the same message in every lane plus one
+  okey = oauth_catenc(2, c_secret, t_secret);
+  oauth_hmac_sha1 *h = oauth_hmac_sha1_new(okey, strlen(okey));
+  int n = oauth_hmac_sha1_lanes() + 1;
+  const oauth_hmac_sha1 **hv = (const oauth_hmac_sha1**) calloc(n, sizeof(oauth_hmac_sha1*));
+  const char **mv = (const char**) calloc(n, sizeof(char*));
+  size_t *lv = (size_t*) calloc(n, sizeof(size_t));
+  unsigned char *digest = (unsigned char*) calloc(n, 20);
+  for (i=0; i<n; i++) { hv[i] = h; mv[i] = base; lv[i] = strlen(base); }
+  if (oauth_hmac_sha1_digest_multi(hv, mv, lv, digest, n) != n) rv=1;
+  for (i=0; i<n; i++) {
+    b64d = oauth_encode_base64(20, digest + 20*i);
+    if (strcmp(b64d, expected)) {
+      printf("HMAC-SHA1 multi-buffer lane %d invalid.\n"
+             " got: '%s' expected: '%s'\n", i, b64d, expected);
+      rv=1;
+    }
+    free(b64d);
+  }
+  free(hv); free(mv); free(lv); free(digest);
+  oauth_hmac_sha1_free(h);
+  free(okey);
+  return (rv);
+}
+
+/*
+ * multi-buffer HMAC-SHA1 with a different key and message length in
+ * every lane, compared to single digests for each engine width.
+ */
+int test_sha1_multi(void) {
+  static const size_t lens[] = { 0, 55, 56, 63, 64, 65, 119, 120, 128, 129, 200, 1, 64, 300, 56, 0, 63, 65, 131 };
+  enum { N = sizeof(lens) / sizeof(lens[0]) };
+  oauth_hmac_sha1 *h[N];
+  const char *mv[N];
+  static const int widths[] = { 1, 4, 8, 16 };
+  char msg[N][300], key[7*N + 1];
+  unsigned char digest[20*N], single[20];
+  int rv=0, i, j, w;
+
+  for (i=0; i<N; i++) {
+    // keys of different lengths, some longer than a block
+    for (j=0; j < 7*i + 1; j++) key[j] = (char) ('a' + (i + j) % 26);
+    h[i] = oauth_hmac_sha1_new(key, 7*i + 1);
+    for (j=0; j < (int) lens[i]; j++) msg[i][j] = (char) (i * 31 + j);
+    mv[i] = msg[i];
+  }
+  for (w=0; w < 4; w++) {
+    oauth_hmac_sha1_select_lanes(widths[w]);
+    // N is more than 16: full groups and a remainder
+    if (oauth_hmac_sha1_digest_multi((const oauth_hmac_sha1 * const *) h, mv, lens, digest, N) != N) rv=1;
+    for (i=0; i<N; i++) {
+      oauth_hmac_sha1_digest(h[i], mv[i], lens[i], single);
+      if (memcmp(single, digest + 20*i, 20)) {
+        printf("HMAC-SHA1 multi-buffer (%d lanes) lane %d of length %d invalid.\n",
+            oauth_hmac_sha1_lanes(), i, (int) lens[i]);
+        rv=1;
+      }
+    }
+  }
+  oauth_hmac_sha1_select_lanes(16);
+  for (i=0; i<N; i++) oauth_hmac_sha1_free(h[i]);
   return (rv);
 }
 
@@ -173,5 +295,38 @@ int test_sign_get(
   }
   else if (loglevel) printf("PLAINTEXT signature ok.\n");
   if(geturl) free(geturl);
+
+  // caller-buffer variant: probe for the size, then sign into the buffer
+  char buf[512];
+  size_t len = oauth_sign_url2_into(url, OA_OUT_URL, method, NULL,
+      c_key, c_secret, t_key, t_secret, NULL, 0);
+  if (len == 0 || len >= sizeof(buf)
+      || oauth_sign_url2_into(url, OA_OUT_URL, method, NULL,
+          c_key, c_secret, t_key, t_secret, buf, sizeof(buf)) != strlen(expected)
+      || strcmp(buf, expected)) {
+    printf("test_sign_get failed (oauth_sign_url2_into):\n"
+           " got:      '%s'\n expected: '%s'\n", len ? buf : "", expected);
+    rv|=1;
+  }
+  else if (loglevel) printf("PLAINTEXT signature into buffer ok.\n");
+
+  // batch: the same request twice shares one signer
+  oauth_batch_request req[2];
+  memset(req, 0, sizeof(req));
+  req[0].url = req[1].url = url;
+  req[0].method = req[1].method = method;
+  req[0].c_key = req[1].c_key = c_key;
+  req[0].c_secret = req[1].c_secret = c_secret;
+  req[0].t_key = req[1].t_key = t_key;
+  req[0].t_secret = req[1].t_secret = t_secret;
+  char *batch = oauth_sign_batch(req, 2);
+  if (!batch || !req[0].result || !req[1].result
+      || strcmp(req[0].result, expected) || strcmp(req[1].result, expected)) {
+    printf("test_sign_get failed (oauth_sign_batch):\n"
+           " got:      '%s'\n expected: '%s'\n", req[0].result ? req[0].result : "", expected);
+    rv|=1;
+  }
+  else if (loglevel) printf("PLAINTEXT batch signature ok.\n");
+  if (batch) free(batch);
   return (rv);
 }
@@ -0,0 +1,527 @@
+/**
+ *  @brief micro-benchmark for liboauth signing functions
+ *  @file oauthbench.c
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <oauth.h>
+
+/* 
+ * usage: oauthbench [requests per batch] [rounds]
+ *
+ * signs the same set of requests with the single-call API and with
+ * oauth_sign_batch() and reports the time per request.
+ */
+
+#define NUSERS 4 ///< number of distinct credential pairs in a batch
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* 
+ * HMAC-SHA1 of 'n' base-string sized messages, one at a time and
+ * with the multi-buffer engine.
+ */
+static void bench_hmac(int n, int rounds) {
+  oauth_hmac_sha1 *h = oauth_hmac_sha1_new("consumer%20secret&secret0", 25);
+  const oauth_hmac_sha1 **hv = (const oauth_hmac_sha1**) malloc(n * sizeof(oauth_hmac_sha1*));
+  const char **mv = (const char**) malloc(n * sizeof(char*));
+  size_t *lv = (size_t*) malloc(n * sizeof(size_t));
+  unsigned char *digest = (unsigned char*) malloc(n * 20);
+  char msg[200];
+  double t0, t1, t2;
+  int i, r;
+
+  memset(msg, 'x', sizeof(msg));
+  for (i=0; i < n; i++) { hv[i] = h; mv[i] = msg; lv[i] = 150 + i % 50; }
+
+  t0 = now();
+  for (r=0; r < rounds; r++)
+    for (i=0; i < n; i++) oauth_hmac_sha1_digest(h, mv[i], lv[i], digest + 20*i);
+  t1 = now();
+  for (r=0; r < rounds; r++)
+    oauth_hmac_sha1_digest_multi(hv, mv, lv, digest, n);
+  t2 = now();
+
+  printf("HMAC-SHA1 of 150-200 bytes, %d lanes\n", oauth_hmac_sha1_lanes());
+  printf("oauth_hmac_sha1_digest:       %8.3f us/message\n", (t1 - t0) * 1e6 / ((double) n * rounds));
+  printf("oauth_hmac_sha1_digest_multi: %8.3f us/message\n", (t2 - t1) * 1e6 / ((double) n * rounds));
+
+  free(hv); free(mv); free(lv); free(digest);
+  oauth_hmac_sha1_free(h);
+}
+
+/*
+ * polling one endpoint: the same request with a new nonce and
+ * timestamp, signed from scratch and from a request template.
+ */
+static void bench_template(int n, int rounds) {
+  const char *url = "http://api.example.com/1.1/statuses/home_timeline.json"
+    "?count=200&include_entities=true&trim_user=false&exclude_replies=true"
+    "&since_id=1234567890123456&max_id=9876543210987654";
+  oauth_signer *s = oauth_signer_new(OA_HMAC, "consumer", "consumer secret", "token0", "secret0");
+  oauth_request_template *t = oauth_request_template_new(s, url, OA_OUT_HEADER, NULL);
+  char buf[1024];
+  double t0, t1, t2;
+  int i, r;
+
+  t0 = now();
+  for (r=0; r < rounds; r++)
+    for (i=0; i < n; i++) oauth_signer_sign_url_into(s, url, OA_OUT_HEADER, NULL, buf, sizeof(buf));
+  t1 = now();
+  for (r=0; r < rounds; r++)
+    for (i=0; i < n; i++) oauth_request_template_sign_into(t, buf, sizeof(buf));
+  t2 = now();
+
+  printf("polling one endpoint, header output\n");
+  printf("oauth_signer_sign_url_into:       %8.3f us/request\n", (t1 - t0) * 1e6 / ((double) n * rounds));
+  printf("oauth_request_template_sign_into: %8.3f us/request\n", (t2 - t1) * 1e6 / ((double) n * rounds));
+
+  oauth_request_template_free(t);
+  oauth_signer_free(s);
+}
+
+/*
+ * one request signed for 'n' token holders, one at a time and fanned out.
+ */
+static void bench_fanout(int n, int rounds) {
+  const char *url = "http://api.example.com/1.1/statuses/update.json"
+    "?status=Hello%20Ladies%20%2B%20Gentlemen%2C%20a%20signed%20OAuth%20request%21"
+    "&include_entities=true";
+  oauth_fanout_token *tk = (oauth_fanout_token*) calloc(n, sizeof(oauth_fanout_token));
+  char (*keys)[32] = malloc(n * sizeof(*keys));
+  char buf[1024];
+  double t0, t1, t2;
+  int i, r;
+
+  for (i=0; i < n; i++) {
+    snprintf(keys[i], sizeof(keys[i]), "%d-token", 1000000 + i);
+    tk[i].t_key = keys[i];
+    tk[i].t_secret = "token secret";
+  }
+
+  t0 = now();
+  for (r=0; r < rounds; r++)
+    for (i=0; i < n; i++)
+      oauth_sign_url2_into(url, OA_OUT_HEADER, OA_HMAC, "POST", "consumer", "consumer secret",
+          tk[i].t_key, tk[i].t_secret, buf, sizeof(buf));
+  t1 = now();
+  for (r=0; r < rounds; r++)
+    free(oauth_sign_fanout(url, OA_OUT_HEADER, OA_HMAC, "POST", "consumer", "consumer secret", tk, n));
+  t2 = now();
+
+  printf("one request for %d token holders, header output\n", n);
+  printf("oauth_sign_url2_into: %8.3f us/token\n", (t1 - t0) * 1e6 / ((double) n * rounds));
+  printf("oauth_sign_fanout:    %8.3f us/token\n", (t2 - t1) * 1e6 / ((double) n * rounds));
+
+  free(keys);
+  free(tk);
+}
+
+/*
+ * Authorization headers, built from the signed argument array as in
+ * oauthtest2.c and written directly.
+ */
+static void bench_header(int n, int rounds) {
+  const char *url = "http://api.example.com/1.1/statuses/update.json"
+    "?status=Hello%20Ladies%20%2B%20Gentlemen&include_entities=true&trim_user=1";
+  oauth_signer *s = oauth_signer_new(OA_HMAC, "consumer", "consumer secret", "token0", "secret0");
+  char buf[1024];
+  double t0, t1, t2;
+  int i, r;
+
+  t0 = now();
+  for (r=0; r < rounds; r++) {
+    for (i=0; i < n; i++) {
+      int argc;
+      char **argv = NULL;
+      char *hdr;
+      argc = oauth_split_url_parameters(url, &argv);
+      oauth_sign_array2_process(&argc, &argv, NULL, OA_HMAC, "POST",
+          "consumer", "consumer secret", "token0", "secret0");
+      hdr = oauth_serialize_url_sep(argc, 1, argv, ", ", 6);
+      snprintf(buf, sizeof(buf), "Authorization: OAuth realm=\"api\", %s", hdr);
+      free(hdr);
+      oauth_free_array(&argc, &argv);
+    }
+  }
+  t1 = now();
+  for (r=0; r < rounds; r++)
+    for (i=0; i < n; i++)
+      oauth_signer_sign_header_into(s, url, "POST", "api", OAUTH_HEADER_NAME, buf, sizeof(buf));
+  t2 = now();
+
+  printf("Authorization header with realm\n");
+  printf("oauth_sign_array2_process + serialize: %8.3f us/request\n", (t1 - t0) * 1e6 / ((double) n * rounds));
+  printf("oauth_signer_sign_header_into:         %8.3f us/request\n", (t2 - t1) * 1e6 / ((double) n * rounds));
+
+  oauth_signer_free(s);
+}
+
+/*
+ * a large form body, written to one buffer and described as segments.
+ */
+static void bench_iov(int n, int rounds) {
+  const char *url = "http://api.example.com/upload";
+  oauth_signer *s = oauth_signer_new(OA_HMAC, "consumer", "consumer secret", "token0", "secret0");
+  size_t bodylen = 0, size = 64 * 1024;
+  char *body = (char*) malloc(size), *full = (char*) malloc(size + 64), *buf = (char*) malloc(size + 1024);
+  oauth_iovec iov[16];
+  double t0, t1, t2;
+  int i, r, cnt;
+
+  for (i=0; i < 1000; i++)
+    bodylen += snprintf(body + bodylen, size - bodylen, "%sfield%d=value-%d.%%2Fx", i ? "&" : "", i, i);
+  snprintf(full, size + 64, "%s?%s", url, body);
+  n = n > 16 ? n / 16 : 1; // the requests are large
+
+  t0 = now();
+  for (r=0; r < rounds; r++)
+    for (i=0; i < n; i++) oauth_signer_sign_url_into(s, full, OA_OUT_POSTARGS, NULL, buf, size + 1024);
+  t1 = now();
+  for (r=0; r < rounds; r++) {
+    for (i=0; i < n; i++) {
+      cnt = 16;
+      oauth_signer_sign_iov(s, url, body, bodylen, OA_OUT_POSTARGS, NULL, iov, &cnt, buf, 1024);
+    }
+  }
+  t2 = now();
+
+  printf("form body of %lu bytes, 1000 parameters\n", (unsigned long) bodylen);
+  printf("oauth_signer_sign_url_into: %8.3f us/request\n", (t1 - t0) * 1e6 / ((double) n * rounds));
+  printf("oauth_signer_sign_iov:      %8.3f us/request (%d segments)\n", (t2 - t1) * 1e6 / ((double) n * rounds), cnt);
+
+  free(buf);
+  free(full);
+  free(body);
+  oauth_signer_free(s);
+}
+
+/*
+ * checking a signed request on the server: rebuilding the signature
+ * with oauth_sign_array2_process as the request's parameters were
+ * signed, and oauth_verify_request on the Authorization header.
+ */
+static void bench_verify(int n, int rounds) {
+  const char *url = "http://api.example.com/1.1/statuses/update.json"
+    "?status=Hello%20Ladies%20%2B%20Gentlemen&include_entities=true&trim_user=1";
+  oauth_signer *s = oauth_signer_new(OA_HMAC, "consumer", "consumer secret", "token0", "secret0");
+  char *hdr = oauth_signer_sign_header(s, url, "POST", "api", 0);
+  char *sig = strstr(hdr, "oauth_signature=\"") + 17;
+  char *nonce = strstr(hdr, "oauth_nonce=\"") + 13;
+  char *ts = strstr(hdr, "oauth_timestamp=\"") + 17;
+  char signed_url[1024], *usig;
+  oauth_span sp[OAUTH_HEADER_MAX_PARAMS];
+  double t0, t1, t2, t3;
+  int i, r, ok = 0;
+
+  // the request with the nonce and timestamp of the header as query,
+  // the other protocol parameters are added again
+  snprintf(signed_url, sizeof(signed_url), "%s&oauth_nonce=%.*s&oauth_timestamp=%.*s", url,
+      (int) strcspn(nonce, "\""), nonce, (int) strcspn(ts, "\""), ts);
+  sig[strlen(sig) - 1] = '\0';
+  usig = oauth_url_unescape(sig, NULL);
+
+  t0 = now();
+  for (r=0; r < rounds; r++) {
+    for (i=0; i < n; i++) {
+      int argc;
+      char **argv = NULL;
+      argc = oauth_split_url_parameters(signed_url, &argv);
+      oauth_sign_array2_process(&argc, &argv, NULL, OA_HMAC, "POST",
+          "consumer", "consumer secret", "token0", "secret0");
+      ok += !strcmp(argv[argc-1] + 16, usig);
+      oauth_free_array(&argc, &argv);
+    }
+  }
+  t1 = now();
+  sig[strlen(sig)] = '"';
+  for (r=0; r < rounds; r++)
+    for (i=0; i < n; i++)
+      ok += oauth_verify_request(s, "POST", url, hdr, NULL, 0, 300) == OA_VERIFY_OK;
+  t2 = now();
+  for (r=0; r < rounds; r++)
+    for (i=0; i < n; i++)
+      ok += oauth_split_header(hdr, strlen(hdr), sp, OAUTH_HEADER_MAX_PARAMS) == 8;
+  t3 = now();
+
+  printf("verifying a request with an Authorization header (%d ok)\n", ok);
+  printf("oauth_sign_array2_process + strcmp: %8.3f us/request\n", (t1 - t0) * 1e6 / ((double) n * rounds));
+  printf("oauth_verify_request:               %8.3f us/request\n", (t2 - t1) * 1e6 / ((double) n * rounds));
+  printf("oauth_split_header alone:           %8.3f us/request\n", (t3 - t2) * 1e6 / ((double) n * rounds));
+
+  free(usig);
+  free(hdr);
+  oauth_signer_free(s);
+}
+
+/*
+ * oauth_sign_batch() with a distinct token per request at growing batch
+ * sizes; the time per request should not grow with the batch.
+ */
+static void bench_batch_distinct(int rounds) {
+  int sizes[] = { 1000, 8000, 32000 };
+  int s, i, r;
+
+  printf("oauth_sign_batch, one token per request\n");
+  for (s=0; s < 3; s++) {
+    int n = sizes[s];
+    int nr = rounds * 256 / n > 0 ? rounds * 256 / n : 1;
+    oauth_batch_request *reqs = (oauth_batch_request*) calloc(n, sizeof(oauth_batch_request));
+    char *tok = (char*) malloc(n * 32);
+    double t0, t1;
+    for (i=0; i < n; i++) {
+      snprintf(tok + 32*i, 16, "token%d", i);
+      snprintf(tok + 32*i + 16, 16, "secret%d", i);
+      reqs[i].url = "http://api.example.com/queue/1?status=done";
+      reqs[i].mode = OA_OUT_POSTARGS;
+      reqs[i].method = OA_HMAC;
+      reqs[i].c_key = "consumer";
+      reqs[i].c_secret = "consumer secret";
+      reqs[i].t_key = tok + 32*i;
+      reqs[i].t_secret = tok + 32*i + 16;
+    }
+    t0 = now();
+    for (r=0; r < nr; r++) free(oauth_sign_batch(reqs, n));
+    t1 = now();
+    printf("%6d requests: %8.3f us/request\n", n, (t1 - t0) * 1e6 / ((double) n * nr));
+    free(tok);
+    free(reqs);
+  }
+}
+
+/*
+ * the legacy oauth_sign_url2 polling a few endpoints, without and with
+ * the normalization cache.
+ */
+static void bench_cache(int n, int rounds) {
+  char url[4][160];
+  unsigned long hits, misses;
+  double t0, t1, t2;
+  int i, r;
+
+  for (i=0; i < 4; i++)
+    snprintf(url[i], sizeof(url[i]), "http://api.example.com/1.1/lists/%d/members.json"
+        "?count=200&include_entities=true&skip_status=true&cursor=-1&list_id=%d", i, 1000 + i);
+
+  t0 = now();
+  for (r=0; r < rounds; r++)
+    for (i=0; i < n; i++)
+      free(oauth_sign_url2(url[i % 4], NULL, OA_HMAC, NULL, "consumer", "consumer secret", "token0", "secret0"));
+  t1 = now();
+  oauth_sign_cache_size(16);
+  for (r=0; r < rounds; r++)
+    for (i=0; i < n; i++)
+      free(oauth_sign_url2(url[i % 4], NULL, OA_HMAC, NULL, "consumer", "consumer secret", "token0", "secret0"));
+  t2 = now();
+  oauth_sign_cache_stats(&hits, &misses);
+  oauth_sign_cache_size(0);
+
+  printf("oauth_sign_url2 polling 4 endpoints, URL output\n");
+  printf("uncached: %8.3f us/request\n", (t1 - t0) * 1e6 / ((double) n * rounds));
+  printf("cached:   %8.3f us/request (%lu hits, %lu misses)\n",
+      (t2 - t1) * 1e6 / ((double) n * rounds), hits, misses);
+}
+
+struct replay_job {
+  oauth_replay_cache *c;
+  long now;
+  int id, n;
+  int fresh;
+};
+
+static void *replay_worker(void *arg) {
+  struct replay_job *j = (struct replay_job*) arg;
+  char nonce[32];
+  int i;
+
+  for (i=0; i < j->n; i++) {
+    snprintf(nonce, sizeof(nonce), "n%d-%d", j->id, i);
+    // timestamps spread over the accepted window
+    j->fresh += oauth_replay_check(j->c, "consumer", "token0", nonce,
+        j->now - 300 + (i % 601), j->now) == OAUTH_REPLAY_FRESH;
+  }
+  return NULL;
+}
+
+/*
+ * claim and clear every table of the window once, so that the timed
+ * checks see the steady state rather than the first touch of the cache.
+ */
+static void replay_warm(oauth_replay_cache *c, long t) {
+  struct replay_job job = { c, t, -1, 601 * 64, 0 };
+  replay_worker(&job);
+}
+
+/*
+ * concurrent oauth_replay_check() with distinct nonces by 1..8 threads.
+ */
+static void bench_replay(int n, int rounds) {
+  struct replay_job job[8];
+  pthread_t tid[8];
+  long t = 1700000000;
+  int total = n * rounds * 4 < 1 << 20 ? 1 << 20 : n * rounds * 4;
+  int nt, i, fresh;
+
+  printf("oauth_replay_check, %d distinct requests, warm 64 MB cache\n", total);
+  for (nt=1; nt <= 8; nt *= 2) {
+    oauth_replay_cache *c = oauth_replay_cache_new(64 << 20, 300);
+    double t0, t1;
+    if (!c) {
+      printf("replay cache not supported\n");
+      return;
+    }
+    replay_warm(c, t);
+    t0 = now();
+    for (i=0; i < nt; i++) {
+      job[i].c = c;
+      job[i].now = t;
+      job[i].id = i;
+      job[i].n = total / nt;
+      job[i].fresh = 0;
+      pthread_create(&tid[i], NULL, replay_worker, &job[i]);
+    }
+    for (fresh=0, i=0; i < nt; i++) {
+      pthread_join(tid[i], NULL);
+      fresh += job[i].fresh;
+    }
+    t1 = now();
+    printf("%d thread%s: %8.3f Mops/s (%d fresh)\n", nt, nt > 1 ? "s" : " ",
+        (double) (total / nt) * nt / (t1 - t0) / 1e6, fresh);
+    oauth_replay_cache_free(c);
+  }
+}
+
+/*
+ * oauth_replay_check() with distinct nonces on a shared cache by 1..8
+ * forked workers, as in a prefork server.
+ */
+static void bench_replay_shared(int n, int rounds) {
+  int total = n * rounds * 4 < 1 << 20 ? 1 << 20 : n * rounds * 4;
+  int *fresh, nw, i, sum;
+
+  fresh = (int*) mmap(NULL, 8 * sizeof(int), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if (fresh == MAP_FAILED) return;
+  printf("oauth_replay_check, %d distinct requests, warm 64 MB shared cache\n", total);
+  for (nw=1; nw <= 8; nw *= 2) {
+    oauth_replay_cache *c = oauth_replay_cache_shared(NULL, 64 << 20, 300);
+    double t0, t1;
+    if (!c) {
+      printf("shared replay cache not supported\n");
+      break;
+    }
+    replay_warm(c, 1700000000);
+    t0 = now();
+    for (i=0; i < nw; i++) {
+      if (fork() == 0) {
+        struct replay_job job = { c, 1700000000, i, total / nw, 0 };
+        replay_worker(&job);
+        fresh[i] = job.fresh;
+        _exit(0);
+      }
+    }
+    for (i=0; i < nw; i++) wait(NULL);
+    t1 = now();
+    for (sum=0, i=0; i < nw; i++) sum += fresh[i];
+    printf("%d worker%s: %8.3f Mops/s (%d fresh)\n", nw, nw > 1 ? "s" : " ",
+        (double) (total / nw) * nw / (t1 - t0) / 1e6, sum);
+    oauth_replay_cache_free(c);
+  }
+  munmap(fresh, 8 * sizeof(int));
+}
+
+int main (int argc, char **argv) {
+  int n = argc > 1 ? atoi(argv[1]) : 256;
+  int rounds = argc > 2 ? atoi(argv[2]) : 100;
+  char tk[NUSERS][16], ts[NUSERS][16];
+  char **urls;
+  oauth_batch_request *reqs;
+  double t0, t1, t2;
+  int i, r;
+
+  if (n < 1 || rounds < 1) {
+    fprintf(stderr, "usage: %s [requests per batch] [rounds]\n", argv[0]);
+    return 1;
+  }
+
+  for (i=0; i < NUSERS; i++) {
+    snprintf(tk[i], sizeof(tk[i]), "token%d", i);
+    snprintf(ts[i], sizeof(ts[i]), "secret%d", i);
+  }
+  urls = (char**) malloc(n * sizeof(char*));
+  reqs = (oauth_batch_request*) calloc(n, sizeof(oauth_batch_request));
+  for (i=0; i < n; i++) {
+    urls[i] = (char*) malloc(128);
+    snprintf(urls[i], 128, "http://api.example.com/queue/%d?item=%d&status=done&note=a%%20b", i % 7, i);
+    reqs[i].url = urls[i];
+    reqs[i].mode = OA_OUT_POSTARGS;
+    reqs[i].method = OA_HMAC;
+    reqs[i].c_key = "consumer";
+    reqs[i].c_secret = "consumer secret";
+    reqs[i].t_key = tk[i % NUSERS];
+    reqs[i].t_secret = ts[i % NUSERS];
+  }
+
+  t0 = now();
+  for (r=0; r < rounds; r++) {
+    for (i=0; i < n; i++) {
+      char *postargs = NULL;
+      free(oauth_sign_url2(reqs[i].url, &postargs, OA_HMAC, NULL,
+            reqs[i].c_key, reqs[i].c_secret, reqs[i].t_key, reqs[i].t_secret));
+      free(postargs);
+    }
+  }
+  t1 = now();
+  for (r=0; r < rounds; r++) {
+    free(oauth_sign_batch(reqs, n));
+  }
+  t2 = now();
+
+  printf("requests: %d x %d, %d credential pairs\n", n, rounds, NUSERS);
+  printf("oauth_sign_url2:  %8.3f us/request\n", (t1 - t0) * 1e6 / ((double) n * rounds));
+  printf("oauth_sign_batch: %8.3f us/request\n", (t2 - t1) * 1e6 / ((double) n * rounds));
+
+  bench_batch_distinct(rounds);
+  bench_hmac(n, rounds);
+  bench_template(n, rounds);
+  bench_fanout(n, rounds);
+  bench_header(n, rounds);
+  bench_iov(n, rounds);
+  bench_verify(n, rounds);
+  bench_cache(n, rounds);
+  bench_replay(n, rounds);
+  bench_replay_shared(n, rounds);
+
+  for (i=0; i < n; i++) free(urls[i]);
+  free(urls);
+  free(reqs);
+  return 0;
+}
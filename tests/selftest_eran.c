@@ -55,6 +55,9 @@ int main (int argc, char **argv) {
   fail|=test_encoding("12303202302","12303202302");
   fail|=test_encoding("taken with a 30% orange filter","taken%20with%20a%2030%25%20orange%20filter");
   fail|=test_encoding("mountain & water view","mountain%20%26%20water%20view");
+  // not one of Eran's, but long enough for the vectorized code path
+  fail|=test_encoding("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-._~ mountain & water view/\xc3\xa9",
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-._~%20mountain%20%26%20water%20view%2F%C3%A9");
 
   fail|=test_request("GET", "http://example.com:80/photo" "?" 
       "oauth_version=1.0"
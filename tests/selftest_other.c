@@ -28,11 +28,55 @@
 #include <stdlib.h>
 #include <string.h>
 #include <oauth.h>
+#ifndef WIN32
+#include <sys/types.h>
+#include <signal.h>
+#include <sys/mman.h> // shm_unlink()
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#endif
 
 #include "commontest.h"
 
 int loglevel = 1; //< report each successful test
 
+#ifndef WIN32
+/*
+ * a stand-in for memcached: answers "add" commands on one connection
+ * from 'lfd' until it is closed.
+ */
+static void memcached_standin(int lfd) {
+  char buf[8192], keys[64][64], key[64], *e;
+  size_t len = 0;
+  int fd = accept(lfd, NULL, NULL), nkeys = 0, bytes, i;
+  ssize_t r;
+  while (fd >= 0 && (r = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0) {
+    len += r;
+    buf[len] = '\0';
+    // a complete command has its data line too
+    while ((e = strstr(buf, "\r\n")) && (e = strstr(e + 2, "\r\n"))) {
+      const char *reply = "ERROR\r\n";
+      if (sscanf(buf, "add %63s %*u %*d %d", key, &bytes) == 2) {
+        for (i=0; i < nkeys && strcmp(keys[i], key); i++) ;
+        if (i < nkeys) reply = "NOT_STORED\r\n";
+        else if (nkeys < 64) {
+          strcpy(keys[nkeys++], key);
+          reply = "STORED\r\n";
+        }
+      }
+      if (write(fd, reply, strlen(reply)) < 0) _exit(1);
+      len -= e + 2 - buf;
+      memmove(buf, e + 2, len);
+      buf[len] = '\0';
+    }
+  }
+  _exit(0);
+}
+#endif
+
 int main (int argc, char **argv) {
   int fail=0;
 
@@ -72,6 +116,53 @@ int main (int argc, char **argv) {
     fail|=1;
   }
 
+  if (loglevel) printf("\n *** Testing multi-buffer HMAC-SHA1.\n");
+  fail|=test_sha1_multi();
+
+  if (loglevel) printf("\n *** Testing base64 encoding.\n");
+  fail|=test_base64("", "");
+  fail|=test_base64("f", "Zg==");
+  fail|=test_base64("fo", "Zm8=");
+  fail|=test_base64("Hello World!", "SGVsbG8gV29ybGQh");
+  fail|=test_base64("Man is distinguished, not only by his reason, but by this singular passion",
+      "TWFuIGlzIGRpc3Rpbmd1aXNoZWQsIG5vdCBvbmx5IGJ5IGhpcyByZWFzb24sIGJ1dCBieSB0aGlzIHNpbmd1bGFyIHBhc3Npb24=");
+  {
+    unsigned char dec[16];
+    // non-canonical input is only accepted in the default mode
+    if (oauth_decode_base64_into("Zm9=", 4, dec, sizeof(dec), OAUTH_B64_STRICT) != -1) fail|=1;
+    if (oauth_decode_base64_into("Zm8", 3, dec, sizeof(dec), OAUTH_B64_STRICT) != -1) fail|=1;
+    if (oauth_decode_base64_into("Zg=A", 4, dec, sizeof(dec), OAUTH_B64_STRICT) != -1) fail|=1;
+    if (oauth_decode_base64_into("Zm 8=", 5, dec, sizeof(dec), 0) != 2 || memcmp(dec, "fo", 2)) fail|=1;
+  }
+
+  if (loglevel) printf("\n *** Testing url unescaping.\n");
+  {
+    char in[] = "a+b%20c%2x%\0%41%2B%e9~mountain%20%26%20water%20view%2";
+    const char out[] = "a b c%2x%\0A+\xe9~mountain & water view%2";
+    char buf[sizeof(in)];
+    size_t n = oauth_url_unescape_into(in, sizeof(in)-1, buf, OAUTH_UNESCAPE_PLUS);
+    if (n != sizeof(out)-1 || memcmp(buf, out, n)) fail|=1;
+    // in place, '+' kept
+    n = oauth_url_unescape_into(in, sizeof(in)-1, in, 0);
+    if (n != sizeof(out)-1 || in[1] != '+' || memcmp(in+2, out+2, n-2)) fail|=1;
+  }
+
+  if (loglevel) printf("\n *** Testing parameter spans.\n");
+  {
+    const char *q = "a=1&&b%20c=?d&e=x+y=z";
+    oauth_span sp[4];
+    char buf[8];
+    if (oauth_split_spans(q, strlen(q), 1, sp, 2) != 4
+        || oauth_split_spans(q, strlen(q), 1, sp, 4) != 4) fail|=1;
+    else if (sp[0].klen != 1 || sp[0].vlen != 1 || q[sp[0].voff] != '1' || sp[0].flags != OAUTH_SPAN_HAS_VALUE
+        || sp[1].flags != (OAUTH_SPAN_HAS_VALUE|OAUTH_SPAN_KEY_ESCAPED) || sp[1].vlen != 0
+        || sp[2].flags != 0 || sp[2].klen != 1 || sp[2].vlen != 0
+        || sp[3].flags != (OAUTH_SPAN_HAS_VALUE|OAUTH_SPAN_VALUE_ESCAPED) || sp[3].vlen != 5
+        || oauth_span_unescape(q + sp[1].koff, sp[1].klen, 1, buf) != 3 || memcmp(buf, "b c", 3)
+        || oauth_span_unescape(q + sp[3].voff, sp[3].vlen, 1, buf) != 5 || memcmp(buf, "x y=z", 5))
+      fail|=1;
+  }
+
   if (loglevel) printf("\n *** Testing PLAINTEXT signature.\n");
   fail |= test_sign_get(
       "http://host.net/resource" "?" "name=value&name=value"
@@ -83,6 +174,445 @@ int main (int argc, char **argv) {
       );
 
 
+  if (loglevel) printf("\n *** Testing parameter sets.\n");
+  {
+    const char *q = "name=value&name=value&oauth_nonce=fake&oauth_timestamp=1&oauth_signature=x";
+    oauth_params *p = oauth_params_new();
+    oauth_signer *s = oauth_signer_new(OA_PLAINTEXT, "abcd", "&", "1234", "&");
+    char buf[512];
+    size_t len;
+    int i;
+    if (oauth_params_add_query(p, q, strlen(q), 0) != 5 || oauth_params_add(p, "a b", 3, NULL, 0) != 5) fail|=1;
+    i = oauth_params_find(p, "a b");
+    if (i != 5 || oauth_params_value(p, i, NULL) || memcmp(oauth_params_key(p, i, &len), "a%20b", 5) || len != 5) fail|=1;
+    i = oauth_params_find(p, "oauth_nonce");
+    if (i != 2 || !oauth_params_is_oauth(p, i) || oauth_params_is_oauth(p, 0) || oauth_params_find(p, "none") != -1) fail|=1;
+    oauth_params_clear(p);
+    oauth_params_add_query(p, q, strlen(q), 0);
+    len = oauth_signer_sign_params_into(s, "http://host.net:80/resource", p, OA_OUT_URL, NULL, buf, sizeof(buf));
+    if (len >= sizeof(buf) || strcmp(buf, "http://host.net/resource?name=value&name=value&oauth_consumer_key=abcd&oauth_nonce=fake&oauth_signature_method=PLAINTEXT&oauth_timestamp=1&oauth_token=1234&oauth_version=1.0&oauth_signature=%2526%26%2526")) {
+      printf(" got '%s'\n", buf);
+      fail|=1;
+    } else if (loglevel) printf("parameter set signature ok.\n");
+    oauth_signer_free(s);
+    oauth_params_free(p);
+  }
+
+
+  if (loglevel) printf("\n *** Testing nonce generation.\n");
+  {
+    char *a, *b;
+    a = oauth_gen_nonce(); b = oauth_gen_nonce();
+    if (strlen(a) < 15 || strlen(a) > 30 || strspn(a, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_") != strlen(a) || !strcmp(a, b)) fail|=1;
+    free(a); free(b);
+    if (oauth_set_nonce_mode(OAUTH_NONCE_COUNTER) != OAUTH_NONCE_RANDOM) fail|=1;
+    a = oauth_gen_nonce(); b = oauth_gen_nonce();
+    if (strlen(a) != 23 || strlen(b) != 23 || memcmp(a, b, 12) || !strcmp(a, b)) fail|=1;
+    free(a); free(b);
+    if (oauth_set_nonce_mode(OAUTH_NONCE_RANDOM) != OAUTH_NONCE_COUNTER || oauth_set_nonce_mode(7) != -1) fail|=1;
+  }
+
+
+  if (loglevel) printf("\n *** Testing request templates.\n");
+  {
+    const char *url = "http://example.com/poll?z=1&a=b%20c&oauth_callback=oob";
+    oauth_signer *s = oauth_signer_new(OA_HMAC, "ck", "cs", "tk", "ts");
+    oauth_request_template *t = oauth_request_template_new(s, url, OA_OUT_URL, NULL);
+    oauth_hmac_sha1 *h = oauth_hmac_sha1_new("key", 3), *x = oauth_hmac_sha1_extend(h, "GET&http", 8);
+    unsigned char d1[20], d2[20];
+    char *o = oauth_request_template_sign(t), *n, *ts, *e;
+    char url2[256], buf[512];
+    // the template result is reproduced with its nonce and timestamp as given parameters
+    if (!o || !(n = strstr(o, "oauth_nonce=")) || !(ts = strstr(o, "oauth_timestamp="))) fail|=1;
+    else {
+      n += 12; ts += 16;
+      e = strchr(n, '&'); *e = '\0';
+      snprintf(url2, sizeof(url2), "%s&oauth_nonce=%s&oauth_timestamp=%.10s", url, n, ts);
+      *e = '&';
+      oauth_signer_sign_url_into(s, url2, OA_OUT_URL, NULL, buf, sizeof(buf));
+      if (strcmp(o, buf)) {
+        printf(" got '%s'\n expected: '%s'\n", o, buf);
+        fail|=1;
+      } else if (loglevel) printf("request template signature ok.\n");
+    }
+    oauth_hmac_sha1_digest(h, "GET&http%3A", 11, d1);
+    oauth_hmac_sha1_digest(x, "%3A", 3, d2);
+    if (memcmp(d1, d2, 20)) fail|=1;
+    free(o);
+    oauth_hmac_sha1_free(x);
+    oauth_hmac_sha1_free(h);
+    oauth_request_template_free(t);
+    oauth_signer_free(s);
+  }
+
+
+  if (loglevel) printf("\n *** Testing array signing.\n");
+  {
+    // the base URL is used verbatim, as by oauth_sign_array2()
+    const char *base[2] = { "http://example.com:80/p", "http://example.com" };
+    oauth_signer *s = oauth_signer_new(OA_HMAC, "ck", "cs", "tk", "ts");
+    char buf[512];
+    int i, j, f = 0;
+    for (i=0; i < 2; i++) {
+      char *av[4] = { (char*) base[i], "a=1 2", "oauth_nonce=n", "oauth_timestamp=1" };
+      char **lv = (char**) malloc(4 * sizeof(char*));
+      int lc = 4;
+      size_t len = oauth_signer_sign_array_into(s, 4, av, OA_OUT_URL, NULL, buf, sizeof(buf));
+      char *legacy;
+      for (j=0; j < 4; j++) lv[j] = strdup(av[j]);
+      legacy = oauth_sign_array2(&lc, &lv, NULL, OA_HMAC, NULL, "ck", "cs", "tk", "ts");
+      if (!len || len >= sizeof(buf) || !legacy || strcmp(buf, legacy)) {
+        printf(" got '%s'\n expected: '%s'\n", buf, legacy);
+        f|=1;
+      }
+      free(legacy);
+      oauth_free_array(&lc, &lv);
+    }
+    oauth_signer_free(s);
+    if (f) fail|=1;
+    else if (loglevel) printf("array signature ok.\n");
+  }
+
+
+  if (loglevel) printf("\n *** Testing fan-out signing.\n");
+  {
+    oauth_fanout_token tk[3] = { { "a b", "s1", NULL }, { NULL, "s2", NULL }, { "c", NULL, NULL } };
+    char *blk = oauth_sign_fanout("http://example.com/post?x=1", OA_OUT_POSTARGS, OA_PLAINTEXT,
+        NULL, "ck", "cs", tk, 3);
+    if (!blk || tk[1].result || !tk[0].result || !tk[2].result
+        || !strstr(tk[0].result, "&oauth_token=a%20b&") || !strstr(tk[0].result, "&oauth_signature=cs%26s1")
+        || !strstr(tk[2].result, "&oauth_token=c&") || !strstr(tk[2].result, "&oauth_signature=cs%26")
+        || strncmp(tk[2].result, "oauth_consumer_key=ck&oauth_nonce=", 34) || !strstr(tk[2].result, "&x=1&"))
+      fail|=1;
+    else if (loglevel) printf("fan-out signatures ok.\n");
+    free(blk);
+  }
+  {
+    // HMAC-SHA1 in two full multi-buffer groups and a remainder
+    const char *url = "http://example.com/post?x=1&y=a%20b";
+    oauth_fanout_token tk[37];
+    char key[37][16], sec[37][16], u[256];
+    char *blk;
+    int i, f = 0;
+    for (i=0; i < 37; i++) {
+      snprintf(key[i], sizeof(key[i]), i % 2 ? "t %d" : "t%d", i);
+      snprintf(sec[i], sizeof(sec[i]), "s&%d /", i);
+      tk[i].t_key = key[i];
+      tk[i].t_secret = i % 3 ? sec[i] : NULL;
+    }
+    blk = oauth_sign_fanout(url, OA_OUT_POSTARGS, OA_HMAC, NULL, "ck", "c s", tk, 37);
+    for (i=0; i < 37; i++) {
+      // the legacy call with the nonce and timestamp of the result
+      const char *nv = tk[i].result ? strstr(tk[i].result, "&oauth_nonce=") : NULL;
+      const char *tv = tk[i].result ? strstr(tk[i].result, "&oauth_timestamp=") : NULL;
+      char *pa = NULL;
+      if (!nv || !tv) {
+        f|=1;
+        break;
+      }
+      snprintf(u, sizeof(u), "%s%.*s%.*s", url, (int) strcspn(nv + 1, "&") + 1, nv,
+          (int) strcspn(tv + 1, "&") + 1, tv);
+      free(oauth_sign_url2(u, &pa, OA_HMAC, NULL, "ck", "c s", tk[i].t_key, tk[i].t_secret));
+      if (!pa || strcmp(pa, tk[i].result)) {
+        printf(" token %d: got '%s'\n expected: '%s'\n", i, tk[i].result, pa);
+        f|=1;
+      }
+      free(pa);
+    }
+    if (f) fail|=1;
+    else if (loglevel) printf("HMAC-SHA1 fan-out signatures ok.\n");
+    free(blk);
+  }
+  {
+    // a key without value is escaped the same way by every entry point
+    const char *url = "http://example.com/post?a%20b&c=1";
+    oauth_fanout_token tk = { "tk", "ts", NULL };
+    char u[256], buf[512], *pa = NULL;
+    char *blk = oauth_sign_fanout(url, OA_OUT_POSTARGS, OA_HMAC, NULL, "ck", "cs", &tk, 1);
+    const char *nv = tk.result ? strstr(tk.result, "&oauth_nonce=") : NULL;
+    const char *tv = tk.result ? strstr(tk.result, "&oauth_timestamp=") : NULL;
+    size_t len = 0;
+    if (nv && tv) {
+      snprintf(u, sizeof(u), "%s%.*s%.*s", url, (int) strcspn(nv + 1, "&") + 1, nv,
+          (int) strcspn(tv + 1, "&") + 1, tv);
+      free(oauth_sign_url2(u, &pa, OA_HMAC, NULL, "ck", "cs", "tk", "ts"));
+      len = oauth_sign_url2_into(u, OA_OUT_POSTARGS, OA_HMAC, NULL, "ck", "cs", "tk", "ts", buf, sizeof(buf));
+    }
+    if (!pa || !len || len >= sizeof(buf) || strncmp(pa, "a%20b=&c=1&", 11)
+        || strcmp(pa, buf) || strcmp(pa, tk.result)) {
+      printf(" got '%s'\n and '%s'\n expected: '%s'\n", pa, len ? buf : "", tk.result);
+      fail|=1;
+    } else if (loglevel) printf("keys without value ok.\n");
+    free(pa);
+    free(blk);
+  }
+
+
+  if (loglevel) printf("\n *** Testing Authorization headers.\n");
+  {
+    oauth_signer *s = oauth_signer_new(OA_PLAINTEXT, "ck", "cs", "tk", "ts");
+    const char *exp = "Authorization: OAuth realm=\"x\\\"y\", oauth_consumer_key=\"ck\", "
+      "oauth_nonce=\"n\", oauth_signature_method=\"PLAINTEXT\", oauth_timestamp=\"1\", "
+      "oauth_token=\"tk\", oauth_version=\"1.0\", oauth_signature=\"cs%26ts\"";
+    char *h = oauth_signer_sign_header(s, "http://example.com/p?a=1&oauth_nonce=n&oauth_timestamp=1",
+        "POST", "x\"y", OAUTH_HEADER_NAME);
+    if (!h || strcmp(h, exp)) {
+      printf(" got '%s'\n expected: '%s'\n", h, exp);
+      fail|=1;
+    } else if (loglevel) printf("Authorization header ok.\n");
+    free(h);
+    oauth_signer_free(s);
+  }
+
+
+  if (loglevel) printf("\n *** Testing Authorization header parsing.\n");
+  {
+    char h[] = "OAuth realm=\"a\\\"b\", oauth_consumer_key=\"c%20k\",oauth_nonce=\"n\"";
+    const char *bad[6] = { "Basic x=\"1\"", "OAuth a=\"1\",", "OAuth a=\"1\", a=\"2\"",
+      "OAuth a=1", "OAuth a=\"1\",,b=\"2\"", "OAuth a=\"1" };
+    oauth_span sp[4];
+    size_t l;
+    int i, f = 0, n = oauth_split_header(h, strlen(h), sp, 4);
+    if (n != 3 || sp[0].klen != 5 || strncmp(h + sp[0].koff, "realm", 5)
+        || sp[1].vlen != 5 || !(sp[1].flags & OAUTH_SPAN_VALUE_ESCAPED)
+        || (sp[2].flags & OAUTH_SPAN_VALUE_ESCAPED) || strncmp(h + sp[2].voff, "n\"", 2)) {
+      printf(" parsed %d parameters\n", n);
+      f|=1;
+    }
+    // decode in place
+    l = n < 2 ? 0 : oauth_header_unescape(h + sp[0].voff, sp[0].vlen, h + sp[0].voff);
+    if (l != 3 || strncmp(h + sp[0].voff, "a\"b", 3)) f|=1;
+    l = n < 2 ? 0 : oauth_header_unescape(h + sp[1].voff, sp[1].vlen, h + sp[1].voff);
+    if (l != 3 || strncmp(h + sp[1].voff, "c k", 3)) f|=1;
+    for (i=0; i < 6; i++) {
+      if (oauth_split_header(bad[i], strlen(bad[i]), sp, 4) != -1) {
+        printf(" accepted '%s'\n", bad[i]);
+        f|=1;
+      }
+    }
+    if (f) fail|=1;
+    else if (loglevel) printf("Authorization header parsing ok.\n");
+  }
+
+
+  if (loglevel) printf("\n *** Testing request verification.\n");
+  {
+    oauth_signer *s = oauth_signer_new(OA_HMAC, "c k", "cs", "tk", "ts");
+    oauth_signer *o = oauth_signer_new(OA_HMAC, "c k", "cs", "other", "ts");
+    oauth_signer *p = oauth_signer_new(OA_PLAINTEXT, "c k", "cs", "tk", "ts");
+    const char *url = "http://example.com/p?a=1&b=x+y";
+    const OAuthVerifyStatus exp[8] = { OA_VERIFY_OK, OA_VERIFY_BAD_SIGNATURE, OA_VERIFY_KEY,
+      OA_VERIFY_STALE, OA_VERIFY_OK, OA_VERIFY_MALFORMED, OA_VERIFY_MISSING, OA_VERIFY_METHOD };
+    OAuthVerifyStatus st[8];
+    char *h = oauth_signer_sign_header(s, url, "POST", "r", OAUTH_HEADER_NAME), *ph;
+    char body[512];
+    int i;
+    st[0] = oauth_verify_request(s, "POST", url, h, NULL, 0, 300);
+    st[1] = oauth_verify_request(s, "GET", url, h, NULL, 0, 300);
+    st[2] = oauth_verify_request(o, "POST", url, h, NULL, 0, 300);
+    // a form body with an old timestamp
+    oauth_signer_sign_url_into(s, "http://example.com/p?a=1&oauth_timestamp=1000",
+        OA_OUT_POSTARGS, NULL, body, sizeof(body));
+    st[3] = oauth_verify_request(s, NULL, "http://example.com/p", NULL, body, strlen(body), 300);
+    st[4] = oauth_verify_request(s, NULL, "http://example.com/p", NULL, body, strlen(body), 0);
+    st[5] = oauth_verify_request(s, "POST", "http://example.com/p?a=1&b=x+y&oauth_token=tk", h, NULL, 0, 300);
+    st[6] = oauth_verify_request(s, "POST", url, NULL, NULL, 0, 300);
+    ph = oauth_signer_sign_header(p, url, "POST", NULL, 0);
+    st[7] = oauth_verify_request(s, "POST", url, ph, NULL, 0, 300);
+    for (i=0; i < 8; i++) {
+      if (st[i] != exp[i]) {
+        printf(" verification %d: got %d expected: %d\n", i, st[i], exp[i]);
+        fail|=1;
+      }
+    }
+    if (oauth_verify_request(p, "POST", url, ph, NULL, 0, 300) != OA_VERIFY_OK) fail|=1;
+    else if (loglevel) printf("request verification ok.\n");
+    free(h);
+    free(ph);
+    oauth_signer_free(s);
+    oauth_signer_free(o);
+    oauth_signer_free(p);
+  }
+
+
+  if (loglevel) printf("\n *** Testing the replay cache.\n");
+  {
+    oauth_replay_cache *c = oauth_replay_cache_new(0, 300);
+    const long now = 1000000;
+    int i, full = 0, f = 0;
+    char nonce[16];
+    if (c) {
+      if (oauth_replay_check(c, "ck", "tk", "n1", now, now) != OAUTH_REPLAY_FRESH
+          || oauth_replay_check(c, "ck", "tk", "n1", now, now + 10) != OAUTH_REPLAY_SEEN
+          || oauth_replay_check(c, "ck", "tk", "n1", now + 1, now) != OAUTH_REPLAY_FRESH
+          || oauth_replay_check(c, "ck", NULL, "n1", now, now) != OAUTH_REPLAY_FRESH
+          || oauth_replay_check(c, "ck", "", "n1", now, now) != OAUTH_REPLAY_SEEN
+          || oauth_replay_check(c, "ck", "tk", "n2", now - 301, now) != OAUTH_REPLAY_STALE)
+        f|=1;
+      // once its timestamp is out of the window, the bucket is reused
+      if (oauth_replay_check(c, "ck", "tk", "n1", now, now + 301) != OAUTH_REPLAY_STALE
+          || oauth_replay_check(c, "ck", "tk", "n1", now + 640, now + 640) != OAUTH_REPLAY_FRESH)
+        f|=1;
+      // the smallest cache has 128 slots per bucket, probing gives up on a few more
+      for (i=0; i < 200; i++) {
+        snprintf(nonce, sizeof(nonce), "x%d", i);
+        switch (oauth_replay_check(c, "ck", "tk", nonce, now + 20, now)) {
+          case OAUTH_REPLAY_FULL: full++; break;
+          case OAUTH_REPLAY_FRESH: break;
+          default: f|=1;
+        }
+      }
+      if (full < 72 || full > 100) f|=1;
+      oauth_replay_cache_free(c);
+      if (f) fail|=1;
+      else if (loglevel) printf("replay cache ok.\n");
+    }
+  }
+
+#ifndef WIN32
+  if (loglevel) printf("\n *** Testing the shared replay cache.\n");
+  {
+    oauth_replay_cache *c = oauth_replay_cache_shared(NULL, 0, 300), *a, *b;
+    const long now = 1000000;
+    char name[64];
+    int f = 0, st = -1;
+    pid_t pid;
+    if (c) {
+      // a tuple recorded by a forked worker is a replay for the parent
+      if ((pid = fork()) == 0)
+        _exit(oauth_replay_check(c, "ck", "tk", "n1", now, now));
+      if (pid < 0 || waitpid(pid, &st, 0) != pid || !WIFEXITED(st)
+          || WEXITSTATUS(st) != OAUTH_REPLAY_FRESH
+          || oauth_replay_check(c, "ck", "tk", "n1", now, now) != OAUTH_REPLAY_SEEN)
+        f|=1;
+      oauth_replay_cache_free(c);
+      // a named cache is attached to with its own key and size, but the same window
+      snprintf(name, sizeof(name), "/liboauth-selftest-%d", (int) getpid());
+      a = oauth_replay_cache_shared(name, 0, 300);
+      b = oauth_replay_cache_shared(name, 1 << 20, 300);
+      if (!a || !b || oauth_replay_cache_shared(name, 0, 60)
+          || oauth_replay_check(a, "ck", NULL, "n2", now, now) != OAUTH_REPLAY_FRESH
+          || oauth_replay_check(b, "ck", NULL, "n2", now, now) != OAUTH_REPLAY_SEEN)
+        f|=1;
+      oauth_replay_cache_free(a);
+      oauth_replay_cache_free(b);
+      shm_unlink(name);
+      if (f) fail|=1;
+      else if (loglevel) printf("shared replay cache ok.\n");
+    }
+  }
+#endif
+
+#ifndef WIN32
+  if (loglevel) printf("\n *** Testing the memcached nonce store.\n");
+  {
+    struct sockaddr_in sa;
+    socklen_t sl = sizeof(sa);
+    const long now = 1000000;
+    oauth_nonce n[4] = {
+      { "ck", "tk", "a", now }, { "ck", "tk", "b", now },
+      { "ck", "tk", "a", now }, { "ck", NULL, "c", now - 1000 } };
+    oauth_nonce_store *st;
+    char port[16];
+    int res[4], f = 0, lfd;
+    pid_t pid = -1;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((lfd = socket(AF_INET, SOCK_STREAM, 0)) < 0 || bind(lfd, (struct sockaddr*) &sa, sizeof(sa))
+        || listen(lfd, 1) || getsockname(lfd, (struct sockaddr*) &sa, &sl)
+        || (pid = fork()) < 0)
+      f|=1;
+    else if (pid == 0) memcached_standin(lfd);
+    if (lfd >= 0) close(lfd);
+    snprintf(port, sizeof(port), "%d", ntohs(sa.sin_port));
+    st = oauth_nonce_store_memcached("127.0.0.1", port, 300, 1000,
+        oauth_nonce_store_local(oauth_replay_cache_new(0, 300)));
+    // one pipelined batch, a repeat within it and a stale timestamp
+    if (f || oauth_nonce_store_check(st, n, res, 4, now)
+        || res[0] != OAUTH_REPLAY_FRESH || res[1] != OAUTH_REPLAY_FRESH
+        || res[2] != OAUTH_REPLAY_SEEN || res[3] != OAUTH_REPLAY_STALE)
+      f|=1;
+    // the connection is kept, and replays are seen across batches
+    if (oauth_nonce_store_check(st, n + 1, res, 1, now) || res[0] != OAUTH_REPLAY_SEEN)
+      f|=1;
+    // without the server the local fallback takes over
+    if (pid > 0) {
+      kill(pid, SIGTERM);
+      waitpid(pid, NULL, 0);
+    }
+    n[3].timestamp = now;
+    if (oauth_nonce_store_check(st, n + 3, res, 1, now) || res[0] != OAUTH_REPLAY_FRESH
+        || oauth_nonce_store_check(st, n + 3, res, 1, now) || res[0] != OAUTH_REPLAY_SEEN)
+      f|=1;
+    oauth_nonce_store_free(st);
+    // nothing to fall back to
+    st = oauth_nonce_store_memcached("127.0.0.1", port, 300, 1000, NULL);
+    if (oauth_nonce_store_check(st, n, res, 1, now) != -1 || res[0] != -1)
+      f|=1;
+    oauth_nonce_store_free(st);
+    if (f) fail|=1;
+    else if (loglevel) printf("memcached nonce store ok.\n");
+  }
+#endif
+
+  if (loglevel) printf("\n *** Testing scatter/gather output.\n");
+  {
+    oauth_signer *s = oauth_signer_new(OA_HMAC, "ck", "cs", "tk", "ts");
+    const char *body = "a=1&b=x y&c=3";
+    oauth_iovec iov[8];
+    int cnt = 8;
+    char buf[512];
+    size_t len = oauth_signer_sign_iov(s, "http://example.com/post", body, strlen(body),
+        OA_OUT_POSTARGS, NULL, iov, &cnt, buf, sizeof(buf));
+    // "a=1" and "&c=3" are sent from the body, "&b=x%20y" and the oauth parameters from buf
+    if (!len || len >= sizeof(buf) || cnt != 4
+        || iov[0].iov_base != (void*) body || iov[0].iov_len != 3
+        || iov[1].iov_len != 8 || memcmp(iov[1].iov_base, "&b=x%20y", 8)
+        || iov[2].iov_base != (void*) (body + 9) || iov[2].iov_len != 4
+        || strncmp(iov[3].iov_base, "&oauth_consumer_key=ck&oauth_nonce=", 35)) {
+      printf(" scatter/gather output failed (%d segments)\n", cnt);
+      fail|=1;
+    } else if (loglevel) printf("scatter/gather output ok.\n");
+    oauth_signer_free(s);
+  }
+
+
+  if (loglevel) printf("\n *** Testing the normalization cache.\n");
+  if (oauth_sign_cache_size(8) == 0) {
+    // the last request brings its own token and is not cached
+    const char *url[5] = {
+      "http://example.com/get?b=2&a=1&oauth_nonce=n&oauth_timestamp=1",
+      "http://example.com/get?a%20b&c=1&oauth_nonce=n&oauth_timestamp=1",
+      "http://example.com/get?a%2Fb&oauth_nonce=n&oauth_timestamp=1",
+      "http://example.com/get?cb=http%3A%2F%2Fx%2F%3Foauth_token%3D1&oauth_nonce=n&oauth_timestamp=1",
+      "http://example.com/get?oauth%5Ftoken=x&oauth_nonce=n&oauth_timestamp=1" };
+    const char *ck[2] = { "ck", "c k" };
+    unsigned long hits, misses, h0, m0;
+    char *pa[3], *rv[3];
+    int i, u;
+    for (u=0; u < 5; u++) {
+      oauth_sign_cache_size(8);
+      oauth_sign_cache_stats(&h0, &m0);
+      // a miss, a hit with other credentials, and the uncached result for the latter
+      for (i=0; i < 3; i++) {
+        if (i == 2) oauth_sign_cache_size(0);
+        rv[i] = oauth_sign_url2(url[u], &pa[i], OA_HMAC, NULL, ck[i>0], "cs", "tk", "ts");
+        if (i == 1) oauth_sign_cache_stats(&hits, &misses);
+      }
+      if (hits - h0 != (u < 4) || misses - m0 != 1 || strcmp(rv[1], rv[2]) || strcmp(pa[1], pa[2])
+          || !strcmp(pa[0], pa[1]) || strcmp(rv[1], "http://example.com/get")) {
+        printf(" %s:\n got '%s'\n expected: '%s'\n", url[u], pa[1], pa[2]);
+        fail|=1;
+      } else if (loglevel) printf("cached signature %d ok.\n", u);
+      for (i=0; i < 3; i++) {
+        free(pa[i]);
+        free(rv[i]);
+      }
+    }
+  }
+
   // report
   if (fail) {
     printf("\n !!! One or more test cases failed.\n\n");